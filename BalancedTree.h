@@ -0,0 +1,102 @@
+/******************************************************************************
+ * File: BalancedTree.h
+ *
+ * An order statistics set whose balancing rule is a compile-time policy, one
+ * of those in Balancing.h: RedBlackBalancing, AvlBalancing, or WavlBalancing.
+ *
+ * Every policy runs over the same TreeCore as RedBlackTree, with the same node
+ * layout, the same augmentation (subtree sizes and, optionally, one of the
+ * summaries in SubtreeSummary.h), and the same chunked node storage, so
+ * comparing two BalancedTrees compares their balancing rules and nothing else.
+ * These trees are sets: duplicate keys are rejected.
+ */
+#pragma once
+
+#include "Balancing.h"
+#include <cstddef>
+#include <stdexcept>
+
+template <typename Balancing, typename Summary = SizeOnly>
+class BalancedTree: private TreeCore<typename Balancing::Balance, Summary> {
+public:
+  BalancedTree() = default;
+
+  /**
+   * These behave exactly like their RedBlackTree counterparts.
+   */
+  bool contains(int key) const {
+    return this->find(key) != nullptr;
+  }
+  bool        insert(int key);
+  bool        erase(int key);
+  std::size_t rankOf(int key) const {
+    return Core::rankOf(key);
+  }
+  int         select(std::size_t rank) const;
+  std::size_t getSize() const {
+    return this->root? this->root->numTotal : 0;
+  }
+  Summary     summary() const {
+    return Core::summaryOf(this->root);
+  }
+
+  /**
+   * Statistics for comparing balancing rules: the number of nodes on the
+   * longest path from the root to a leaf, and the number of rotations done
+   * since the tree was created.
+   */
+  std::size_t height() const {
+    return Core::height();
+  }
+  std::size_t numRotations() const {
+    return this->rotations;
+  }
+
+  /**
+   * For testing and debugging purposes, confirms that the tree obeys its
+   * balancing rule and that the keys, sizes, summaries, and parent pointers
+   * are all right, throwing a std::runtime_error if anything is wrong.
+   */
+  void checkInvariants() const {
+    this->checkStructure();
+    Balancing::checkBalance(this->root);
+  }
+
+private:
+  using Core = TreeCore<typename Balancing::Balance, Summary>;
+  using Node = typename Core::Node;
+  using Path = typename Core::Path;
+};
+
+/* * * * * Implementation Below This Point * * * * */
+
+template <typename Balancing, typename Summary>
+bool BalancedTree<Balancing, Summary>::insert(int key) {
+  Path path;
+  Node* node = this->insertKey(key, false, path);
+  if (node == nullptr) return false;
+
+  Balancing::insertFixup(static_cast<Core&>(*this), node, path);
+  return true;
+}
+
+template <typename Balancing, typename Summary>
+bool BalancedTree<Balancing, Summary>::erase(int key) {
+  Path path;
+  Node* node = this->findPath(key, path);
+  if (node == nullptr) return false;
+
+  Node* child;
+  Node* removed = this->removeNode(node, path, child);
+  Balancing::eraseFixup(static_cast<Core&>(*this), removed, child, path);
+  this->releaseNode(removed);
+  return true;
+}
+
+template <typename Balancing, typename Summary>
+int BalancedTree<Balancing, Summary>::select(std::size_t rank) const {
+  if (rank >= getSize()) {
+    throw std::runtime_error("BalancedTree::select(): rank out of range.");
+  }
+  return Core::select(rank);
+}
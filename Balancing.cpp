@@ -0,0 +1,479 @@
+#include "Balancing.h"
+#include <stdexcept>
+using namespace std;
+
+namespace {
+  /* Returns the number of black nodes on every path from the given node down
+   * to a null, counting the null, or throws if the paths don't agree or a red
+   * node has a red child.
+   */
+  template <typename Node> size_t blackHeightOf(const Node* node) {
+    using Color = RedBlackBalancing::Color;
+    if (node == nullptr) return 1;
+
+    auto isRed = [](const Node* n) {
+      return n != nullptr && n->balance == Color::RED;
+    };
+    if (isRed(node) && (isRed(node->left) || isRed(node->right))) {
+      throw runtime_error("A red node in a red/black tree has a red child.");
+    }
+
+    size_t left  = blackHeightOf(node->left);
+    size_t right = blackHeightOf(node->right);
+    if (left != right) {
+      throw runtime_error("Paths through a red/black tree pass through different numbers of black nodes.");
+    }
+    return left + (node->balance == Color::BLACK? 1 : 0);
+  }
+
+  /* Checks that every rank difference in the subtree is allowed, given the
+   * largest difference allowed. Under the AVL rule, a node also has to be
+   * 1,1 or 1,2, which is the same as its rank being its height.
+   */
+  template <typename Node> void checkRanks(const Node* node, int maxDifference, bool isAvl) {
+    if (node == nullptr) return;
+
+    int left  = node->balance - AvlBalancing::rankOf(node->left);
+    int right = node->balance - AvlBalancing::rankOf(node->right);
+    if (left < 1 || right < 1 || left > maxDifference || right > maxDifference ||
+        (isAvl && left != 1 && right != 1)) {
+      throw runtime_error(string(isAvl? "An AVL" : "A WAVL") + " tree node has a bad rank difference.");
+    }
+    if (!isAvl && node->left == nullptr && node->right == nullptr && node->balance != 0) {
+      throw runtime_error("A leaf in a WAVL tree doesn't have rank 0.");
+    }
+
+    checkRanks(node->left,  maxDifference, isAvl);
+    checkRanks(node->right, maxDifference, isAvl);
+  }
+}
+
+/* * * * * Red/Black * * * * */
+
+/* Applies the fixup rules to restore the red/black tree invariants. The path
+ * holds the node's ancestors, which is how we find our way back up the tree.
+ */
+template <typename Core>
+void RedBlackBalancing::insertFixup(Core& core, typename Core::Node* node, typename Core::Path& path) {
+  using Node = typename Core::Node;
+  while (true) {
+    /* If the node is the root, then there's nothing to do. */
+    if (path.depth == 0) break;
+
+    /* For simplicity, get pointers to our parent, sibling, aunt, and grandparent.
+     * These are the nodes marked in this diagram:
+     *
+     *           G
+     *          / \
+     *         P   A
+     *        / \
+     *       N   S
+     *
+     * Here, N is the node itself.
+     */
+    Node* parent = path.up(1);
+    Node* grandparent = path.up(2);
+
+    /* The SIBLING of a node is the other child of its parent. Its AUNT is its
+     * parent's sibling.
+     */
+    Node* sibling = siblingOf(node, parent);
+    Node* aunt    = siblingOf(parent, grandparent);
+
+    /* If the parent corresponds to a node with one key in the 2-3-4 tree (that
+     * is, the parent is a black node), then via the isometry we add ourselves
+     * to that node by coloring ourselves red. At that point, we're done.
+     *
+     * To see if our parent corresponds to a node with one key in the 2-3-4
+     * tree, we need to check that
+     *
+     *   1. the parent is black (if it's red, we're in part of a larger node), and
+     *   2. the parent has no red children (if it does, then it's part of a larger
+     *      node).
+     *
+     * To do this, we'll find our sibling node (the node across from us under our
+     * parent) and confirm that it's not red.
+     */
+    if (parent->balance == Color::BLACK && (sibling == nullptr || sibling->balance == Color::BLACK)) {
+      //cout << "Insert into 2-node." << endl;
+      node->balance = Color::RED;
+      break;
+    }
+
+    /* If the parent is part of a node with two keys in the 2-3-4 tree, add
+     * ourselves to that node. There are several cases to consider here, and
+     * they're all symmetric. A node with two keys has one of these shapes,
+     * with all possible insertion points marked with an I:
+     *
+     *          B              B
+     *         / \            / \
+     *        R   I          I   R
+     *       / \                / \
+     *      I   I              I   I
+     *
+     * The commonality is that we would be in one of two cases:
+     *
+     *    1. We have a black parent and a red sibling.
+     *    2. We have a red parent and a black aunt.
+     *
+     * These two cases function differently. If we're in case 1, we just color
+     * ourselves red:
+     *
+     *         B             B
+     *        / \    -->    / \
+     *       N   R         R   R
+     *
+     * Fun fact - this subcase of inserting into a 3-node can be combined with
+     * the logic for inserting into a 2-node. Do you see why?
+     */
+    if (parent->balance == Color::BLACK && sibling != nullptr && sibling->balance == Color::RED) {
+      //cout << "Insert into 3-node, black parent." << endl;
+      node->balance = Color::RED;
+      break;
+    }
+
+    /* That takes us to the second option. */
+    if (parent->balance == Color::RED && (aunt == nullptr || aunt->balance == Color::BLACK)) {
+      /* There are two subcases here, which correspond to the relative ordering
+       * at which the node to insert appears relative to the two other nodes in
+       * the 3-node. The first option is the "zig zag" case:
+       *
+       *       B                   B                   N                B
+       *      / \                 / \                 / \              / \
+       *     R   B   --->        N   B    --->       R   B    --->    R   R
+       *      \     rotate      /        rotate           \  recolor       \
+       *       N   N with R    R        N with B           B                B
+       *
+       * To see whether we're in this case, we have to see whether the orientation
+       * of the parent/child and grandparent/parent relations are reversed.
+       */
+      if ((node == parent->left) != (parent == grandparent->left)) {
+        //cout << "Insert into 3-node, zig-zag." << endl;
+        core.rotateUp(node, parent, grandparent);
+        core.rotateUp(node, grandparent, path.up(3));
+        grandparent->balance = Color::RED;
+      }
+
+      /* The other option is the "zig-zig" case:
+       *
+       *      B               R                  B
+       *     / \             / \                / \
+       *    R   B   --->    N   B      --->    R   R
+       *   /       rotate        \    recolor       \
+       *  N       R with B        B                  B
+       */
+      else {
+        //cout << "Insert into 3-node, zig-zig." << endl;
+        core.rotateUp(parent, grandparent, path.up(3));
+        parent->balance      = Color::BLACK;
+        node->balance        = Color::RED;
+        grandparent->balance = Color::RED;
+      }
+
+      /* Both cases are terminal; we've inserted into a 3-node. */
+      break;
+    }
+
+    /* Otherwise, we are inserting into a 4-node. There are several orientations
+     * possible here, but with mirroring excluded there are basically two unique
+     * insertion points
+     *
+     *          B              B
+     *        /   \          /   \
+     *       R     R        R     R
+     *      /                \
+     *     I                  I
+     *
+     * We are splitting a node with four keys into a node with two keys, a node
+     * with one key, and then kicking one key higher up. This can be done purely
+     * by recoloring the nodes and continuing the search from a starred node that
+     * is colored black beforehand:
+     *
+     *          B              B
+     *        /   \          /   \
+     *       R     R        R     R
+     *      /                \
+     *     I                  I
+     *         vvv            vvvv
+     *
+     *          *              *
+     *        /   \          /   \
+     *       B     B        B     B
+     *      /                \
+     *     R                  R
+     *
+     * In other words, we just flip the colors of the nodes and propagate the
+     * search upward from the grandparent.
+     */
+    //cout << "Insert into 4-node, zig-zag." << endl;
+    parent->balance = Color::BLACK;
+    aunt->balance   = Color::BLACK;
+    node->balance   = Color::RED;
+
+    node = grandparent;
+    path.depth -= 2;
+  }
+}
+
+/* Removing a red node never breaks the red/black properties. Removing a black
+ * node leaves its side of the tree one black node short, which we either fix
+ * by coloring its red child black or by running the fixup.
+ */
+template <typename Core>
+void RedBlackBalancing::eraseFixup(Core& core, typename Core::Node* removed, typename Core::Node* child,
+                                   typename Core::Path& path) {
+  if (removed->balance == Color::BLACK) {
+    if (child != nullptr && child->balance == Color::RED) {
+      child->balance = Color::BLACK;
+    } else {
+      eraseFixupFrom(core, child, path);
+    }
+  }
+}
+
+/* Restores the red/black properties after deletion. The given node (which may
+ * be null, which is why we need the path to find its parent) is "doubly black":
+ * every path through it has one fewer black node than it should. In 2-3-4
+ * terms, the 2-node it's part of just lost its key. We either borrow a key from
+ * a sibling 3- or 4-node (a rotation or two), or merge with a sibling 2-node
+ * (a recoloring) and push the problem one level up.
+ */
+template <typename Core>
+void RedBlackBalancing::eraseFixupFrom(Core& core, typename Core::Node* node, typename Core::Path& path) {
+  using Node = typename Core::Node;
+  auto isBlack = [](Node* n) {
+    return n == nullptr || n->balance == Color::BLACK;
+  };
+
+  while (path.depth != 0 && isBlack(node)) {
+    Node* parent  = path.up(1);
+    bool  onLeft  = node == parent->left;
+    Node* sibling = onLeft? parent->right : parent->left;
+
+    /* A red sibling means the parent is part of a 3-node. Rotate so that our
+     * actual sibling in the 2-3-4 tree is the one below us. The old sibling
+     * is now between the parent and grandparent, so it joins the path.
+     */
+    if (sibling->balance == Color::RED) {
+      sibling->balance = Color::BLACK;
+      parent->balance  = Color::RED;
+      core.rotateUp(sibling, parent, path.up(2));
+
+      path.nodes[path.depth - 1] = sibling;
+      path.push(parent);
+      sibling = onLeft? parent->right : parent->left;
+    }
+
+    Node* near = onLeft? sibling->left  : sibling->right;
+    Node* far  = onLeft? sibling->right : sibling->left;
+
+    /* Sibling is a 2-node: merge with it and move the problem up a level. */
+    if (isBlack(near) && isBlack(far)) {
+      sibling->balance = Color::RED;
+      node = parent;
+      path.depth--;
+      continue;
+    }
+
+    /* Sibling has a key to spare. Make sure it's on the far side, then rotate
+     * it over to our side.
+     */
+    if (isBlack(far)) {
+      near->balance    = Color::BLACK;
+      sibling->balance = Color::RED;
+      core.rotateUp(near, sibling, parent);
+      far     = sibling;
+      sibling = near;
+    }
+
+    sibling->balance = parent->balance;
+    parent->balance  = Color::BLACK;
+    far->balance     = Color::BLACK;
+    core.rotateUp(sibling, parent, path.up(2));
+    node = core.root;
+    break;
+  }
+
+  if (node != nullptr) node->balance = Color::BLACK;
+}
+
+/* Returns the sibling of a node, the other child of its parent. */
+template <typename Node>
+Node* RedBlackBalancing::siblingOf(Node* node, Node* parent) {
+  /* A node with no parent has no sibling. */
+  if (parent == nullptr) return nullptr;
+
+  /* Otherwise, return the opposite child. */
+  return node == parent->left? parent->right : parent->left;
+}
+
+template <typename Node>
+void RedBlackBalancing::checkBalance(const Node* root) {
+  if (root != nullptr && root->balance != Color::BLACK) {
+    throw runtime_error("The root of a red/black tree is red.");
+  }
+  blackHeightOf(root);
+}
+
+/* * * * * AVL * * * * */
+
+/* Insertion and deletion both change the height of one subtree by one, and
+ * either way each ancestor is rebalanced in turn. Once a subtree comes out the
+ * same height it went in, nothing above it has changed, so we can stop.
+ */
+template <typename Core>
+void AvlBalancing::rebalanceAlong(Core& core, typename Core::Path& path) {
+  using Node = typename Core::Node;
+  for (size_t i = path.depth; i > 0; i--) {
+    Node* node   = path.nodes[i - 1];
+    int   before = node->balance;
+    Node* top    = rebalance(node, core.rotations);
+    if (top != node) core.replaceChild(i > 1? path.nodes[i - 2] : nullptr, node, top);
+    if (top->balance == before) return;
+  }
+}
+
+template <typename Core>
+void AvlBalancing::insertFixup(Core& core, typename Core::Node*, typename Core::Path& path) {
+  rebalanceAlong(core, path);
+}
+
+template <typename Core>
+void AvlBalancing::eraseFixup(Core& core, typename Core::Node*, typename Core::Node*,
+                              typename Core::Path& path) {
+  rebalanceAlong(core, path);
+}
+
+template <typename Node>
+void AvlBalancing::checkBalance(const Node* root) {
+  checkRanks(root, 2, true);
+}
+
+/* * * * * WAVL * * * * */
+
+/* The new leaf breaks the rule only if it's a 0-child. While it's a 0-child
+ * of a 0,1 parent, promoting the parent pushes the problem up a level. If the
+ * parent is 0,2 instead, one rotation (if the 0-child's inner child is a
+ * 2-child) or a double rotation (if it's a 1-child) fixes everything.
+ */
+template <typename Core>
+void WavlBalancing::insertFixup(Core& core, typename Core::Node* node, typename Core::Path& path) {
+  using Node = typename Core::Node;
+  for (size_t i = path.depth; i > 0; i--) {
+    Node* parent = path.nodes[i - 1];
+    if (parent->balance != node->balance) return;
+
+    bool  isLeft  = parent->left == node;
+    Node* sibling = isLeft? parent->right : parent->left;
+    if (parent->balance - AvlBalancing::rankOf(sibling) == 1) {
+      parent->balance++;
+      node = parent;
+      continue;
+    }
+
+    Node* above = i > 1? path.nodes[i - 2] : nullptr;
+    Node* inner = isLeft? node->right : node->left;
+    if (node->balance - AvlBalancing::rankOf(inner) == 2) {
+      core.rotateUp(node, parent, above);
+      parent->balance--;
+    } else {
+      core.rotateUp(inner, node, parent);
+      core.rotateUp(inner, parent, above);
+      inner->balance++;
+      node->balance--;
+      parent->balance--;
+    }
+    return;
+  }
+}
+
+/* The child now in the removed node's place (possibly null) has a rank
+ * difference one bigger than the node it replaced. A leaf left with rank 1 is
+ * demoted first. Then, while there's a 3-child, its parent is demoted (along
+ * with the sibling, if that one is a 1-child with two 2-children) until a
+ * rotation finishes the job.
+ *
+ * The child and its sibling can only both be null if the parent is a leaf of
+ * rank 1, which has already been demoted by the time we need to tell them
+ * apart, so comparing against the parent's children finds the right side.
+ */
+template <typename Core>
+void WavlBalancing::eraseFixup(Core& core, typename Core::Node*, typename Core::Node* child,
+                               typename Core::Path& path) {
+  using Node = typename Core::Node;
+  auto rankOf = [](const Node* node) { return AvlBalancing::rankOf(node); };
+
+  Node*  node = child;
+  size_t i    = path.depth;
+  if (i > 0) {
+    Node* parent = path.nodes[i - 1];
+    if (parent->left == nullptr && parent->right == nullptr && parent->balance == 1) {
+      parent->balance = 0;
+      node = parent;
+      i--;
+    }
+  }
+
+  for (; i > 0; i--, node = path.nodes[i]) {
+    Node* parent  = path.nodes[i - 1];
+    bool  isLeft  = parent->left == node;
+    Node* sibling = isLeft? parent->right : parent->left;
+
+    if (parent->balance - rankOf(node) != 3) return;
+    if (parent->balance - rankOf(sibling) == 2) {
+      parent->balance--;
+      continue;
+    }
+
+    /* The sibling is a 1-child. */
+    Node* inner = isLeft? sibling->left  : sibling->right;
+    Node* outer = isLeft? sibling->right : sibling->left;
+    if (sibling->balance - rankOf(inner) == 2 && sibling->balance - rankOf(outer) == 2) {
+      sibling->balance--;
+      parent->balance--;
+      continue;
+    }
+
+    Node* above = i > 1? path.nodes[i - 2] : nullptr;
+    if (sibling->balance - rankOf(outer) == 1) {
+      core.rotateUp(sibling, parent, above);
+      sibling->balance++;
+      parent->balance--;
+      if (parent->left == nullptr && parent->right == nullptr) parent->balance--;
+    } else {
+      core.rotateUp(inner, sibling, parent);
+      core.rotateUp(inner, parent, above);
+      inner->balance   += 2;
+      sibling->balance -= 1;
+      parent->balance  -= 2;
+    }
+    return;
+  }
+}
+
+template <typename Node>
+void WavlBalancing::checkBalance(const Node* root) {
+  checkRanks(root, 2, false);
+}
+
+/* * * * * Instantiations * * * * */
+
+/* Every rule, once for each summary a tree can keep. */
+#define INSTANTIATE_BALANCING(Rule, Summary)                                                     \
+  template void Rule::insertFixup(TreeCore<Rule::Balance, Summary>&,                             \
+                                  TreeCore<Rule::Balance, Summary>::Node*,                       \
+                                  TreeCore<Rule::Balance, Summary>::Path&);                      \
+  template void Rule::eraseFixup(TreeCore<Rule::Balance, Summary>&,                              \
+                                 TreeCore<Rule::Balance, Summary>::Node*,                        \
+                                 TreeCore<Rule::Balance, Summary>::Node*,                        \
+                                 TreeCore<Rule::Balance, Summary>::Path&);                       \
+  template void Rule::checkBalance(const TreeNode<Rule::Balance, Summary>*);
+
+INSTANTIATE_BALANCING(RedBlackBalancing, SizeOnly)
+INSTANTIATE_BALANCING(RedBlackBalancing, SubtreeSummary)
+INSTANTIATE_BALANCING(AvlBalancing,      SizeOnly)
+INSTANTIATE_BALANCING(AvlBalancing,      SubtreeSummary)
+INSTANTIATE_BALANCING(WavlBalancing,     SizeOnly)
+INSTANTIATE_BALANCING(WavlBalancing,     SubtreeSummary)
+
+#undef INSTANTIATE_BALANCING
@@ -0,0 +1,176 @@
+/******************************************************************************
+ * File: Balancing.h
+ *
+ * The balancing rules a TreeCore can be kept in shape with. Each rule is a set
+ * of static functions run after a plain BST insertion or removal, which put
+ * the rule back in force by rotating (through the core, so sizes and
+ * summaries stay right) and by updating each node's balance field:
+ *
+ *   RedBlackBalancing  Every node is red or black, no red node has a red
+ *                      child, and every path from the root down to a null
+ *                      passes through the same number of black nodes. This is
+ *                      an isometry of a 2-3-4 tree, with height at most
+ *                      2 lg n, and does O(1) amortized rotations per update.
+ *
+ * The other two rules follow Haeupler, Sen, and Tarjan's "Rank-Balanced
+ * Trees." Every node has an integer rank (a missing child has rank -1), and
+ * the rank difference of a child is its parent's rank minus its own.
+ *
+ *   AvlBalancing       Every node is 1,1 or 1,2. The rank of a node is its
+ *                      height, so this is exactly an AVL tree. It's the
+ *                      shallowest of the three (height at most 1.44 lg n),
+ *                      which makes lookups cheapest, but a deletion can rotate
+ *                      all the way up to the root.
+ *
+ *   WavlBalancing      Every rank difference is 1 or 2, and every leaf has
+ *                      rank 0. This is a weak AVL tree: until the first
+ *                      deletion it's exactly an AVL tree, its height never
+ *                      exceeds a red/black tree's 2 lg n, and like a red/black
+ *                      tree it does O(1) amortized rotations per update.
+ *
+ * Every rule provides
+ *
+ *   Balance                       what each node keeps in its balance field,
+ *   insertFixup(core, node, path) to run once a new leaf, whose balance is
+ *                                 value-initialized, has been linked in below
+ *                                 the path,
+ *   eraseFixup(core, removed, child, path)
+ *                                 to run once removeNode has spliced out
+ *                                 removed and put child (possibly null) in
+ *                                 its place below the path, and
+ *   checkBalance(root)            which throws a std::runtime_error if the
+ *                                 tree below root breaks the rule.
+ *
+ * Both fixups may clobber the path. The fixups are templates over the core,
+ * and checkBalance over its nodes, so that one rule serves trees with any
+ * summary; Balancing.cpp instantiates them for the summaries in
+ * SubtreeSummary.h.
+ */
+#pragma once
+
+#include "TreeCore.h"
+
+struct RedBlackBalancing {
+  static constexpr const char* kName = "red/black";
+
+  enum class Color {
+    BLACK, RED
+  };
+  using Balance = Color;
+
+  template <typename Core>
+  static void insertFixup(Core& core, typename Core::Node* node, typename Core::Path& path);
+  template <typename Core>
+  static void eraseFixup(Core& core, typename Core::Node* removed, typename Core::Node* child,
+                         typename Core::Path& path);
+  template <typename Node> static void checkBalance(const Node* root);
+
+  /* Map a color to a string, for debugging purposes. */
+  static const char* colorToString(Color c) {
+    if (c == Color::BLACK) return "black";
+    if (c == Color::RED)   return "red";
+    return "(?)";
+  }
+
+private:
+  /* Returns the sibling of a node, given its parent (which may be null). */
+  template <typename Node> static Node* siblingOf(Node* node, Node* parent);
+
+  /* Restores the red/black properties after deletion, given a (possibly null)
+   * node that's one black node short and the path to it.
+   */
+  template <typename Core>
+  static void eraseFixupFrom(Core& core, typename Core::Node* node, typename Core::Path& path);
+};
+
+struct AvlBalancing {
+  static constexpr const char* kName = "AVL";
+
+  using Balance = int;
+
+  template <typename Core>
+  static void insertFixup(Core& core, typename Core::Node* node, typename Core::Path& path);
+  template <typename Core>
+  static void eraseFixup(Core& core, typename Core::Node* removed, typename Core::Node* child,
+                         typename Core::Path& path);
+  template <typename Node> static void checkBalance(const Node* root);
+
+  /* Returns the rank of a node that keeps its rank in its balance field, with
+   * a missing node at -1.
+   */
+  template <typename AnyNode> static int rankOf(const AnyNode* node) {
+    return node? node->balance : -1;
+  }
+
+  /* Recomputes a node's augmentation and rank from its children, each of
+   * which must already be an AVL tree, rotating if their ranks are two apart.
+   * Returns whatever node ends up on top, for the caller to link in where the
+   * node was, and adds the rotations done to the count. This works on any
+   * node type the rotations in TreeCore.h do with an int balance field, which
+   * lets trees that aren't built on a TreeCore share it.
+   */
+  template <typename AnyNode> static AnyNode* rebalance(AnyNode* node, std::size_t& rotations);
+  template <typename AnyNode> static AnyNode* rebalance(AnyNode* node) {
+    std::size_t unused = 0;
+    return rebalance(node, unused);
+  }
+
+private:
+  /* Rebalances every node on the path from the bottom up. */
+  template <typename Core> static void rebalanceAlong(Core& core, typename Core::Path& path);
+};
+
+struct WavlBalancing {
+  static constexpr const char* kName = "WAVL";
+
+  using Balance = int;
+
+  template <typename Core>
+  static void insertFixup(Core& core, typename Core::Node* node, typename Core::Path& path);
+  template <typename Core>
+  static void eraseFixup(Core& core, typename Core::Node* removed, typename Core::Node* child,
+                         typename Core::Path& path);
+  template <typename Node> static void checkBalance(const Node* root);
+};
+
+/* * * * * Implementation Below This Point * * * * */
+
+/* A subtree that's too tall on one side has the tall child rotated up over
+ * it. If that child's taller subtree is on the inside, it would just end up
+ * too tall on the other side, so the inner grandchild is rotated up first.
+ */
+template <typename AnyNode>
+AnyNode* AvlBalancing::rebalance(AnyNode* node, std::size_t& rotations) {
+  auto updateRank = [](AnyNode* n) {
+    int left = rankOf(n->left), right = rankOf(n->right);
+    n->balance = (left > right? left : right) + 1;
+  };
+
+  int difference = rankOf(node->left) - rankOf(node->right);
+  if (difference > 1) {
+    if (rankOf(node->left->left) < rankOf(node->left->right)) {
+      node->left = rotateLeft(node->left);
+      updateRank(node->left->left);
+      updateRank(node->left);
+      rotations++;
+    }
+    node = rotateRight(node);
+    updateRank(node->right);
+    rotations++;
+  } else if (difference < -1) {
+    if (rankOf(node->right->right) < rankOf(node->right->left)) {
+      node->right = rotateRight(node->right);
+      updateRank(node->right->right);
+      updateRank(node->right);
+      rotations++;
+    }
+    node = rotateLeft(node);
+    updateRank(node->left);
+    rotations++;
+  } else {
+    updateAugmentation(node);
+  }
+
+  updateRank(node);
+  return node;
+}
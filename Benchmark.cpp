@@ -0,0 +1,770 @@
+/******************************************************************************
+ * File: Benchmark.cpp
+ *
+ * Performance benchmarks for the red/black tree. Usage:
+ *
+ *     ./bench [--size n] [benchmark-name ...]
+ *
+ * With no benchmark names, every benchmark is run. The size controls how many
+ * keys each benchmark works with (1,000,000 by default). Run ./bench --list to
+ * see what's available.
+ */
+#include "RedBlackTree.h"
+#include "PublishedTree.h"
+#include "ShardedTree.h"
+#include "QuantileSketch.h"
+#include "DenseIntSet.h"
+#include "BalancedTree.h"
+#include "ReplicatedTree.h"
+#include "CompressedIndex.h"
+#include "BufferedTree.h"
+#include "IndexedSequence.h"
+#include "SmallTree.h"
+#include "QueryCache.h"
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+using namespace std;
+
+namespace {
+  /* Results get folded into this so that the compiler can't throw away the
+   * work we're trying to measure.
+   */
+  volatile size_t sink;
+  
+  /* Runs the given function, which performs numOps operations, and returns the
+   * average time per operation in nanoseconds.
+   */
+  template <typename Fn> double nanosecondsPerOp(size_t numOps, Fn fn) {
+    auto start = chrono::steady_clock::now();
+    fn();
+    chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+    return elapsed.count() / double(numOps);
+  }
+  
+  void printHeader(const string& title) {
+    cout << '\n' << title << '\n' << string(title.size(), '-') << '\n';
+  }
+  
+  void report(const string& label, double nsPerOp) {
+    cout << "  " << left << setw(44) << label << right << setw(10)
+         << fixed << setprecision(1) << nsPerOp << " ns/op" << '\n';
+  }
+  
+  /* A random permutation of 0, 1, ..., n - 1 scaled out so that the keys are
+   * spread over the whole range of ints.
+   */
+  vector<int> randomKeys(size_t n, mt19937& gen) {
+    vector<int> result(n);
+    int stride = int(max<size_t>(1, size_t(2000000000) / max<size_t>(n, 1)));
+    for (size_t i = 0; i < n; i++) result[i] = int(i) * stride - 1000000000;
+    shuffle(result.begin(), result.end(), gen);
+    return result;
+  }
+  
+  const char* policyName(RedBlackTree::InsertPolicy policy) {
+    return policy == RedBlackTree::InsertPolicy::TOP_DOWN? "top-down" : "bottom-up";
+  }
+  
+  /* Compares the two insertion algorithms on random and sorted insertion
+   * orders, then checks how fast the resulting trees are to query.
+   */
+  void benchInsertPolicies(size_t n) {
+    printHeader("Insertion policies (" + to_string(n) + " keys)");
+    
+    mt19937 gen(137);
+    vector<int> keys   = randomKeys(n, gen);
+    vector<int> sorted = keys;
+    sort(sorted.begin(), sorted.end());
+    vector<int> probes = keys;
+    shuffle(probes.begin(), probes.end(), gen);
+    
+    for (auto policy: { RedBlackTree::InsertPolicy::BOTTOM_UP, RedBlackTree::InsertPolicy::TOP_DOWN }) {
+      string name = policyName(policy);
+      
+      {
+        RedBlackTree t(RedBlackTree::Duplicates::REJECT, policy);
+        report(name + " insert, sorted order", nanosecondsPerOp(n, [&] {
+          for (int key: sorted) sink = sink + t.insert(key);
+        }));
+      }
+      
+      RedBlackTree t(RedBlackTree::Duplicates::REJECT, policy);
+      report(name + " insert, random order", nanosecondsPerOp(n, [&] {
+        for (int key: keys) sink = sink + t.insert(key);
+      }));
+      report(name + " insert, all duplicates", nanosecondsPerOp(n, [&] {
+        for (int key: keys) sink = sink + t.insert(key);
+      }));
+      report(name + " tree: contains", nanosecondsPerOp(n, [&] {
+        for (int key: probes) sink = sink + t.contains(key);
+      }));
+      report(name + " tree: rankOf", nanosecondsPerOp(n, [&] {
+        for (int key: probes) sink = sink + t.rankOf(key);
+      }));
+    }
+  }
+  
+  /* Reports the node layout in this build, then times the basic operations.
+   * Comparing ./bench layout against ./bench-no-parent layout shows what
+   * parent pointers cost.
+   */
+  void benchLayout(size_t n) {
+    printHeader(string("Node layout, parent pointers ") + (RBT_PARENT_POINTERS? "on" : "off") +
+                " (" + to_string(n) + " keys)");
+    cout << "  " << left << setw(44) << "bytes per node" << right << setw(10)
+         << RedBlackTree::bytesPerNode() << '\n';
+    cout << "  " << left << setw(44) << "node memory for all keys (MB)" << right << setw(10)
+         << fixed << setprecision(1) << double(RedBlackTree::bytesPerNode() * n) / (1 << 20) << '\n';
+    
+    mt19937 gen(137);
+    vector<int> keys   = randomKeys(n, gen);
+    vector<int> probes = keys;
+    shuffle(probes.begin(), probes.end(), gen);
+    
+    for (auto policy: { RedBlackTree::InsertPolicy::BOTTOM_UP, RedBlackTree::InsertPolicy::TOP_DOWN }) {
+      RedBlackTree t(RedBlackTree::Duplicates::REJECT, policy);
+      report(string(policyName(policy)) + " insert", nanosecondsPerOp(n, [&] {
+        for (int key: keys) sink = sink + t.insert(key);
+      }));
+    }
+    
+    RedBlackTree t;
+    for (int key: keys) t.insert(key);
+    report("contains", nanosecondsPerOp(n, [&] {
+      for (int key: probes) sink = sink + t.contains(key);
+    }));
+    report("rankOf", nanosecondsPerOp(n, [&] {
+      for (int key: probes) sink = sink + t.rankOf(key);
+    }));
+    report("in-order forEach", nanosecondsPerOp(n, [&] {
+      t.forEach([&](int key, size_t) { sink = sink + key; });
+    }));
+    report("erase", nanosecondsPerOp(n, [&] {
+      for (int key: probes) sink = sink + t.erase(key);
+    }));
+  }
+  
+  /* Times each export format, writing to /dev/null. */
+  void benchExport(size_t n) {
+    printHeader("Export (" + to_string(n) + " keys)");
+    
+    mt19937 gen(137);
+    RedBlackTree t;
+    for (int key: randomKeys(n, gen)) t.insert(key);
+    
+    ofstream devNull("/dev/null");
+    report("DOT, per node", nanosecondsPerOp(n, [&] {
+      t.exportTo(devNull, RedBlackTree::ExportFormat::DOT);
+    }));
+    report("JSON, per node", nanosecondsPerOp(n, [&] {
+      t.exportTo(devNull, RedBlackTree::ExportFormat::JSON);
+    }));
+    report("LEVELS, per node", nanosecondsPerOp(n, [&] {
+      t.exportTo(devNull, RedBlackTree::ExportFormat::LEVELS);
+    }));
+  }
+  
+  /* Times how long it takes to get rid of a tree's contents, either by
+   * destroying it or by clearing it, relative to building it in the first place.
+   */
+  void benchTeardown(size_t n) {
+    printHeader("Teardown (" + to_string(n) + " keys)");
+    
+    mt19937 gen(137);
+    vector<int> keys = randomKeys(n, gen);
+    
+    auto* t = new RedBlackTree;
+    report("insert", nanosecondsPerOp(n, [&] {
+      for (int key: keys) sink = sink + t->insert(key);
+    }));
+    report("destroy, per key", nanosecondsPerOp(n, [&] {
+      delete t;
+    }));
+    
+    RedBlackTree reused;
+    for (int key: keys) reused.insert(key);
+    report("clear, per key", nanosecondsPerOp(n, [&] {
+      reused.clear();
+    }));
+    report("insert into cleared tree", nanosecondsPerOp(n, [&] {
+      for (int key: keys) sink = sink + reused.insert(key);
+    }));
+  }
+  
+  /* Compares bulk loading a tree against inserting the keys one at a time, and
+   * times a full background rebuild through a PublishedTree.
+   */
+  void benchBulkLoad(size_t n) {
+    printHeader("Bulk loading (" + to_string(n) + " keys)");
+    
+    mt19937 gen(137);
+    vector<int> keys = randomKeys(n, gen);
+    sort(keys.begin(), keys.end());
+    
+    {
+      RedBlackTree t;
+      report("insert, sorted order", nanosecondsPerOp(n, [&] {
+        for (int key: keys) sink = sink + t.insert(key);
+      }));
+    }
+    report("fromSorted", nanosecondsPerOp(n, [&] {
+      sink = sink + RedBlackTree::fromSorted(keys).getSize();
+    }));
+    
+    PublishedTree published;
+    report("PublishedTree rebuild and publish", nanosecondsPerOp(n, [&] {
+      published.rebuild(keys);
+      published.wait();
+    }));
+    vector<int> delta = randomKeys(n / 100, gen);
+    report("PublishedTree 1% delta, per key in tree", nanosecondsPerOp(n, [&] {
+      published.rebuildWithDelta(delta, {});
+      published.wait();
+    }));
+  }
+  
+  /* Times inserting keys into a ShardedTree with more and more shards (one
+   * thread each), up to one per core, against a plain tree.
+   */
+  void benchSharded(size_t n) {
+    size_t numCores = max(1u, thread::hardware_concurrency());
+    printHeader("Sharded inserts (" + to_string(n) + " keys, " + to_string(numCores) + " cores)");
+    
+    mt19937 gen(137);
+    vector<int> keys = randomKeys(n, gen);
+    
+    RedBlackTree plain;
+    double baseline = nanosecondsPerOp(n, [&] {
+      for (int key: keys) sink = sink + plain.insert(key);
+    });
+    report("single tree", baseline);
+    
+    for (size_t numShards = 1; ; numShards = min(2 * numShards, numCores)) {
+      ShardedTree sharded(numShards);
+      double time = nanosecondsPerOp(n, [&] {
+        for (int key: keys) sharded.insert(key);
+        sharded.flush();
+      });
+      report(to_string(numShards) + " shards", time);
+      cout << "  " << left << setw(44) << "  speedup over single tree" << right << setw(10)
+           << fixed << setprecision(2) << baseline / time << "x" << '\n';
+      
+      if (numShards == numCores) break;
+    }
+  }
+  
+  /* Compares quantile sketches of several sizes against an exact multiset
+   * tree: time per sample, memory, and the worst rank error actually seen.
+   */
+  void benchSketch(size_t n) {
+    printHeader("Quantile sketch vs. exact tree (" + to_string(n) + " samples)");
+    
+    mt19937 gen(137);
+    vector<int> samples(n);
+    uniform_int_distribution<int> dist(0, 1 << 30);
+    for (int& sample: samples) sample = dist(gen);
+    
+    RedBlackTree exact(RedBlackTree::Duplicates::COUNT);
+    report("exact tree, add", nanosecondsPerOp(n, [&] {
+      for (int sample: samples) sink = sink + exact.insert(sample);
+    }));
+    cout << "  " << left << setw(44) << "exact tree, node memory (bytes)" << right << setw(10)
+         << exact.distinctSize() * RedBlackTree::bytesPerNode() << '\n';
+    
+    for (size_t k: { 50, 200, 800 }) {
+      QuantileSketch sketch(k);
+      string name = "k = " + to_string(k);
+      report(name + ", add", nanosecondsPerOp(n, [&] {
+        for (int sample: samples) sketch.add(sample);
+      }));
+      
+      double worst = 0;
+      size_t step = max<size_t>(1, n / 1000);
+      for (size_t rank = 0; rank < n; rank += step) {
+        int value = exact.select(rank);
+        worst = max(worst, fabs(double(sketch.rankOf(value)) - double(rank)) / double(n));
+      }
+      cout << "  " << left << setw(44) << name + ", sample memory (bytes)" << right << setw(10)
+           << sketch.numRetained() * sizeof(int) << '\n';
+      cout << "  " << left << setw(44) << name + ", worst / bound rank error (%)" << right << setw(10)
+           << fixed << setprecision(3) << 100 * worst << " / " << 100 * sketch.errorBound() << '\n';
+    }
+  }
+  
+  /* Compares one-at-a-time lookups against containsBatch on bursts of various
+   * sizes. The interesting case is a tree much bigger than the last-level
+   * cache, so try this with --size 10000000 or more.
+   */
+  void benchBatchLookup(size_t n) {
+    printHeader("Batched lookups (" + to_string(n) + " keys, " +
+                to_string(n * RedBlackTree::bytesPerNode() >> 20) + " MB of nodes)");
+    
+    mt19937 gen(137);
+    vector<int> keys = randomKeys(n, gen);
+    RedBlackTree t = RedBlackTree::fromSorted([&] {
+      vector<int> sorted = keys;
+      sort(sorted.begin(), sorted.end());
+      return sorted;
+    }());
+    
+    /* Half the probes are in the tree, half (odd keys) aren't. */
+    vector<int> probes = keys;
+    shuffle(probes.begin(), probes.end(), gen);
+    for (size_t i = 0; i < n; i += 2) probes[i] |= 1;
+    
+    report("contains, one at a time", nanosecondsPerOp(n, [&] {
+      for (int key: probes) sink = sink + t.contains(key);
+    }));
+    
+    unique_ptr<bool[]> results(new bool[n]);
+    for (size_t burst: { size_t(16), size_t(64), size_t(1024), n }) {
+      report("containsBatch, bursts of " + to_string(burst), nanosecondsPerOp(n, [&] {
+        for (size_t i = 0; i < n; i += burst) {
+          sink = sink + t.containsBatch(probes.data() + i, min(burst, n - i), results.get() + i);
+        }
+      }));
+    }
+  }
+  
+  /* Compares a tree against a bitset when the keys are half of a range
+   * that's twice the number of keys.
+   */
+  void benchDense(size_t n) {
+    printHeader("Dense keys (" + to_string(n) + " keys in [0, " + to_string(2 * n) + "))");
+    
+    mt19937 gen(137);
+    vector<int> keys(2 * n);
+    for (size_t i = 0; i < keys.size(); i++) keys[i] = int(i);
+    shuffle(keys.begin(), keys.end(), gen);
+    keys.resize(n);
+    vector<int> probes(n);
+    uniform_int_distribution<int> dist(0, int(2 * n - 1));
+    for (int& probe: probes) probe = dist(gen);
+    vector<size_t> ranks(n);
+    for (size_t& rank: ranks) rank = gen() % n;
+    
+    RedBlackTree tree;
+    DenseIntSet  dense(0, int(2 * n - 1));
+    
+    report("tree insert",   nanosecondsPerOp(n, [&] { for (int key: keys) sink = sink + tree.insert(key); }));
+    report("bitset insert", nanosecondsPerOp(n, [&] { for (int key: keys) sink = sink + dense.insert(key); }));
+    report("tree contains",   nanosecondsPerOp(n, [&] { for (int key: probes) sink = sink + tree.contains(key); }));
+    report("bitset contains", nanosecondsPerOp(n, [&] { for (int key: probes) sink = sink + dense.contains(key); }));
+    report("tree rankOf",   nanosecondsPerOp(n, [&] { for (int key: probes) sink = sink + tree.rankOf(key); }));
+    report("bitset rankOf", nanosecondsPerOp(n, [&] { for (int key: probes) sink = sink + dense.rankOf(key); }));
+    report("tree select",   nanosecondsPerOp(n, [&] { for (size_t rank: ranks) sink = sink + tree.select(rank); }));
+    report("bitset select", nanosecondsPerOp(n, [&] { for (size_t rank: ranks) sink = sink + dense.select(rank); }));
+    
+    cout << "  " << left << setw(44) << "tree node memory (bytes)" << right << setw(10)
+         << n * RedBlackTree::bytesPerNode() << '\n';
+    cout << "  " << left << setw(44) << "bitset memory (bytes)" << right << setw(10)
+         << dense.bytesUsed() << '\n';
+  }
+  
+  /* Builds a tree of each kind from the same random keys, then churns it by
+   * erasing half the keys and inserting new ones, reporting the height and
+   * rotations after each phase and the cost of queries on the churned tree.
+   */
+  template <typename Tree> void benchBalancing(const string& name, const vector<int>& keys,
+                                               const vector<int>& extra, const vector<int>& probes) {
+    size_t n = keys.size();
+    Tree t;
+    report(name + " insert", nanosecondsPerOp(n, [&] {
+      for (int key: keys) sink = sink + t.insert(key);
+    }));
+    cout << "  " << left << setw(44) << name + " height / rotations per insert" << right << setw(10)
+         << t.height() << " / " << fixed << setprecision(3) << double(t.numRotations()) / double(n) << '\n';
+    
+    size_t rotationsBefore = t.numRotations();
+    report(name + " churn (erase + insert)", nanosecondsPerOp(n, [&] {
+      for (size_t i = 0; i < n / 2; i++) {
+        sink = sink + t.erase(keys[i]);
+        sink = sink + t.insert(extra[i]);
+      }
+    }));
+    cout << "  " << left << setw(44) << name + " height / rotations per update" << right << setw(10)
+         << t.height() << " / " << fixed << setprecision(3)
+         << double(t.numRotations() - rotationsBefore) / double(n) << '\n';
+    
+    report(name + " contains", nanosecondsPerOp(n, [&] {
+      for (int key: probes) sink = sink + t.contains(key);
+    }));
+    report(name + " rankOf", nanosecondsPerOp(n, [&] {
+      for (int key: probes) sink = sink + t.rankOf(key);
+    }));
+    report(name + " select", nanosecondsPerOp(n, [&] {
+      for (size_t i = 0; i < n; i++) sink = sink + t.select(size_t(probes[i]) % t.getSize());
+    }));
+  }
+  
+  void benchBalancing(size_t n) {
+    printHeader("Balancing rules (" + to_string(n) + " keys)");
+    
+    mt19937 gen(137);
+    vector<int> all = randomKeys(2 * n, gen);
+    vector<int> keys(all.begin(), all.begin() + n);
+    vector<int> extra(all.begin() + n, all.end());
+    vector<int> probes = all;
+    shuffle(probes.begin(), probes.end(), gen);
+    probes.resize(n);
+    
+    benchBalancing<RedBlackTree>("red/black", keys, extra, probes);
+    benchBalancing<BalancedTree<RedBlackBalancing>>("red/black policy", keys, extra, probes);
+    benchBalancing<BalancedTree<AvlBalancing>>("AVL", keys, extra, probes);
+    benchBalancing<BalancedTree<WavlBalancing>>("WAVL", keys, extra, probes);
+  }
+  
+  /* Queries on a large tree mostly miss the TLB; with nodes on 2MB pages,
+   * far fewer translations cover the whole tree. The replica section times a
+   * refresh and a query through the local replica, which is what a reader on
+   * a multi-socket machine would do.
+   */
+  void benchHugePages(size_t n) {
+    printHeader("Node memory (" + to_string(n) + " keys)");
+    
+    mt19937 gen(137);
+    vector<int> keys = randomKeys(n, gen);
+    vector<int> probes = keys;
+    shuffle(probes.begin(), probes.end(), gen);
+    
+    for (auto memory: { RedBlackTree::NodeMemory::DEFAULT, RedBlackTree::NodeMemory::HUGE_PAGES }) {
+      string name = memory == RedBlackTree::NodeMemory::DEFAULT? "default pages" : "huge pages";
+      RedBlackTree t;
+      t.setNodeMemory(memory);
+      report(name + " insert",   nanosecondsPerOp(n, [&] { for (int key: keys) sink = sink + t.insert(key); }));
+      report(name + " contains", nanosecondsPerOp(n, [&] { for (int key: probes) sink = sink + t.contains(key); }));
+      report(name + " rankOf",   nanosecondsPerOp(n, [&] { for (int key: probes) sink = sink + t.rankOf(key); }));
+    }
+    
+    ReplicationOptions options;
+    options.memory = RedBlackTree::NodeMemory::HUGE_PAGES;
+    ReplicatedTree replicated(options);
+    for (int key: keys) replicated.insert(key);
+    cout << "  " << left << setw(44) << "NUMA replicas" << right << setw(10)
+         << replicated.numReplicas() << '\n';
+    report("replica refresh (per key)", nanosecondsPerOp(n, [&] { replicated.refresh(); }));
+    report("local replica rankOf", nanosecondsPerOp(n, [&] {
+      ReplicatedTree::Snapshot local = replicated.snapshot();
+      for (int key: probes) sink = sink + local->rankOf(key);
+    }));
+  }
+  
+  /* Compares queries on a tree against the same keys in a compressed index,
+   * along with how much memory each one takes.
+   */
+  void benchCompressed(size_t n) {
+    printHeader("Compressed index (" + to_string(n) + " keys)");
+    
+    mt19937 gen(137);
+    vector<int> keys = randomKeys(n, gen);
+    vector<int> probes = keys;
+    shuffle(probes.begin(), probes.end(), gen);
+    vector<size_t> ranks(n);
+    for (size_t& rank: ranks) rank = gen() % n;
+    
+    vector<int> sorted = keys;
+    sort(sorted.begin(), sorted.end());
+    RedBlackTree tree = RedBlackTree::fromSorted(sorted);
+    
+    unique_ptr<CompressedIndex> index;
+    report("compress (per key)", nanosecondsPerOp(n, [&] { index.reset(new CompressedIndex(tree)); }));
+    report("tree contains",       nanosecondsPerOp(n, [&] { for (int key: probes) sink = sink + tree.contains(key); }));
+    report("compressed contains", nanosecondsPerOp(n, [&] { for (int key: probes) sink = sink + index->contains(key); }));
+    report("tree rankOf",         nanosecondsPerOp(n, [&] { for (int key: probes) sink = sink + tree.rankOf(key); }));
+    report("compressed rankOf",   nanosecondsPerOp(n, [&] { for (int key: probes) sink = sink + index->rankOf(key); }));
+    report("tree select",         nanosecondsPerOp(n, [&] { for (size_t rank: ranks) sink = sink + tree.select(rank); }));
+    report("compressed select",   nanosecondsPerOp(n, [&] { for (size_t rank: ranks) sink = sink + index->select(rank); }));
+    
+    cout << "  " << left << setw(44) << "tree bytes per key" << right << setw(10)
+         << RedBlackTree::bytesPerNode() << '\n';
+    cout << "  " << left << setw(44) << "compressed bytes per key" << right << setw(10)
+         << fixed << setprecision(2) << double(index->bytesUsed()) / double(n) << '\n';
+  }
+  
+  /* Times a burst of inserts straight into a tree and through write buffers
+   * of a couple of sizes, then queries with keys still in the runs.
+   */
+  void benchBuffered(size_t n) {
+    printHeader("Write buffer (" + to_string(n) + " keys)");
+    
+    mt19937 gen(137);
+    vector<int> keys = randomKeys(n, gen);
+    vector<int> probes = keys;
+    shuffle(probes.begin(), probes.end(), gen);
+    
+    for (auto duplicates: { RedBlackTree::Duplicates::REJECT, RedBlackTree::Duplicates::COUNT }) {
+      string kind = duplicates == RedBlackTree::Duplicates::REJECT? "set" : "multiset";
+      RedBlackTree tree(duplicates);
+      report(kind + " tree insert", nanosecondsPerOp(n, [&] { for (int key: keys) sink = sink + tree.insert(key); }));
+      
+      for (size_t capacity: { 64, 1024 }) {
+        BufferedTree buffered(duplicates, capacity);
+        report(kind + " buffer(" + to_string(capacity) + ") insert", nanosecondsPerOp(n, [&] {
+          for (int key: keys) sink = sink + buffered.insert(key);
+          buffered.flush();
+        }));
+      }
+    }
+    
+    BufferedTree buffered(RedBlackTree::Duplicates::REJECT);
+    for (int key: keys) buffered.insert(key);
+    string label = " (" + to_string(buffered.buffered()) + " buffered)";
+    report("rankOf" + label, nanosecondsPerOp(n, [&] { for (int key: probes) sink = sink + buffered.rankOf(key); }));
+    report("select" + label, nanosecondsPerOp(n, [&] {
+      for (size_t i = 0; i < n; i++) sink = sink + buffered.select(size_t(probes[i]) % n);
+    }));
+    
+    const RedBlackTree& merged = buffered.merged();
+    report("rankOf (all merged)", nanosecondsPerOp(n, [&] { for (int key: probes) sink = sink + merged.rankOf(key); }));
+    report("select (all merged)", nanosecondsPerOp(n, [&] {
+      for (size_t i = 0; i < n; i++) sink = sink + merged.select(size_t(probes[i]) % n);
+    }));
+  }
+  
+  /* Positional inserts, erases, and lookups in an indexed sequence against a
+   * std::vector, whose inserts shift everything after them. The vector is
+   * capped at 100,000 values so the run finishes.
+   */
+  void benchSequence(size_t n) {
+    printHeader("Indexed sequence (" + to_string(n) + " values)");
+    
+    mt19937 gen(137);
+    vector<size_t> positions(n);
+    for (size_t i = 0; i < n; i++) positions[i] = gen() % (i + 1);
+    
+    IndexedSequence<int> seq;
+    report("sequence insertAt", nanosecondsPerOp(n, [&] {
+      for (size_t i = 0; i < n; i++) seq.insertAt(positions[i], int(i));
+    }));
+    report("sequence at", nanosecondsPerOp(n, [&] {
+      for (size_t i = 0; i < n; i++) sink = sink + seq.at(positions[i]);
+    }));
+    report("sequence extract + splice 1/4", nanosecondsPerOp(1000, [&] {
+      for (size_t i = 0; i < 1000; i++) {
+        size_t begin = positions[i] / 2;
+        seq.splice(positions[n - 1 - i] / 2, seq.extract(begin, begin + n / 4));
+      }
+    }));
+    report("sequence eraseAt", nanosecondsPerOp(n, [&] {
+      for (size_t i = n; i > 0; i--) seq.eraseAt(positions[i - 1]);
+    }));
+    
+    size_t m = min<size_t>(n, 100000);
+    vector<int> values;
+    report("vector insert (" + to_string(m) + ")", nanosecondsPerOp(m, [&] {
+      for (size_t i = 0; i < m; i++) values.insert(values.begin() + positions[i], int(i));
+    }));
+    report("vector erase (" + to_string(m) + ")", nanosecondsPerOp(m, [&] {
+      for (size_t i = m; i > 0; i--) values.erase(values.begin() + positions[i - 1]);
+    }));
+  }
+  
+  /* Returns how many bytes are currently allocated on the heap, or 0 if we
+   * can't tell.
+   */
+  size_t heapBytesInUse() {
+#ifdef __GLIBC__
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+  }
+  
+  /* Builds many tiny trees of each kind, the way one tree per customer would,
+   * and reports the memory per tree and the cost of queries on them.
+   */
+  template <typename Tree> void benchSmallTrees(const string& name, size_t numTrees, size_t keysPerTree,
+                                                const vector<int>& probes) {
+    size_t before = heapBytesInUse();
+    vector<Tree> trees;
+    trees.reserve(numTrees);
+    report(name + " build", nanosecondsPerOp(numTrees * keysPerTree, [&] {
+      for (size_t i = 0; i < numTrees; i++) {
+        trees.emplace_back();
+        for (size_t j = 0; j < keysPerTree; j++) trees.back().insert(probes[(i + j) % probes.size()]);
+      }
+    }));
+    cout << "  " << left << setw(44) << name + " bytes per tree" << right << setw(10)
+         << (heapBytesInUse() - before) / numTrees << '\n';
+    
+    report(name + " rankOf", nanosecondsPerOp(probes.size(), [&] {
+      for (size_t i = 0; i < probes.size(); i++) sink = sink + trees[i % numTrees].rankOf(probes[i]);
+    }));
+    report(name + " contains", nanosecondsPerOp(probes.size(), [&] {
+      for (size_t i = 0; i < probes.size(); i++) sink = sink + trees[i % numTrees].contains(probes[i]);
+    }));
+    report(name + " select", nanosecondsPerOp(probes.size(), [&] {
+      for (size_t i = 0; i < probes.size(); i++) sink = sink + trees[i % numTrees].select(i % keysPerTree);
+    }));
+  }
+  
+  void benchSmallTrees(size_t n) {
+    const size_t kKeysPerTree = 20;
+    size_t numTrees = max<size_t>(1, n / kKeysPerTree);
+    printHeader("Small trees (" + to_string(numTrees) + " trees of " + to_string(kKeysPerTree) + " keys)");
+    
+    mt19937 gen(137);
+    vector<int> probes = randomKeys(n, gen);
+    benchSmallTrees<RedBlackTree>("red/black", numTrees, kKeysPerTree, probes);
+    benchSmallTrees<SmallTree<32>>("SmallTree<32>", numTrees, kKeysPerTree, probes);
+  }
+  
+  /* A dashboard's worth of queries: the same 64 rankOf and 64 select calls
+   * over and over, against a large tree that takes an insert every so often.
+   * The inserts are timed too, so the two columns do the same work.
+   */
+  void benchQueryCache(size_t n) {
+    printHeader("Query cache (" + to_string(n) + " keys, 128 hot queries)");
+    
+    mt19937 gen(137);
+    vector<int> keys = randomKeys(n, gen);
+    vector<int> sorted = keys;
+    sort(sorted.begin(), sorted.end());
+    RedBlackTree tree = RedBlackTree::fromSorted(sorted);
+    
+    const size_t kNumHot = 64;
+    vector<int>    hotKeys(kNumHot);
+    vector<size_t> hotRanks(kNumHot);
+    for (size_t i = 0; i < kNumHot; i++) {
+      hotKeys[i]  = keys[gen() % n];
+      hotRanks[i] = gen() % (tree.getSize() / 2);
+    }
+    
+    for (size_t writeEvery: { size_t(0), size_t(10000), size_t(1000), size_t(100) }) {
+      string label = writeEvery == 0? " (no writes)" : " (insert every " + to_string(writeEvery) + ")";
+      size_t nextWrite = 0;
+      auto run = [&](auto rankOf, auto select) {
+        for (size_t i = 0; i < n; i++) {
+          if (writeEvery != 0 && i % writeEvery == 0) tree.insert(keys[nextWrite++ % n] + 1);
+          if (i % 2 == 0) sink = sink + rankOf(hotKeys[(i / 2) % kNumHot]);
+          else            sink = sink + select(hotRanks[(i / 2) % kNumHot]);
+        }
+      };
+      
+      report("tree" + label, nanosecondsPerOp(n, [&] {
+        run([&](int key) { return tree.rankOf(key); }, [&](size_t rank) { return tree.select(rank); });
+      }));
+      
+      QueryCache cache(tree);
+      report("cache" + label, nanosecondsPerOp(n, [&] {
+        run([&](int key) { return cache.rankOf(key); }, [&](size_t rank) { return cache.select(rank); });
+      }));
+      cout << "  " << left << setw(44) << "cache hit rate" + label << right << setw(10)
+           << fixed << setprecision(3) << cache.hitRate() << '\n';
+    }
+  }
+  
+  /* Times exporting a tree built by random inserts, whose nodes are scattered
+   * all over memory, to an array and to a file with more and more threads, up
+   * to one per core, against a serial forEach.
+   */
+  void benchParallelWalk(size_t n) {
+    size_t numCores = max(1u, thread::hardware_concurrency());
+    printHeader("Parallel export (" + to_string(n) + " keys, " + to_string(numCores) + " cores)");
+    
+    mt19937 gen(137);
+    RedBlackTree tree;
+    for (int key: randomKeys(n, gen)) tree.insert(key);
+    
+    vector<int> out(tree.getSize());
+    double baseline = nanosecondsPerOp(n, [&] {
+      size_t i = 0;
+      tree.forEach([&](int key, size_t) { out[i++] = key; });
+    });
+    report("forEach into array", baseline);
+    
+    string path = "/tmp/rbt-bench-" + to_string(getpid()) + ".keys";
+    for (size_t numThreads = 1; ; numThreads = min(2 * numThreads, numCores)) {
+      double time = nanosecondsPerOp(n, [&] { tree.toSortedArray(out.data(), numThreads); });
+      report("toSortedArray, " + to_string(numThreads) + " threads", time);
+      cout << "  " << left << setw(44) << "  speedup over forEach" << right << setw(10)
+           << fixed << setprecision(2) << baseline / time << "x" << '\n';
+      report("writeTo, " + to_string(numThreads) + " threads",
+             nanosecondsPerOp(n, [&] { tree.writeTo(path, numThreads); }));
+      
+      if (numThreads == numCores) break;
+    }
+    unlink(path.c_str());
+  }
+  
+  /* All the benchmarks we know how to run. */
+  struct Benchmark {
+    const char* name;
+    const char* description;
+    void (*run)(size_t n);
+  };
+  
+  const Benchmark kBenchmarks[] = {
+    { "insert-policy", "bottom-up vs. top-down insertion",    benchInsertPolicies },
+    { "layout",        "node size and basic operation costs",  benchLayout         },
+    { "export",        "DOT, JSON, and level-summary exports", benchExport         },
+    { "teardown",      "destroying and clearing a tree",       benchTeardown       },
+    { "bulk-load",     "fromSorted and background rebuilds",   benchBulkLoad       },
+    { "sharded",       "insert scaling across shard threads",  benchSharded        },
+    { "sketch",        "approximate quantiles vs. exact tree", benchSketch         },
+    { "batch",         "containsBatch vs. one-at-a-time",      benchBatchLookup    },
+    { "dense",         "bitset vs. tree on a bounded range",   benchDense          },
+    { "balancing",     "red/black vs. AVL vs. WAVL",           benchBalancing      },
+    { "huge-pages",    "huge-page nodes and NUMA replicas",    benchHugePages      },
+    { "compressed",    "Elias-Fano index vs. tree",            benchCompressed     },
+    { "buffered",      "write-buffered inserts vs. direct",    benchBuffered       },
+    { "sequence",      "positional sequence vs. std::vector",  benchSequence       },
+    { "small",         "inline arrays vs. trees, tiny sets",   benchSmallTrees     },
+    { "cache",         "versioned cache of repeated queries",  benchQueryCache     },
+    { "parallel",      "multithreaded export to array/file",   benchParallelWalk   },
+  };
+  
+  void printUsage() {
+    cerr << "Usage: ./bench [--size n] [benchmark-name ...]" << endl;
+    cerr << "       ./bench --list" << endl;
+  }
+}
+
+int main(int argc, const char* argv[]) {
+  size_t n = 1000000;
+  vector<const Benchmark*> toRun;
+  
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--list") {
+      for (const auto& benchmark: kBenchmarks) {
+        cout << left << setw(20) << benchmark.name << benchmark.description << '\n';
+      }
+      return 0;
+    } else if (arg == "--size" && i + 1 < argc) {
+      n = strtoull(argv[++i], nullptr, 10);
+    } else {
+      auto match = find_if(begin(kBenchmarks), end(kBenchmarks), [&](const Benchmark& b) {
+        return arg == b.name;
+      });
+      if (match == end(kBenchmarks)) {
+        cerr << "Unknown benchmark \"" << arg << "\"." << endl;
+        printUsage();
+        return -1;
+      }
+      toRun.push_back(match);
+    }
+  }
+  
+  if (toRun.empty()) {
+    for (const auto& benchmark: kBenchmarks) toRun.push_back(&benchmark);
+  }
+  for (const Benchmark* benchmark: toRun) {
+    benchmark->run(n);
+  }
+  cout << flush;
+}
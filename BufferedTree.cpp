@@ -0,0 +1,178 @@
+#include "BufferedTree.h"
+#include <algorithm>
+#include <climits>
+#include <iterator>
+#include <stdexcept>
+using namespace std;
+
+namespace {
+  /* Once the runs hold at least 1/kRebuildRatio as many keys as the tree,
+   * they're all merged into it.
+   */
+  const size_t kRebuildRatio = 8;
+}
+
+BufferedTree::BufferedTree(RedBlackTree::Duplicates duplicates, size_t bufferCapacity)
+  : duplicates(duplicates), bufferCapacity(bufferCapacity), tree(duplicates), runs(1) {
+  if (bufferCapacity == 0) {
+    throw runtime_error("BufferedTree(): the buffer capacity must be positive.");
+  }
+  runs[0].reserve(bufferCapacity);
+}
+
+bool BufferedTree::isSet() const {
+  return duplicates == RedBlackTree::Duplicates::REJECT;
+}
+
+bool BufferedTree::insert(int key) {
+  if (isSet()) {
+    if (bufferedKeys.count(key) || tree.contains(key)) return false;
+    bufferedKeys.insert(key);
+  }
+
+  vector<int>& buffer = runs[0];
+  buffer.insert(upper_bound(buffer.begin(), buffer.end(), key), key);
+  numBuffered++;
+  if (buffer.size() >= bufferCapacity) spill();
+  return true;
+}
+
+bool BufferedTree::erase(int key) {
+  if (isSet() && bufferedKeys.erase(key) == 0) return tree.erase(key);
+
+  for (auto& run: runs) {
+    auto itr = lower_bound(run.begin(), run.end(), key);
+    if (itr != run.end() && *itr == key) {
+      run.erase(itr);
+      numBuffered--;
+      return true;
+    }
+  }
+  return tree.erase(key);
+}
+
+bool BufferedTree::contains(int key) const {
+  if (isSet()) return bufferedKeys.count(key) || tree.contains(key);
+
+  for (const auto& run: runs) {
+    if (binary_search(run.begin(), run.end(), key)) return true;
+  }
+  return tree.contains(key);
+}
+
+size_t BufferedTree::countBefore(size_t source, int key, bool inclusive) const {
+  if (source == 0) {
+    if (!inclusive)      return tree.rankOf(key);
+    if (key == INT_MAX)  return tree.getSize();
+    return tree.rankOf(key + 1);
+  }
+
+  const vector<int>& run = runs[source - 1];
+  auto itr = inclusive? upper_bound(run.begin(), run.end(), key)
+                      : lower_bound(run.begin(), run.end(), key);
+  return size_t(itr - run.begin());
+}
+
+size_t BufferedTree::rankOf(int key) const {
+  size_t result = tree.rankOf(key);
+  for (const auto& run: runs) {
+    result += size_t(lower_bound(run.begin(), run.end(), key) - run.begin());
+  }
+  return result;
+}
+
+/* Break ties between equal keys by putting the tree's copies first, then the
+ * runs' in order. Under that order, the key at position p of source s comes
+ * after p keys of its own source, after every key at most as large in the
+ * sources before it, and after every smaller key in the sources after it.
+ * That position is strictly increasing in p, so we can binary search each
+ * source for the p that lands exactly on the rank, and exactly one source
+ * has it.
+ *
+ * The tree is tried first since it usually holds the answer, and there the
+ * search only has to cover the numBuffered + 1 positions the answer could be
+ * in.
+ */
+int BufferedTree::select(size_t rank) const {
+  if (rank >= getSize()) {
+    throw runtime_error("BufferedTree::select(): rank out of range.");
+  }
+
+  for (size_t source = 0; source <= runs.size(); source++) {
+    auto keyAt = [&](size_t position) {
+      return source == 0? tree.select(position) : runs[source - 1][position];
+    };
+    auto positionOf = [&](size_t position) {
+      int    key    = keyAt(position);
+      size_t result = position;
+      for (size_t other = 0; other <= runs.size(); other++) {
+        if (other != source) result += countBefore(other, key, other < source);
+      }
+      return result;
+    };
+
+    size_t size = source == 0? tree.getSize() : runs[source - 1].size();
+    size_t low  = source == 0 && rank > numBuffered? rank - numBuffered : 0;
+    size_t high = min(size, rank + 1);
+    while (low < high) {
+      size_t mid = low + (high - low) / 2;
+      if (positionOf(mid) < rank) low = mid + 1;
+      else high = mid;
+    }
+    if (low < size && positionOf(low) == rank) return keyAt(low);
+  }
+  throw runtime_error("BufferedTree::select(): no source holds the key.");
+}
+
+/* Carry the buffer down through the runs, merging with each full one, until
+ * it lands in an empty slot.
+ */
+void BufferedTree::spill() {
+  vector<int> carry;
+  carry.swap(runs[0]);
+  runs[0].reserve(bufferCapacity);
+
+  size_t level = 1;
+  for (; level < runs.size() && !runs[level].empty(); level++) {
+    vector<int> merged;
+    merged.reserve(runs[level].size() + carry.size());
+    merge(runs[level].begin(), runs[level].end(), carry.begin(), carry.end(),
+          back_inserter(merged));
+    runs[level].clear();
+    carry.swap(merged);
+  }
+  if (level == runs.size()) runs.emplace_back();
+  runs[level].swap(carry);
+
+  if (numBuffered * kRebuildRatio >= tree.getSize()) flush();
+}
+
+/* The runs are merged smallest first, so that each key in them is copied
+ * about once per run, and then into the tree's keys in one pass.
+ */
+void BufferedTree::flush() {
+  if (numBuffered == 0) return;
+
+  vector<int> pending;
+  for (auto& run: runs) {
+    vector<int> merged;
+    merged.reserve(pending.size() + run.size());
+    merge(pending.begin(), pending.end(), run.begin(), run.end(), back_inserter(merged));
+    pending.swap(merged);
+    run.clear();
+  }
+
+  vector<int> keys = tree.toSortedArray();
+
+  vector<int> all;
+  all.reserve(keys.size() + pending.size());
+  merge(keys.begin(), keys.end(), pending.begin(), pending.end(), back_inserter(all));
+  tree = RedBlackTree::fromSorted(all, duplicates);
+  numBuffered = 0;
+  bufferedKeys.clear();
+}
+
+const RedBlackTree& BufferedTree::merged() {
+  flush();
+  return tree;
+}
@@ -0,0 +1,99 @@
+/******************************************************************************
+ * File: BufferedTree.h
+ *
+ * A red/black tree with a log-structured write buffer in front of it, for
+ * workloads that insert in bursts. Inserting straight into a large tree
+ * costs a cache miss at nearly every level of the descent, plus allocation
+ * and rebalancing. Here, new keys go into a small sorted array instead. When
+ * that fills, it's merged into a stack of sorted runs whose sizes double from
+ * one to the next, the way a binary counter carries, so each key is copied
+ * O(log n) times, always sequentially. Once the runs hold an eighth as many
+ * keys as the tree, everything is merged and the tree is rebuilt with
+ * fromSorted, which is linear time and touches memory in order.
+ *
+ * Queries never have to merge. contains and rankOf combine the answer from
+ * the tree with a binary search of the buffer and each run. select finds
+ * which of those holds the answer and binary searches for it there. Results
+ * are always exact, whether or not anything has been merged yet.
+ *
+ * In a multiset, insert only touches the buffer. In a set, insert still has
+ * to check whether the key is already present so that it can return the
+ * right answer. A hash set of the buffered keys makes that a single read-only
+ * descent of the tree rather than a binary search of every run, but on a tree
+ * much larger than the cache, that descent costs about as much as inserting,
+ * so sets gain little. Erasing a buffered key shifts the rest of its run
+ * over, so erase-heavy workloads are better off with a plain tree.
+ */
+#pragma once
+
+#include "RedBlackTree.h"
+#include <cstddef>
+#include <unordered_set>
+#include <vector>
+
+class BufferedTree {
+public:
+  /**
+   * Creates an empty tree that handles duplicates as specified, whose insert
+   * buffer holds the given number of keys before it spills into the runs. If
+   * the capacity is zero, this throws a std::runtime_error.
+   */
+  explicit BufferedTree(RedBlackTree::Duplicates duplicates = RedBlackTree::Duplicates::REJECT,
+                        std::size_t bufferCapacity = 256);
+
+  /**
+   * These behave exactly like their RedBlackTree counterparts.
+   */
+  bool        insert(int key);
+  bool        erase(int key);
+  bool        contains(int key) const;
+  std::size_t getSize() const {
+    return tree.getSize() + numBuffered;
+  }
+  std::size_t rankOf(int key) const;
+  int         select(std::size_t rank) const;
+
+  /**
+   * Returns how many keys are waiting in the buffer and runs rather than in
+   * the tree.
+   */
+  std::size_t buffered() const {
+    return numBuffered;
+  }
+
+  /**
+   * Merges every buffered key into the tree.
+   */
+  void flush();
+
+  /**
+   * Merges everything, then returns the tree holding every key.
+   */
+  const RedBlackTree& merged();
+
+private:
+  RedBlackTree::Duplicates duplicates;
+  std::size_t bufferCapacity;
+
+  RedBlackTree tree;
+
+  /* Keys not yet in the tree, each array sorted. runs[0] is the insert
+   * buffer; runs[k] for k > 0 is empty or holds about bufferCapacity * 2^(k-1)
+   * keys. In a set, no key appears twice across all of these and the tree.
+   */
+  std::vector<std::vector<int>> runs;
+  std::size_t numBuffered = 0;
+
+  /* In a set, every key in the runs. Empty in a multiset. */
+  std::unordered_set<int> bufferedKeys;
+
+  bool isSet() const;
+
+  /* Returns how many keys in the tree (if source is 0) or in runs[source - 1]
+   * are less than the key, or at most the key if inclusive is set.
+   */
+  std::size_t countBefore(std::size_t source, int key, bool inclusive) const;
+
+  /* Moves the full insert buffer down into the runs. */
+  void spill();
+};
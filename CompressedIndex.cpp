@@ -0,0 +1,144 @@
+#include "CompressedIndex.h"
+#include <algorithm>
+#include <stdexcept>
+using namespace std;
+
+namespace {
+  /* Returns the position of the set bit in the word with the given rank
+   * among the set bits, narrowing down to the right byte by halves first.
+   */
+  unsigned selectInWord(uint64_t word, uint64_t rank) {
+    unsigned position = 0;
+    for (unsigned width = 32; width >= 8; width /= 2) {
+      uint64_t low = __builtin_popcountll(word & ((uint64_t(1) << width) - 1));
+      if (rank >= low) {
+        rank     -= low;
+        word    >>= width;
+        position += width;
+      }
+    }
+    for (; rank > 0; rank--) word &= word - 1;
+    return position + __builtin_ctzll(word);
+  }
+
+  /* Finds the bit with the given rank among the bits of words that are set
+   * (or clear, if invert is true), given that the bit at position start has
+   * rank zero.
+   */
+  uint64_t scanForBit(const vector<uint64_t>& words, uint64_t start, uint64_t rank, bool invert) {
+    size_t   index = start / 64;
+    uint64_t word  = (invert? ~words[index] : words[index]) & (~uint64_t(0) << (start % 64));
+    while (true) {
+      uint64_t count = __builtin_popcountll(word);
+      if (rank < count) return index * 64 + selectInWord(word, rank);
+      rank -= count;
+      index++;
+      word = invert? ~words[index] : words[index];
+    }
+  }
+}
+
+CompressedIndex::CompressedIndex(const RedBlackTree& tree) {
+  build(tree.toSortedArray());
+}
+
+CompressedIndex::CompressedIndex(const vector<int>& keys) {
+  if (!is_sorted(keys.begin(), keys.end())) {
+    throw runtime_error("CompressedIndex(): keys are not sorted.");
+  }
+  build(keys);
+}
+
+/* The low halves get l = floor(lg(range / n)) bits each, which keeps the
+ * unary high halves to at most about 2n bits.
+ */
+void CompressedIndex::build(const vector<int>& keys) {
+  size = keys.size();
+  if (size == 0) return;
+
+  minKey    = keys.front();
+  maxOffset = uint64_t(int64_t(keys.back()) - int64_t(minKey));
+  while (lowBits < 32 && (uint64_t(size) << (lowBits + 1)) <= maxOffset + 1) lowBits++;
+
+  lows.assign((size * lowBits + 63) / 64 + 1, 0);
+  highs.assign((size + (maxOffset >> lowBits) + 1 + 63) / 64, 0);
+
+  uint64_t lowMask = (uint64_t(1) << lowBits) - 1;
+  uint64_t zeros   = 0;   // Zeros written into highs so far
+  for (size_t i = 0; i < size; i++) {
+    uint64_t offset = uint64_t(int64_t(keys[i]) - int64_t(minKey));
+    uint64_t high   = offset >> lowBits;
+
+    /* Every zero up to this key's high half comes before its one. */
+    for (; zeros <= high; zeros++) {
+      if (zeros % kSampleRate == 0) zeroSamples.push_back(zeros + i);
+    }
+
+    uint64_t position = high + i;
+    highs[position / 64] |= uint64_t(1) << (position % 64);
+    if (i % kSampleRate == 0) oneSamples.push_back(position);
+
+    if (lowBits > 0) {
+      uint64_t bit = i * lowBits;
+      lows[bit / 64] |= (offset & lowMask) << (bit % 64);
+      if (bit % 64 + lowBits > 64) lows[bit / 64 + 1] |= (offset & lowMask) >> (64 - bit % 64);
+    }
+  }
+}
+
+uint64_t CompressedIndex::lowOf(size_t index) const {
+  if (lowBits == 0) return 0;
+
+  uint64_t bit    = index * lowBits;
+  uint64_t result = lows[bit / 64] >> (bit % 64);
+  if (bit % 64 + lowBits > 64) result |= lows[bit / 64 + 1] << (64 - bit % 64);
+  return result & ((uint64_t(1) << lowBits) - 1);
+}
+
+uint64_t CompressedIndex::selectOne(uint64_t rank) const {
+  return scanForBit(highs, oneSamples[rank / kSampleRate], rank % kSampleRate, false);
+}
+
+uint64_t CompressedIndex::selectZero(uint64_t rank) const {
+  return scanForBit(highs, zeroSamples[rank / kSampleRate], rank % kSampleRate, true);
+}
+
+/* The keys with high half h are the ones between the (h - 1)st and hth zeros,
+ * and they're sorted by their low halves.
+ */
+size_t CompressedIndex::rankOf(int key) const {
+  if (size == 0 || key <= minKey) return 0;
+
+  uint64_t offset = uint64_t(int64_t(key) - int64_t(minKey));
+  if (offset > maxOffset) return size;
+
+  uint64_t high  = offset >> lowBits;
+  uint64_t low   = offset & ((uint64_t(1) << lowBits) - 1);
+  size_t   begin = high == 0? 0 : selectZero(high - 1) - (high - 1);
+  size_t   end   = selectZero(high) - high;
+
+  while (begin < end) {
+    size_t mid = begin + (end - begin) / 2;
+    if (lowOf(mid) < low) begin = mid + 1;
+    else end = mid;
+  }
+  return begin;
+}
+
+int CompressedIndex::select(size_t rank) const {
+  if (rank >= size) {
+    throw runtime_error("CompressedIndex::select(): rank out of range.");
+  }
+
+  uint64_t high = selectOne(rank) - rank;
+  return int(int64_t(minKey) + int64_t((high << lowBits) | lowOf(rank)));
+}
+
+bool CompressedIndex::contains(int key) const {
+  size_t rank = rankOf(key);
+  return rank < size && select(rank) == key;
+}
+
+size_t CompressedIndex::bytesUsed() const {
+  return (lows.size() + highs.size() + oneSamples.size() + zeroSamples.size()) * sizeof(uint64_t);
+}
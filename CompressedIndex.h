@@ -0,0 +1,81 @@
+/******************************************************************************
+ * File: CompressedIndex.h
+ *
+ * A read-only snapshot of a sorted collection of ints, stored with Elias-Fano
+ * coding so it takes a couple of bytes per key instead of a whole tree node.
+ * Queries run directly on the compressed form.
+ *
+ * Each key is offset by the smallest key and split into high and low halves.
+ * The low l bits of every key, where l is about lg(range / n), are packed
+ * side by side. The high bits are stored in unary in a single bitvector: key i
+ * sets the bit at position high(i) + i, so the number of zeros before a key's
+ * one is its high half. That takes at most 2 + l bits per key in total.
+ *
+ * To jump into the unary bitvector quickly, we sample the position of every
+ * 256th one and every 256th zero. select(i) finds the i-th one from the
+ * nearest sample; rankOf finds the stretch of ones between two zeros holding
+ * every key with the same high half, then binary searches their low halves.
+ *
+ * Like the tree, this can hold repeated keys, and rankOf counts every copy.
+ */
+#pragma once
+
+#include "RedBlackTree.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class CompressedIndex {
+public:
+  /**
+   * Builds an index of every key in the tree, including repeated copies in a
+   * multiset.
+   */
+  explicit CompressedIndex(const RedBlackTree& tree);
+
+  /**
+   * Builds an index of the given keys, which must be in nondecreasing order.
+   * If they aren't, this throws a std::runtime_error.
+   */
+  explicit CompressedIndex(const std::vector<int>& keys);
+
+  /**
+   * These behave exactly like their RedBlackTree counterparts.
+   */
+  bool        contains(int key) const;
+  std::size_t getSize() const {
+    return size;
+  }
+  std::size_t rankOf(int key) const;
+  int         select(std::size_t rank) const;
+
+  /**
+   * Returns how much memory the encoded keys and their samples take up.
+   */
+  std::size_t bytesUsed() const;
+
+private:
+  static constexpr std::size_t kSampleRate = 256;
+
+  std::size_t   size = 0;
+  int           minKey = 0;
+  std::uint64_t maxOffset = 0;  // Largest key minus minKey
+  unsigned      lowBits = 0;
+
+  std::vector<std::uint64_t> lows;     // Packed low halves, plus a padding word
+  std::vector<std::uint64_t> highs;    // Unary-coded high halves
+
+  /* Positions in highs of every kSampleRate-th one and zero. */
+  std::vector<std::uint64_t> oneSamples;
+  std::vector<std::uint64_t> zeroSamples;
+
+  void build(const std::vector<int>& keys);
+
+  std::uint64_t lowOf(std::size_t index) const;
+
+  /* Returns the position of the given one or zero in highs, counting from
+   * zero.
+   */
+  std::uint64_t selectOne(std::uint64_t rank) const;
+  std::uint64_t selectZero(std::uint64_t rank) const;
+};
@@ -0,0 +1,133 @@
+#include "DenseIntSet.h"
+#include <stdexcept>
+using namespace std;
+
+namespace {
+  /* Returns the position of the set bit in the word with the given rank
+   * among the set bits. We narrow down to the right byte by counting the
+   * bits in the low half, then quarter, then eighth, and finish by clearing
+   * the lowest set bit until the one we want is the lowest.
+   */
+  unsigned selectInWord(uint64_t word, uint64_t rank) {
+    unsigned position = 0;
+    for (unsigned width = 32; width >= 8; width /= 2) {
+      uint64_t low = __builtin_popcountll(word & ((uint64_t(1) << width) - 1));
+      if (rank >= low) {
+        rank     -= low;
+        word    >>= width;
+        position += width;
+      }
+    }
+    for (; rank > 0; rank--) word &= word - 1;
+    return position + __builtin_ctzll(word);
+  }
+}
+
+DenseIntSet::DenseIntSet(int minKey, int maxKey) : minKey(minKey), maxKey(maxKey) {
+  if (minKey > maxKey) {
+    throw runtime_error("DenseIntSet(): the range of keys is empty.");
+  }
+
+  uint64_t range = uint64_t(int64_t(maxKey) - int64_t(minKey)) + 1;
+  uint64_t numBlocks = (range + kBitsPerBlock - 1) / kBitsPerBlock;
+  words.assign(numBlocks * kWordsPerBlock, 0);
+  fenwick.assign(numBlocks + 1, 0);
+}
+
+bool DenseIntSet::contains(int key) const {
+  if (key < minKey || key > maxKey) return false;
+
+  uint64_t bit = uint64_t(int64_t(key) - int64_t(minKey));
+  return (words[bit / 64] >> (bit % 64)) & 1;
+}
+
+bool DenseIntSet::insert(int key) {
+  if (key < minKey || key > maxKey) {
+    throw runtime_error("DenseIntSet::insert(): key out of range.");
+  }
+
+  uint64_t bit  = uint64_t(int64_t(key) - int64_t(minKey));
+  uint64_t mask = uint64_t(1) << (bit % 64);
+  if (words[bit / 64] & mask) return false;
+
+  words[bit / 64] |= mask;
+  addToBlock(bit / kBitsPerBlock, 1);
+  size++;
+  return true;
+}
+
+bool DenseIntSet::erase(int key) {
+  if (!contains(key)) return false;
+
+  uint64_t bit = uint64_t(int64_t(key) - int64_t(minKey));
+  words[bit / 64] &= ~(uint64_t(1) << (bit % 64));
+  addToBlock(bit / kBitsPerBlock, -1);
+  size--;
+  return true;
+}
+
+void DenseIntSet::addToBlock(size_t block, int64_t delta) {
+  for (size_t i = block + 1; i < fenwick.size(); i += i & -i) {
+    fenwick[i] += uint64_t(delta);
+  }
+}
+
+uint64_t DenseIntSet::keysBeforeBlock(size_t block) const {
+  uint64_t result = 0;
+  for (size_t i = block; i > 0; i -= i & -i) {
+    result += fenwick[i];
+  }
+  return result;
+}
+
+/* Everything in earlier superblocks, plus the full words before the key's word
+ * in its superblock, plus the bits below the key in its own word.
+ */
+size_t DenseIntSet::rankOf(int key) const {
+  if (key <= minKey) return 0;
+  if (key >  maxKey) return size;
+
+  uint64_t bit  = uint64_t(int64_t(key) - int64_t(minKey));
+  size_t   word = bit / 64;
+  uint64_t result = keysBeforeBlock(bit / kBitsPerBlock);
+  for (size_t i = word - word % kWordsPerBlock; i < word; i++) {
+    result += __builtin_popcountll(words[i]);
+  }
+  result += __builtin_popcountll(words[word] & ((uint64_t(1) << (bit % 64)) - 1));
+  return result;
+}
+
+/* The Fenwick tree is walked from the top down, skipping over each range of
+ * superblocks whose keys all have smaller ranks. That leaves the superblock
+ * holding the key, which is scanned a word at a time.
+ */
+int DenseIntSet::select(size_t rank) const {
+  if (rank >= size) {
+    throw runtime_error("DenseIntSet::select(): rank out of range.");
+  }
+
+  size_t numBlocks = fenwick.size() - 1;
+  size_t step = 1;
+  while (step * 2 <= numBlocks) step *= 2;
+
+  size_t   block     = 0;
+  uint64_t remaining = rank;
+  for (; step > 0; step /= 2) {
+    if (block + step <= numBlocks && fenwick[block + step] <= remaining) {
+      block += step;
+      remaining -= fenwick[block];
+    }
+  }
+
+  for (size_t i = block * kWordsPerBlock; ; i++) {
+    uint64_t count = __builtin_popcountll(words[i]);
+    if (remaining < count) {
+      return int(int64_t(minKey) + int64_t(i * 64 + selectInWord(words[i], remaining)));
+    }
+    remaining -= count;
+  }
+}
+
+size_t DenseIntSet::bytesUsed() const {
+  return words.size() * sizeof(words[0]) + fenwick.size() * sizeof(fenwick[0]);
+}
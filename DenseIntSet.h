@@ -0,0 +1,79 @@
+/******************************************************************************
+ * File: DenseIntSet.h
+ *
+ * An order statistics set for keys drawn from a known, bounded range of ints.
+ * Instead of one node per key, it keeps one bit per possible key, which is far
+ * smaller and friendlier to the cache than a tree whenever a decent fraction
+ * of the range is in use.
+ *
+ * The bits are grouped into 512-bit superblocks (eight 64-bit words). A
+ * Fenwick tree over the superblock counts gives the number of keys before
+ * any superblock in O(log n) time, and the last few words are handled with
+ * hardware popcount. Select walks down the Fenwick tree to find the right
+ * superblock, then scans at most eight words.
+ *
+ * This is a set, not a multiset: inserting a key that's already present does
+ * nothing.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class DenseIntSet {
+public:
+  /**
+   * Creates an empty set that can hold keys from minKey to maxKey, inclusive.
+   * If minKey > maxKey, this throws a std::runtime_error.
+   */
+  DenseIntSet(int minKey, int maxKey);
+
+  /**
+   * Adds the key to the set, returning whether it wasn't already there. If
+   * the key is out of range, this throws a std::runtime_error.
+   */
+  bool insert(int key);
+
+  /**
+   * Removes the key from the set, returning whether it was there.
+   */
+  bool erase(int key);
+
+  /**
+   * These behave exactly like their RedBlackTree counterparts. Keys outside
+   * the range are allowed and are simply never present.
+   */
+  bool        contains(int key) const;
+  std::size_t getSize() const {
+    return size;
+  }
+  std::size_t rankOf(int key) const;
+  int         select(std::size_t rank) const;
+
+  /**
+   * Returns how much memory the bitset and its directory take up.
+   */
+  std::size_t bytesUsed() const;
+
+private:
+  static constexpr std::size_t kWordsPerBlock = 8;
+  static constexpr std::size_t kBitsPerBlock  = 64 * kWordsPerBlock;
+
+  int minKey, maxKey;
+  std::size_t size = 0;
+
+  std::vector<std::uint64_t> words;
+
+  /* A Fenwick tree over the number of keys in each superblock, indexed from
+   * one. fenwick[i] holds the count for superblocks i - lowbit(i) through
+   * i - 1.
+   */
+  std::vector<std::uint64_t> fenwick;
+
+  /* Adds delta to the count of the given superblock. */
+  void addToBlock(std::size_t block, std::int64_t delta);
+
+  /* Returns the number of keys in the superblocks before the given one. */
+  std::uint64_t keysBeforeBlock(std::size_t block) const;
+};
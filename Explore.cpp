@@ -1,4 +1,6 @@
 #include "RedBlackTree.h"
+#include "Trace.h"
+#include "QueryServer.h"
 #include <iostream>
 #include <iomanip>
 #include <string>
@@ -6,8 +8,21 @@
 #include <fstream>
 #include <cctype>
 #include <stdexcept>
+#include <exception>
 #include <functional>
 #include <set>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <charconv>
+#include <cstring>
+#include <csignal>
+#include <random>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 using namespace std;
 
 std::set<int> tree;
@@ -22,6 +37,8 @@ namespace {
     cout << "  r value: return the rank of the given value." << endl;
     cout << "  s index: returns the element at the given index." << endl;
     cout << "  p:       prints debug information." << endl;
+    cout << "  e format [limit]: exports the tree as dot, json, or levels," << endl;
+    cout << "           writing at most limit nodes." << endl;
     cout << "  q:       quit this program." << endl;
     cout << endl;
   }
@@ -141,6 +158,19 @@ namespace {
         }
         cout << "]\n\n";
       t.printDebugInfo();
+    } else if (command == 'e') {
+      execute([&] {
+        string format;
+        if (!(input >> format)) throw ParseError("format");
+        
+        size_t limit = SIZE_MAX;
+        if (!(input >> ws).eof()) limit = parseRank(input);
+        
+        if      (format == "dot")    t.exportTo(cout, RedBlackTree::ExportFormat::DOT,    limit);
+        else if (format == "json")   t.exportTo(cout, RedBlackTree::ExportFormat::JSON,   limit);
+        else if (format == "levels") t.exportTo(cout, RedBlackTree::ExportFormat::LEVELS, limit);
+        else throw ParseError("format");
+      });
     } else if (command == 'q') {
       exit(EXIT_SUCCESS);
     } else {
@@ -171,15 +201,533 @@ namespace {
       executeCommand(t, line);
     }
   }
+  
+  /* Everything below implements replay mode, a fast path for running very long
+   * script files. Rather than going through iostreams a line at a time, we map
+   * the whole file into memory, parse it by hand, and write results into a
+   * large buffer that's only flushed when it fills up.
+   */
+  
+  /* A read-only view of a file mapped into memory. */
+  class MappedFile {
+  public:
+    explicit MappedFile(const string& filename) {
+      int fd = open(filename.c_str(), O_RDONLY);
+      if (fd < 0) {
+        throw runtime_error("Cannot open file \"" + filename + "\" for reading.");
+      }
+      
+      struct stat info;
+      if (fstat(fd, &info) != 0) {
+        close(fd);
+        throw runtime_error("Cannot stat file \"" + filename + "\".");
+      }
+      length = size_t(info.st_size);
+      
+      /* mmap refuses to map empty files, so leave those as an empty range. */
+      if (length != 0) {
+        void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+          close(fd);
+          throw runtime_error("Cannot map file \"" + filename + "\" into memory.");
+        }
+        madvise(mapped, length, MADV_SEQUENTIAL);
+        data = static_cast<const char*>(mapped);
+      }
+      close(fd);
+    }
+    
+    ~MappedFile() {
+      if (data != nullptr) munmap(const_cast<char*>(data), length);
+    }
+    
+    const char* begin() const { return data; }
+    const char* end()   const { return data + length; }
+    
+  private:
+    const char* data = nullptr;
+    size_t length = 0;
+    
+    MappedFile(const MappedFile &) = delete;
+    void operator= (MappedFile) = delete;
+  };
+  
+  /* Output buffer that writes through cout in large chunks. Going through cout
+   * (rather than straight to the file descriptor) keeps our output correctly
+   * ordered relative to printDebugInfo.
+   */
+  class OutputBuffer {
+  public:
+    ~OutputBuffer() {
+      flush();
+    }
+    
+    void put(const char* text, size_t length) {
+      if (used + length > sizeof(buffer)) flush();
+      memcpy(buffer + used, text, length);
+      used += length;
+    }
+    
+    void put(const char* text) {
+      put(text, strlen(text));
+    }
+    
+    template <typename Integer> void putNumber(Integer value) {
+      char digits[32];
+      auto result = to_chars(digits, digits + sizeof(digits), value);
+      put(digits, result.ptr - digits);
+    }
+    
+    void flush() {
+      cout.write(buffer, used);
+      used = 0;
+    }
+    
+  private:
+    char   buffer[1 << 16];
+    size_t used = 0;
+  };
+  
+  /* Commands understood by replay mode, used to index the timing table. */
+  enum Command {
+    kInsert, kContains, kRank, kSelect, kPrint, kNumCommands
+  };
+  
+  const char* const kCommandNames[kNumCommands] = {
+    "insert", "contains", "rankOf", "select", "print"
+  };
+  
+  /* Accumulated timing information for one command type. */
+  struct CommandTiming {
+    size_t count = 0;
+    chrono::nanoseconds total{0};
+  };
+  
+  bool isBlank(char ch) {
+    return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\v' || ch == '\f';
+  }
+  
+  /* Parses a single number out of the range [begin, end), which must contain
+   * nothing else besides whitespace.
+   */
+  template <typename T> bool parseNumber(const char* begin, const char* end, T& result) {
+    while (begin != end && isBlank(*begin)) ++begin;
+    
+    /* from_chars doesn't accept a leading plus sign, but operator>> does. */
+    if (begin != end && *begin == '+') ++begin;
+    
+    auto parsed = from_chars(begin, end, result);
+    if (parsed.ec != errc() || parsed.ptr == begin) return false;
+    
+    for (const char* rest = parsed.ptr; rest != end; ++rest) {
+      if (!isBlank(*rest)) return false;
+    }
+    return true;
+  }
+  
+  /* Options controlling replay mode. */
+  struct ReplayOptions {
+    bool check = false;   // Mirror every operation into a std::set and compare?
+    bool quiet = false;   // Suppress per-command output?
+    string recordTo;      // If nonempty, write a binary trace of the run here.
+  };
+  
+  void runReplay(const string& filename, const ReplayOptions& options) {
+    MappedFile file(filename);
+    OutputBuffer out;
+    
+    unique_ptr<TraceWriter> writer;
+    if (!options.recordTo.empty()) writer.reset(new TraceWriter(options.recordTo));
+    
+    RedBlackTree tree;
+    TracedRedBlackTree t(tree, writer.get());
+    set<int> shadow;                    // Only used when checking results.
+    CommandTiming timing[kNumCommands];
+    size_t mismatches = 0;
+    size_t lineNumber = 0;
+    
+    auto reportError = [&](const char* message) {
+      out.flush();
+      cout << flush;
+      cerr << "Line " << lineNumber << ": " << message << endl;
+    };
+    auto reportMismatch = [&](const char* what) {
+      mismatches++;
+      reportError(what);
+    };
+    
+    for (const char* line = file.begin(); line < file.end(); ) {
+      const char* lineEnd = static_cast<const char*>(memchr(line, '\n', file.end() - line));
+      if (lineEnd == nullptr) lineEnd = file.end();
+      const char* nextLine = lineEnd + 1;
+      lineNumber++;
+      
+      /* Trim trailing comments, then skip leading whitespace. */
+      const char* hash = static_cast<const char*>(memchr(line, '#', lineEnd - line));
+      if (hash != nullptr) lineEnd = hash;
+      while (line != lineEnd && isBlank(*line)) ++line;
+      
+      if (line == lineEnd) {
+        line = nextLine;
+        continue;
+      }
+      
+      char command = char(tolower(static_cast<unsigned char>(*line)));
+      const char* args = line + 1;
+      line = nextLine;
+      
+      if (command == 'i' || command == 'c' || command == 'r') {
+        int key;
+        if (!parseNumber(args, lineEnd, key)) {
+          reportError("Error parsing value.");
+          continue;
+        }
+        
+        if (command == 'i') {
+          auto start = chrono::steady_clock::now();
+          bool result = t.insert(key);
+          timing[kInsert].total += chrono::steady_clock::now() - start;
+          timing[kInsert].count++;
+          
+          if (!options.quiet) out.put(result? "true\n" : "false\n");
+          if (options.check && shadow.insert(key).second != result) {
+            reportMismatch("insert disagrees with std::set.");
+          }
+        } else if (command == 'c') {
+          auto start = chrono::steady_clock::now();
+          bool result = t.contains(key);
+          timing[kContains].total += chrono::steady_clock::now() - start;
+          timing[kContains].count++;
+          
+          if (!options.quiet) out.put(result? "true\n" : "false\n");
+          if (options.check && (shadow.count(key) != 0) != result) {
+            reportMismatch("contains disagrees with std::set.");
+          }
+        } else {
+          auto start = chrono::steady_clock::now();
+          size_t result = t.rankOf(key);
+          timing[kRank].total += chrono::steady_clock::now() - start;
+          timing[kRank].count++;
+          
+          if (!options.quiet) {
+            out.putNumber(result);
+            out.put("\n", 1);
+          }
+          if (options.check &&
+              size_t(distance(shadow.begin(), shadow.lower_bound(key))) != result) {
+            reportMismatch("rankOf disagrees with std::set.");
+          }
+        }
+      } else if (command == 's') {
+        size_t rank;
+        if (!parseNumber(args, lineEnd, rank)) {
+          reportError("Error parsing index.");
+          continue;
+        }
+        
+        /* Check the bounds up front so that out-of-range queries don't pay for
+         * throwing and catching an exception.
+         */
+        if (rank >= t.getSize()) {
+          if (!options.quiet) out.put("out of range\n");
+          continue;
+        }
+        
+        auto start = chrono::steady_clock::now();
+        int result = t.select(rank);
+        timing[kSelect].total += chrono::steady_clock::now() - start;
+        timing[kSelect].count++;
+        
+        if (!options.quiet) {
+          out.putNumber(result);
+          out.put("\n", 1);
+        }
+        if (options.check && *next(shadow.begin(), rank) != result) {
+          reportMismatch("select disagrees with std::set.");
+        }
+      } else if (command == 'p') {
+        out.flush();
+        auto start = chrono::steady_clock::now();
+        t.printDebugInfo();
+        timing[kPrint].total += chrono::steady_clock::now() - start;
+        timing[kPrint].count++;
+      } else if (command == 'q') {
+        break;
+      } else {
+        reportError("Unknown command.");
+      }
+    }
+    out.flush();
+    cout << flush;
+    
+    /* Report where the time went. This goes to cerr so that it doesn't get
+     * mixed into the results.
+     */
+    cerr << "Replayed " << lineNumber << " lines from \"" << filename << "\"." << '\n';
+    cerr << left << setw(10) << "command" << right << setw(12) << "count"
+         << setw(14) << "total (ms)" << setw(12) << "avg (ns)" << '\n';
+    for (size_t i = 0; i < kNumCommands; i++) {
+      if (timing[i].count == 0) continue;
+      double totalNs = double(timing[i].total.count());
+      cerr << left << setw(10) << kCommandNames[i] << right << setw(12) << timing[i].count
+           << setw(14) << fixed << setprecision(3) << totalNs / 1e6
+           << setw(12) << setprecision(1) << totalNs / timing[i].count << '\n';
+    }
+    if (options.check) {
+      cerr << "Mismatches against std::set: " << mismatches << '\n';
+    }
+    if (writer) {
+      writer->flush();
+      cerr << "Recorded " << writer->numEvents() << " events to \"" << options.recordTo << "\"." << '\n';
+    }
+    cerr << flush;
+  }
+  
+  /* Replays a binary trace as quickly as possible, then reports the latency
+   * distribution of each operation both as recorded and as replayed.
+   */
+  void runTrace(const string& filename) {
+    vector<TraceEvent> events = readTrace(filename);
+    
+    RedBlackTree t;
+    LatencyHistogram recorded[kNumTraceOps];
+    LatencyHistogram replayed[kNumTraceOps];
+    
+    /* Fold every result into this value so the calls can't be optimized out. */
+    size_t checksum = 0;
+    
+    auto totalStart = chrono::steady_clock::now();
+    for (const TraceEvent& event: events) {
+      auto start = chrono::steady_clock::now();
+      switch (event.op) {
+        case TraceOp::INSERT:   checksum += t.insert(int(event.argument));   break;
+        case TraceOp::CONTAINS: checksum += t.contains(int(event.argument)); break;
+        case TraceOp::RANK_OF:  checksum += t.rankOf(int(event.argument));   break;
+        case TraceOp::SELECT:
+          if (size_t(event.argument) < t.getSize()) checksum += t.select(size_t(event.argument));
+          break;
+      }
+      auto elapsed = chrono::steady_clock::now() - start;
+      
+      size_t op = size_t(event.op);
+      replayed[op].record(chrono::duration_cast<chrono::nanoseconds>(elapsed).count());
+      recorded[op].record(event.nanoseconds);
+    }
+    chrono::duration<double, milli> total = chrono::steady_clock::now() - totalStart;
+    
+    cout << "Replayed " << events.size() << " events from \"" << filename << "\" in "
+         << fixed << setprecision(3) << total.count() << "ms (checksum " << checksum << ")." << '\n';
+    cout << "Latencies in nanoseconds, recorded / replayed:" << '\n';
+    cout << left << setw(10) << "op" << right << setw(10) << "count"
+         << setw(16) << "mean" << setw(16) << "p50" << setw(16) << "p90"
+         << setw(16) << "p99" << setw(16) << "p99.9" << setw(20) << "max" << '\n';
+    for (size_t op = 0; op < kNumTraceOps; op++) {
+      if (replayed[op].numSamples() == 0) continue;
+      
+      auto pair = [](double before, double after) {
+        ostringstream result;
+        result << fixed << setprecision(0) << before << " / " << after;
+        return result.str();
+      };
+      cout << left << setw(10) << traceOpName(TraceOp(op)) << right
+           << setw(10) << replayed[op].numSamples()
+           << setw(16) << pair(recorded[op].mean(), replayed[op].mean());
+      for (double p: { 50.0, 90.0, 99.0, 99.9 }) {
+        cout << setw(16) << pair(recorded[op].percentile(p), replayed[op].percentile(p));
+      }
+      cout << setw(20) << pair(recorded[op].max(), replayed[op].max()) << '\n';
+    }
+    cout << flush;
+  }
+  
+  /* Everything below implements server mode, which answers queries from other
+   * processes over a Unix domain socket, and a load generator to go with it.
+   */
+  
+  /* The running server, so that CTRL+C can shut it down cleanly. stop() only
+   * writes to a pipe, which is safe to do from a signal handler.
+   */
+  QueryServer* runningServer = nullptr;
+  
+  extern "C" void stopRunningServer(int) {
+    if (runningServer != nullptr) runningServer->stop();
+  }
+  
+  void runServer(const string& path) {
+    RedBlackTree t;
+    QueryServer server(t, path);
+    runningServer = &server;
+    signal(SIGINT,  stopRunningServer);
+    signal(SIGTERM, stopRunningServer);
+    
+    cerr << "Serving on \"" << path << "\". Press CTRL+C to stop." << endl;
+    server.run();
+    runningServer = nullptr;
+    
+    cerr << "Answered " << server.numRequests() << " requests in "
+         << server.numBatches() << " batches; the tree holds " << t.getSize() << " keys." << endl;
+  }
+  
+  /* Options controlling the load generator. */
+  struct LoadOptions {
+    size_t connections = 4;        // Client threads, one connection each
+    size_t requests    = 1000000;  // Spread across all the connections
+    size_t pipeline    = 64;       // Requests sent before waiting for replies
+    size_t writes      = 10;       // Percent of requests that are inserts
+    int    maxKey      = 1000000;  // Keys are drawn from [0, maxKey]
+  };
+  
+  /* Each connection sends a window of random requests, waits for all their
+   * replies, and repeats. A request's latency runs from when its window was
+   * sent to when its reply arrived. The requests are split as evenly as they
+   * can be, with the first few connections sending one extra to make up the
+   * remainder.
+   */
+  void runLoad(const string& path, const LoadOptions& options) {
+    vector<LatencyHistogram> latencies(options.connections);
+    vector<exception_ptr>    errors(options.connections);
+    vector<thread> clients;
+    
+    auto start = chrono::steady_clock::now();
+    for (size_t c = 0; c < options.connections; c++) {
+      clients.emplace_back([&, c] {
+        /* An exception escaping a thread would end the program, so hold on
+         * to it and report it once every client is done.
+         */
+        try {
+          size_t perConnection = options.requests / options.connections +
+                                 (c < options.requests % options.connections? 1 : 0);
+          QueryClient client(path);
+          mt19937 gen(static_cast<unsigned>(c));
+          uniform_int_distribution<int> keys(0, options.maxKey);
+          
+          vector<QueryRequest> window;
+          for (size_t sent = 0; sent < perConnection; sent += window.size()) {
+            window.clear();
+            for (size_t i = 0; i < options.pipeline && sent + i < perConnection; i++) {
+              size_t roll = gen() % 100;
+              TraceOp op = roll < options.writes? TraceOp::INSERT
+                         : roll % 3 == 0?         TraceOp::CONTAINS
+                         : roll % 3 == 1?         TraceOp::RANK_OF : TraceOp::SELECT;
+              window.push_back({ op, uint32_t(keys(gen)) });
+            }
+            
+            auto sentAt = chrono::steady_clock::now();
+            client.send(window);
+            for (size_t i = 0; i < window.size(); i++) {
+              client.receive();
+              latencies[c].record(chrono::duration_cast<chrono::nanoseconds>(
+                chrono::steady_clock::now() - sentAt).count());
+            }
+          }
+        } catch (...) {
+          errors[c] = current_exception();
+        }
+      });
+    }
+    for (auto& client: clients) client.join();
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    for (const auto& error: errors) {
+      if (error) rethrow_exception(error);
+    }
+    
+    LatencyHistogram total;
+    for (const auto& latency: latencies) total.merge(latency);
+    
+    cout << "Sent " << total.numSamples() << " requests over " << options.connections
+         << " connections, " << options.pipeline << " at a time, in "
+         << fixed << setprecision(3) << elapsed.count() << "s." << '\n';
+    cout << "Throughput: " << setprecision(0) << double(total.numSamples()) / elapsed.count()
+         << " requests/s" << '\n';
+    cout << "Latency (ns): mean " << total.mean();
+    for (double p: { 50.0, 90.0, 99.0, 99.9 }) {
+      cout << ", p" << setprecision(p == 99.9? 1 : 0) << p << " " << total.percentile(p);
+    }
+    cout << ", max " << total.max() << '\n' << flush;
+  }
+  
+  void printUsage() {
+    cerr << "Usage: ./explore [optional-test-file]" << endl;
+    cerr << "       ./explore --replay [--check] [--quiet] [--record trace-file] test-file" << endl;
+    cerr << "       ./explore --trace trace-file" << endl;
+    cerr << "       ./explore --serve socket-path" << endl;
+    cerr << "       ./explore --load [--connections k] [--requests n] [--pipeline depth]" << endl;
+    cerr << "                        [--writes percent] socket-path" << endl;
+  }
 }
 
 int main(int argc, const char* argv[]) {
   if (argc == 1) {
     runInteractively();
-  } else if (argc == 2) {
+  } else if (argc == 2 && argv[1][0] != '-') {
     runScriptFile(argv[1]);
+  } else if (string(argv[1]) == "--replay") {
+    ReplayOptions options;
+    const char* filename = nullptr;
+    for (int i = 2; i < argc; i++) {
+      string arg = argv[i];
+      if      (arg == "--check") options.check = true;
+      else if (arg == "--quiet") options.quiet = true;
+      else if (arg == "--record" && i + 1 < argc) options.recordTo = argv[++i];
+      else if (filename == nullptr && arg[0] != '-') filename = argv[i];
+      else {
+        printUsage();
+        return -1;
+      }
+    }
+    if (filename == nullptr) {
+      printUsage();
+      return -1;
+    }
+    
+    try {
+      runReplay(filename, options);
+    } catch (const exception& e) {
+      cerr << e.what() << endl;
+      return -1;
+    }
+  } else if (string(argv[1]) == "--trace" && argc == 3) {
+    try {
+      runTrace(argv[2]);
+    } catch (const exception& e) {
+      cerr << e.what() << endl;
+      return -1;
+    }
+  } else if (string(argv[1]) == "--serve" && argc == 3) {
+    try {
+      runServer(argv[2]);
+    } catch (const exception& e) {
+      cerr << e.what() << endl;
+      return -1;
+    }
+  } else if (string(argv[1]) == "--load") {
+    LoadOptions options;
+    const char* path = nullptr;
+    for (int i = 2; i < argc; i++) {
+      string arg = argv[i];
+      if      (arg == "--connections" && i + 1 < argc) options.connections = strtoull(argv[++i], nullptr, 10);
+      else if (arg == "--requests"    && i + 1 < argc) options.requests    = strtoull(argv[++i], nullptr, 10);
+      else if (arg == "--pipeline"    && i + 1 < argc) options.pipeline    = strtoull(argv[++i], nullptr, 10);
+      else if (arg == "--writes"      && i + 1 < argc) options.writes      = strtoull(argv[++i], nullptr, 10);
+      else if (path == nullptr && arg[0] != '-') path = argv[i];
+      else {
+        printUsage();
+        return -1;
+      }
+    }
+    if (path == nullptr || options.connections == 0 || options.pipeline == 0) {
+      printUsage();
+      return -1;
+    }
+    
+    try {
+      runLoad(path, options);
+    } catch (const exception& e) {
+      cerr << e.what() << endl;
+      return -1;
+    }
   } else {
-    cerr << "Usage: ./explore [optional-test-file]" << endl;
+    printUsage();
     return -1;
   }
 }
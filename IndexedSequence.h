@@ -0,0 +1,423 @@
+/******************************************************************************
+ * File: IndexedSequence.h
+ *
+ * A list of values addressed by position rather than by key, with O(log n)
+ * insertion, deletion, and access anywhere in the list. It's the same
+ * augmentation that gives a RedBlackTree its select: every node knows the
+ * size of its subtree, so we can find the node at any position by walking
+ * down from the root, steering by the sizes on the left. There are no keys at
+ * all; a node's position is just the number of nodes before it in an inorder
+ * walk.
+ *
+ * The tree is balanced with the AVL rule, using the same rotations and
+ * rebalancing step as BalancedTree<AvlBalancing>, with the rank of each node
+ * being its height. AVL trees have a simple join: two trees and a node that
+ * goes between them can be combined in time proportional to the difference in
+ * their heights. Splitting a tree at a position is a series of joins down one
+ * path, so moving a whole block of values from one place to another (extract
+ * and splice) or gluing two lists together (concat) is O(log n), no matter
+ * how many values move.
+ *
+ * Nodes are never copied or reassigned once created. Rebalancing relinks
+ * them, so references to values stay valid until those values are erased.
+ * Since splice and extract move nodes from one sequence to another, each node
+ * is allocated on its own rather than out of a TreeCore's per-tree chunks.
+ */
+#pragma once
+
+#include "Balancing.h"
+#include <cstddef>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+template <typename T> class IndexedSequence {
+public:
+  IndexedSequence() = default;
+  ~IndexedSequence();
+
+  /**
+   * Moves the contents of another sequence into this one in O(1) time,
+   * leaving the other one empty.
+   */
+  IndexedSequence(IndexedSequence&& rhs) noexcept;
+  IndexedSequence& operator= (IndexedSequence&& rhs) noexcept;
+
+  /**
+   * Builds a perfectly balanced sequence holding the given values, in order,
+   * in O(n) time.
+   */
+  static IndexedSequence fromVector(const std::vector<T>& values);
+
+  std::size_t getSize() const {
+    return sizeOf(root);
+  }
+
+  /**
+   * Returns the value at the given position. If the position is out of
+   * range, this throws a std::runtime_error.
+   */
+  const T& at(std::size_t index) const;
+  T&       at(std::size_t index);
+
+  /**
+   * Inserts the value so that it ends up at the given position, shifting
+   * everything from there on back by one. The position may be anywhere from
+   * 0 to the size of the sequence; if it isn't, this throws a
+   * std::runtime_error.
+   */
+  void insertAt(std::size_t index, T value);
+
+  /**
+   * Removes the value at the given position, shifting everything after it
+   * forward by one. If the position is out of range, this throws a
+   * std::runtime_error.
+   */
+  void eraseAt(std::size_t index);
+
+  /**
+   * Removes the values in positions [begin, end) and returns them as a
+   * sequence of their own, in O(log n) time. If the range isn't valid, this
+   * throws a std::runtime_error.
+   */
+  IndexedSequence extract(std::size_t begin, std::size_t end);
+
+  /**
+   * Moves every value of the other sequence into this one, so that the first
+   * of them ends up at the given position, in O(log n + log m) time. The
+   * other sequence is left empty. If the position is past the end of this
+   * sequence, this throws a std::runtime_error.
+   */
+  void splice(std::size_t index, IndexedSequence&& other);
+
+  /**
+   * Appends every value of the other sequence to this one, leaving the other
+   * one empty. This is splice at the end.
+   */
+  void concat(IndexedSequence&& other) {
+    splice(getSize(), std::move(other));
+  }
+
+  /**
+   * Calls fn(value) on each value in order.
+   */
+  template <typename Function> void forEach(Function fn) const;
+
+  /**
+   * Returns the number of nodes on the longest path from the root to a leaf.
+   */
+  std::size_t height() const {
+    return std::size_t(AvlBalancing::rankOf(root) + 1);
+  }
+
+private:
+  struct Node {
+    T           value;
+    int         balance;    // AVL rank: the height of the subtree, with a leaf at 0
+    std::size_t size;       // Of the subtree rooted here
+    Node*       left;
+    Node*       right;
+
+    /* The rotations and rebalancing in Balancing.h keep the size right
+     * through this.
+     */
+    friend void updateAugmentation(Node* node) {
+      node->size = (node->left? node->left->size : 0) + (node->right? node->right->size : 0) + 1;
+    }
+  };
+
+  Node* root = nullptr;
+
+  static std::size_t sizeOf(const Node* node) {
+    return node? node->size : 0;
+  }
+
+  /* Each of these takes ownership of the subtrees they're handed and returns
+   * the root of the subtree that results. Rebalancing is AvlBalancing's,
+   * which restores the AVL rule at a node whose children's heights differ by
+   * at most two.
+   */
+  static Node* insertAt(Node* node, std::size_t index, Node* newNode);
+  static Node* eraseAt(Node* node, std::size_t index, Node*& removed);
+  static Node* removeFirst(Node* node, Node*& first);
+
+  /* Combines two trees with a node that goes between them. */
+  static Node* join(Node* left, Node* middle, Node* right);
+
+  /* Combines two trees. */
+  static Node* join(Node* left, Node* right);
+
+  /* Splits a tree into its first index values and the rest. */
+  static void split(Node* node, std::size_t index, Node*& left, Node*& right);
+
+  static Node* build(std::vector<Node*>& nodes, std::size_t begin, std::size_t end);
+
+  static void destroy(Node* node);
+
+  explicit IndexedSequence(Node* root) : root(root) {}
+
+  IndexedSequence(const IndexedSequence &) = delete;
+  IndexedSequence& operator= (const IndexedSequence &) = delete;
+};
+
+/* * * * * Implementation Below This Point * * * * */
+
+template <typename T>
+IndexedSequence<T>::~IndexedSequence() {
+  destroy(root);
+}
+
+/* Frees the nodes without recursion by rotating left children up until the
+ * tree is a vine hanging off to the right, deleting nodes as they come free.
+ */
+template <typename T>
+void IndexedSequence<T>::destroy(Node* node) {
+  while (node != nullptr) {
+    if (node->left == nullptr) {
+      Node* next = node->right;
+      delete node;
+      node = next;
+    } else {
+      Node* leftChild = node->left;
+      node->left = leftChild->right;
+      leftChild->right = node;
+      node = leftChild;
+    }
+  }
+}
+
+template <typename T>
+IndexedSequence<T>::IndexedSequence(IndexedSequence&& rhs) noexcept : root(rhs.root) {
+  rhs.root = nullptr;
+}
+
+template <typename T>
+IndexedSequence<T>& IndexedSequence<T>::operator= (IndexedSequence&& rhs) noexcept {
+  if (this != &rhs) {
+    destroy(root);
+    root = rhs.root;
+    rhs.root = nullptr;
+  }
+  return *this;
+}
+
+template <typename T>
+IndexedSequence<T> IndexedSequence<T>::fromVector(const std::vector<T>& values) {
+  std::vector<Node*> nodes;
+  nodes.reserve(values.size());
+  try {
+    for (const T& value: values) {
+      nodes.push_back(new Node{ value, 0, 1, nullptr, nullptr });
+    }
+  } catch (...) {
+    for (Node* node: nodes) delete node;
+    throw;
+  }
+  return IndexedSequence(build(nodes, 0, nodes.size()));
+}
+
+/* The middle node goes on top, so the two halves differ in size by at most
+ * one, and therefore in height by at most one.
+ */
+template <typename T>
+typename IndexedSequence<T>::Node*
+IndexedSequence<T>::build(std::vector<Node*>& nodes, std::size_t begin, std::size_t end) {
+  if (begin == end) return nullptr;
+
+  std::size_t middle = begin + (end - begin) / 2;
+  Node* node  = nodes[middle];
+  node->left  = build(nodes, begin, middle);
+  node->right = build(nodes, middle + 1, end);
+  return AvlBalancing::rebalance(node);
+}
+
+template <typename T>
+const T& IndexedSequence<T>::at(std::size_t index) const {
+  if (index >= getSize()) {
+    throw std::runtime_error("IndexedSequence::at(): index out of range.");
+  }
+
+  const Node* curr = root;
+  while (true) {
+    std::size_t numLeft = sizeOf(curr->left);
+    if (index < numLeft) {
+      curr = curr->left;
+    } else if (index == numLeft) {
+      return curr->value;
+    } else {
+      index -= numLeft + 1;
+      curr = curr->right;
+    }
+  }
+}
+
+template <typename T>
+T& IndexedSequence<T>::at(std::size_t index) {
+  return const_cast<T&>(static_cast<const IndexedSequence&>(*this).at(index));
+}
+
+template <typename T>
+void IndexedSequence<T>::insertAt(std::size_t index, T value) {
+  if (index > getSize()) {
+    throw std::runtime_error("IndexedSequence::insertAt(): index out of range.");
+  }
+  root = insertAt(root, index, new Node{ std::move(value), 0, 1, nullptr, nullptr });
+}
+
+template <typename T>
+typename IndexedSequence<T>::Node*
+IndexedSequence<T>::insertAt(Node* node, std::size_t index, Node* newNode) {
+  if (node == nullptr) return newNode;
+
+  std::size_t numLeft = sizeOf(node->left);
+  if (index <= numLeft) {
+    node->left = insertAt(node->left, index, newNode);
+  } else {
+    node->right = insertAt(node->right, index - numLeft - 1, newNode);
+  }
+  return AvlBalancing::rebalance(node);
+}
+
+template <typename T>
+void IndexedSequence<T>::eraseAt(std::size_t index) {
+  if (index >= getSize()) {
+    throw std::runtime_error("IndexedSequence::eraseAt(): index out of range.");
+  }
+
+  Node* removed;
+  root = eraseAt(root, index, removed);
+  delete removed;
+}
+
+/* A node with two children is replaced by its successor, which is unlinked
+ * from the right subtree and moved up into its place.
+ */
+template <typename T>
+typename IndexedSequence<T>::Node*
+IndexedSequence<T>::eraseAt(Node* node, std::size_t index, Node*& removed) {
+  std::size_t numLeft = sizeOf(node->left);
+  if (index < numLeft) {
+    node->left = eraseAt(node->left, index, removed);
+    return AvlBalancing::rebalance(node);
+  }
+  if (index > numLeft) {
+    node->right = eraseAt(node->right, index - numLeft - 1, removed);
+    return AvlBalancing::rebalance(node);
+  }
+
+  removed = node;
+  if (node->left  == nullptr) return node->right;
+  if (node->right == nullptr) return node->left;
+
+  Node* successor;
+  Node* right = removeFirst(node->right, successor);
+  successor->left  = node->left;
+  successor->right = right;
+  return AvlBalancing::rebalance(successor);
+}
+
+template <typename T>
+typename IndexedSequence<T>::Node* IndexedSequence<T>::removeFirst(Node* node, Node*& first) {
+  if (node->left == nullptr) {
+    first = node;
+    return node->right;
+  }
+  node->left = removeFirst(node->left, first);
+  return AvlBalancing::rebalance(node);
+}
+
+/* If the trees are close in height, the middle node just goes on top of
+ * them. Otherwise, we walk down the inner spine of the taller tree until we
+ * reach a subtree about as tall as the shorter tree, put the middle node on
+ * top of those two, and rebalance on the way back up. Each step back up is
+ * off by at most two, which is what rebalance handles.
+ */
+template <typename T>
+typename IndexedSequence<T>::Node* IndexedSequence<T>::join(Node* left, Node* middle, Node* right) {
+  int leftRank  = AvlBalancing::rankOf(left);
+  int rightRank = AvlBalancing::rankOf(right);
+  if (leftRank > rightRank + 1) {
+    left->right = join(left->right, middle, right);
+    return AvlBalancing::rebalance(left);
+  }
+  if (rightRank > leftRank + 1) {
+    right->left = join(left, middle, right->left);
+    return AvlBalancing::rebalance(right);
+  }
+
+  middle->left  = left;
+  middle->right = right;
+  return AvlBalancing::rebalance(middle);
+}
+
+template <typename T>
+typename IndexedSequence<T>::Node* IndexedSequence<T>::join(Node* left, Node* right) {
+  if (right == nullptr) return left;
+
+  Node* first;
+  right = removeFirst(right, first);
+  return join(left, first, right);
+}
+
+/* Each node on the path to the split point goes to one side or the other,
+ * and is joined there with the piece split off below it. The heights of
+ * those pieces increase as we go back up, so the joins telescope to O(log n)
+ * in total.
+ */
+template <typename T>
+void IndexedSequence<T>::split(Node* node, std::size_t index, Node*& left, Node*& right) {
+  if (node == nullptr) {
+    left = right = nullptr;
+    return;
+  }
+
+  std::size_t numLeft = sizeOf(node->left);
+  Node* below;
+  if (index <= numLeft) {
+    split(node->left, index, left, below);
+    right = join(below, node, node->right);
+  } else {
+    split(node->right, index - numLeft - 1, below, right);
+    left = join(node->left, node, below);
+  }
+}
+
+template <typename T>
+IndexedSequence<T> IndexedSequence<T>::extract(std::size_t begin, std::size_t end) {
+  if (begin > end || end > getSize()) {
+    throw std::runtime_error("IndexedSequence::extract(): invalid range.");
+  }
+
+  Node *before, *rest, *middle, *after;
+  split(root, begin, before, rest);
+  split(rest, end - begin, middle, after);
+  root = join(before, after);
+  return IndexedSequence(middle);
+}
+
+template <typename T>
+void IndexedSequence<T>::splice(std::size_t index, IndexedSequence&& other) {
+  if (index > getSize()) {
+    throw std::runtime_error("IndexedSequence::splice(): index out of range.");
+  }
+  if (&other == this || other.root == nullptr) return;
+
+  Node *before, *after;
+  split(root, index, before, after);
+  root = join(join(before, other.root), after);
+  other.root = nullptr;
+}
+
+template <typename T>
+template <typename Function>
+void IndexedSequence<T>::forEach(Function fn) const {
+  const Node* stack[kMaxTreeHeight];
+  std::size_t top = 0;
+  const Node* curr = root;
+  while (curr != nullptr || top > 0) {
+    for (; curr != nullptr; curr = curr->left) stack[top++] = curr;
+    curr = stack[--top];
+    fn(curr->value);
+    curr = curr->right;
+  }
+}
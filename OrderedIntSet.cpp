@@ -0,0 +1,49 @@
+#include "OrderedIntSet.h"
+#include <climits>
+#include <cstdint>
+#include <stdexcept>
+using namespace std;
+
+OrderedIntSet::OrderedIntSet()
+  : minKey(INT_MIN), maxKey(INT_MAX), tree(new RedBlackTree) {
+
+}
+
+OrderedIntSet::OrderedIntSet(int minKey, int maxKey) : minKey(minKey), maxKey(maxKey) {
+  if (minKey > maxKey) {
+    throw runtime_error("OrderedIntSet(): the range of keys is empty.");
+  }
+
+  if (uint64_t(int64_t(maxKey) - int64_t(minKey)) < kMaxDenseRange) {
+    dense.reset(new DenseIntSet(minKey, maxKey));
+  } else {
+    tree.reset(new RedBlackTree);
+  }
+}
+
+bool OrderedIntSet::insert(int key) {
+  if (key < minKey || key > maxKey) {
+    throw runtime_error("OrderedIntSet::insert(): key out of range.");
+  }
+  return dense? dense->insert(key) : tree->insert(key);
+}
+
+bool OrderedIntSet::erase(int key) {
+  return dense? dense->erase(key) : tree->erase(key);
+}
+
+bool OrderedIntSet::contains(int key) const {
+  return dense? dense->contains(key) : tree->contains(key);
+}
+
+size_t OrderedIntSet::getSize() const {
+  return dense? dense->getSize() : tree->getSize();
+}
+
+size_t OrderedIntSet::rankOf(int key) const {
+  return dense? dense->rankOf(key) : tree->rankOf(key);
+}
+
+int OrderedIntSet::select(size_t rank) const {
+  return dense? dense->select(rank) : tree->select(rank);
+}
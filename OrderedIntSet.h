@@ -0,0 +1,61 @@
+/******************************************************************************
+ * File: OrderedIntSet.h
+ *
+ * An order statistics set of ints that picks its own representation. If you
+ * declare up front that every key will fall in some range, and that range is
+ * small enough, the keys go in a DenseIntSet (one bit per possible key).
+ * Otherwise they go in a RedBlackTree. Either way, the interface is the same.
+ */
+#pragma once
+
+#include "DenseIntSet.h"
+#include "RedBlackTree.h"
+#include <cstddef>
+#include <memory>
+
+class OrderedIntSet {
+public:
+  /**
+   * Creates an empty set that can hold any int. This is always backed by a
+   * red/black tree.
+   */
+  OrderedIntSet();
+
+  /**
+   * Creates an empty set that only holds keys from minKey to maxKey,
+   * inclusive. Inserting a key outside that range throws a
+   * std::runtime_error, whichever representation is chosen. If minKey >
+   * maxKey, the constructor throws a std::runtime_error.
+   */
+  OrderedIntSet(int minKey, int maxKey);
+
+  /**
+   * Ranges up to this many keys are stored as a bitset, which takes a bit
+   * over one bit per possible key (32MB at the limit).
+   */
+  static constexpr std::size_t kMaxDenseRange = std::size_t(1) << 28;
+
+  /**
+   * Returns whether the set is backed by a bitset rather than a tree.
+   */
+  bool isDense() const {
+    return dense != nullptr;
+  }
+
+  /**
+   * These behave exactly like their RedBlackTree counterparts.
+   */
+  bool        insert(int key);
+  bool        erase(int key);
+  bool        contains(int key) const;
+  std::size_t getSize() const;
+  std::size_t rankOf(int key) const;
+  int         select(std::size_t rank) const;
+
+private:
+  int minKey, maxKey;
+
+  /* Exactly one of these is non-null. */
+  std::unique_ptr<DenseIntSet>  dense;
+  std::unique_ptr<RedBlackTree> tree;
+};
@@ -0,0 +1,151 @@
+#include "PublishedTree.h"
+#include <algorithm>
+#include <iterator>
+#include <utility>
+using namespace std;
+
+PublishedTree::PublishedTree(RedBlackTree::Duplicates duplicates)
+  : duplicates(duplicates), reclaimer(make_shared<Reclaimer>()),
+    current(adopt(RedBlackTree(duplicates))),
+    builder(&PublishedTree::runBuilder, this) {
+  reclaimer->owner = this;
+}
+
+/* Once owner is cleared, no deleter touches this object again, so the
+ * versions still out there free themselves. Anything already handed over is
+ * freed by the builder before it stops.
+ */
+PublishedTree::~PublishedTree() {
+  {
+    lock_guard<mutex> guard(reclaimer->lock);
+    reclaimer->owner = nullptr;
+  }
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  wakeup.notify_one();
+  builder.join();
+}
+
+PublishedTree::Snapshot PublishedTree::snapshot() const {
+  return atomic_load(&current);
+}
+
+/* The deleter holds the reclaimer's lock while it uses owner, which keeps the
+ * destructor from finishing underneath it. Nothing drops a snapshot while
+ * holding lock, so taking lock inside the reclaimer's lock can't deadlock.
+ */
+PublishedTree::Snapshot PublishedTree::adopt(RedBlackTree tree) {
+  shared_ptr<Reclaimer> reclaimer = this->reclaimer;
+  return Snapshot(new RedBlackTree(std::move(tree)), [reclaimer](const RedBlackTree* tree) {
+    {
+      lock_guard<mutex> guard(reclaimer->lock);
+      if (PublishedTree* owner = reclaimer->owner) {
+        {
+          lock_guard<mutex> ownerGuard(owner->lock);
+          owner->dropped.push_back(tree);
+        }
+        owner->wakeup.notify_one();
+        return;
+      }
+    }
+    delete tree;
+  });
+}
+
+void PublishedTree::wait() {
+  unique_lock<mutex> guard(lock);
+  idle.wait(guard, [&] { return pending.empty() && !building; });
+}
+
+void PublishedTree::enqueue(BuildFn build) {
+  {
+    lock_guard<mutex> guard(lock);
+    pending.push_back(std::move(build));
+  }
+  wakeup.notify_one();
+}
+
+void PublishedTree::rebuild(vector<int> keys) {
+  enqueue([this, keys = std::move(keys)](const RedBlackTree &) mutable {
+    if (!is_sorted(keys.begin(), keys.end())) sort(keys.begin(), keys.end());
+    return RedBlackTree::fromSorted(keys, duplicates);
+  });
+}
+
+/* Merges the inserts into the current keys, then takes out the erases. In a
+ * set, each key is present at most once before the erases go out, so erasing a
+ * key removes it regardless of how many times it was inserted.
+ */
+void PublishedTree::rebuildWithDelta(vector<int> inserts, vector<int> erases) {
+  enqueue([this, inserts = std::move(inserts), erases = std::move(erases)]
+          (const RedBlackTree& base) mutable {
+    sort(inserts.begin(), inserts.end());
+    sort(erases.begin(),  erases.end());
+
+    vector<int> existing = base.toSortedArray();
+    vector<int> merged;
+    merged.reserve(existing.size() + inserts.size());
+    merge(existing.begin(), existing.end(), inserts.begin(), inserts.end(),
+          back_inserter(merged));
+    if (duplicates == RedBlackTree::Duplicates::REJECT) {
+      merged.erase(unique(merged.begin(), merged.end()), merged.end());
+    }
+
+    /* set_difference removes one copy of a key for each copy of it in the
+     * erases, which is exactly what erase() does.
+     */
+    vector<int> result;
+    result.reserve(merged.size());
+    set_difference(merged.begin(), merged.end(), erases.begin(), erases.end(),
+                   back_inserter(result));
+    return RedBlackTree::fromSorted(result, duplicates);
+  });
+}
+
+/* The builder runs rebuilds one at a time, publishing each with an atomic
+ * store. Whoever lets go of the last reference to a version, be it a reader or
+ * the builder itself, puts it on the dropped list and wakes the builder, which
+ * frees it without holding the lock. Between rebuilds and frees, the builder
+ * sleeps until someone wakes it.
+ */
+void PublishedTree::runBuilder() {
+  unique_lock<mutex> guard(lock);
+  while (true) {
+    if (!pending.empty()) {
+      BuildFn build = std::move(pending.front());
+      pending.pop_front();
+      building = true;
+      guard.unlock();
+
+      Snapshot old = snapshot();
+      atomic_store(&current, adopt(build(*old)));
+      numPublished++;
+
+      /* If no reader holds the old version, this hands it straight back. */
+      old.reset();
+
+      guard.lock();
+      building = false;
+      if (pending.empty()) idle.notify_all();
+      continue;
+    }
+
+    if (!dropped.empty()) {
+      vector<const RedBlackTree*> toFree;
+      toFree.swap(dropped);
+      guard.unlock();
+      for (const RedBlackTree* tree: toFree) {
+        delete tree;
+      }
+      guard.lock();
+
+      /* A rebuild may have come in while the lock was released. */
+      continue;
+    }
+
+    if (stopping) return;
+    wakeup.wait(guard);
+  }
+}
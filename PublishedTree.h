@@ -0,0 +1,131 @@
+/******************************************************************************
+ * File: PublishedTree.h
+ *
+ * A read-mostly red/black tree that's refreshed by rebuilding it from scratch
+ * in the background. Readers grab a snapshot, which is an immutable tree that
+ * stays valid for as long as they hold on to it, and query it without any
+ * locking. Meanwhile a builder thread bulk-loads the next version, either from
+ * a fresh set of keys or from the current version plus a batch of changes,
+ * and then publishes it with a single atomic pointer swap.
+ *
+ * Old versions are reclaimed by the builder thread once the last reader lets
+ * go of them, so readers never pay for tearing a tree down. Letting go of the
+ * last reference is what wakes the builder to do it, so an idle PublishedTree
+ * never wakes up, no matter how long a reader holds on to an old snapshot.
+ */
+#pragma once
+
+#include "RedBlackTree.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class PublishedTree {
+public:
+  /* An immutable version of the tree. */
+  using Snapshot = std::shared_ptr<const RedBlackTree>;
+
+  /**
+   * Creates a published tree whose first version is empty.
+   */
+  explicit PublishedTree(RedBlackTree::Duplicates duplicates = RedBlackTree::Duplicates::REJECT);
+
+  /**
+   * Waits for every requested rebuild to be published, then stops the
+   * builder thread. Old versions that readers still hold are freed by
+   * whichever reader lets go of them last.
+   */
+  ~PublishedTree();
+
+  /**
+   * Returns the most recently published version of the tree. This never
+   * blocks, and the snapshot is unaffected by any later rebuilds.
+   */
+  Snapshot snapshot() const;
+
+  /**
+   * Returns how many versions have been published since construction.
+   */
+  std::uint64_t version() const {
+    return numPublished.load();
+  }
+
+  /**
+   * Queues up a new version holding exactly the given keys to be built on the
+   * background thread, and returns immediately. The keys needn't be sorted,
+   * though the build is faster if they are.
+   */
+  void rebuild(std::vector<int> keys);
+
+  /**
+   * Queues up a new version consisting of whatever version precedes it with
+   * the given keys inserted and then the given keys erased, as though by
+   * calls to RedBlackTree::insert and RedBlackTree::erase. Rebuilds run one at
+   * a time in the order they were requested, so a series of deltas is applied
+   * in order.
+   */
+  void rebuildWithDelta(std::vector<int> inserts, std::vector<int> erases);
+
+  /**
+   * Waits until every rebuild requested so far has been published. This
+   * doesn't wait for old versions to be reclaimed, so it's safe to call while
+   * holding a snapshot.
+   */
+  void wait();
+
+private:
+  RedBlackTree::Duplicates duplicates;
+
+  /* Lets the deleter of a snapshot find the PublishedTree it came from, so it
+   * can hand the tree to the builder instead of freeing it on the spot. The
+   * destructor clears owner, after which the last reference to a version
+   * frees it directly.
+   */
+  struct Reclaimer {
+    std::mutex     lock;
+    PublishedTree* owner = nullptr;
+  };
+  std::shared_ptr<Reclaimer> reclaimer;
+
+  /* The latest version. This is only ever accessed through std::atomic_load
+   * and std::atomic_store so that readers and the builder can share it.
+   */
+  Snapshot current;
+  std::atomic<std::uint64_t> numPublished{0};
+
+  /* Turns the latest version into the next one. */
+  using BuildFn = std::function<RedBlackTree (const RedBlackTree&)>;
+
+  /* State shared with the builder thread, all guarded by lock. The builder
+   * sleeps on wakeup until there's something to do, and anyone waiting for
+   * the queue to empty sleeps on idle.
+   */
+  std::mutex lock;
+  std::condition_variable wakeup;
+  std::condition_variable idle;
+  std::deque<BuildFn> pending;              // Rebuilds that haven't started yet
+  bool building = false;                    // Whether a rebuild is running right now
+  bool stopping = false;                    // Set by the destructor
+  std::vector<const RedBlackTree*> dropped; // Versions nobody references any more
+
+  /* Declared last so that the thread starts after everything it touches. */
+  std::thread builder;
+
+  void enqueue(BuildFn build);
+  void runBuilder();
+
+  /* Wraps a newly built version in a snapshot that, once its last reference
+   * goes away, is handed back to the builder to free.
+   */
+  Snapshot adopt(RedBlackTree tree);
+
+  PublishedTree(const PublishedTree &) = delete;
+  void operator= (PublishedTree) = delete;
+};
@@ -0,0 +1,133 @@
+#include "QuantileSketch.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+using namespace std;
+
+namespace {
+  /* Each compactor is this fraction of the size of the one above it. */
+  const double kCapacityRatio = 2.0 / 3.0;
+
+  /* Every compactor can hold at least this many samples, so compacting one
+   * always frees up space.
+   */
+  const size_t kMinCapacity = 2;
+}
+
+QuantileSketch::QuantileSketch(size_t k, uint32_t seed) : k(k), gen(seed) {
+  if (k < 8) {
+    throw runtime_error("QuantileSketch(): k must be at least 8.");
+  }
+  addCompactor();
+}
+
+void QuantileSketch::addCompactor() {
+  compactors.emplace_back();
+
+  totalCapacity = 0;
+  for (size_t h = 0; h < compactors.size(); h++) totalCapacity += capacityOf(h);
+}
+
+/* The top compactor gets k samples and each one below gets two thirds of the
+ * one above, rounded up.
+ */
+size_t QuantileSketch::capacityOf(size_t h) const {
+  size_t depth = compactors.size() - 1 - h;
+  return max(kMinCapacity, size_t(ceil(double(k) * pow(kCapacityRatio, double(depth)))));
+}
+
+void QuantileSketch::add(int value) {
+  compactors[0].push_back(value);
+  numSamples++;
+  retained++;
+  sortedIsCurrent = false;
+
+  if (retained >= totalCapacity) compress();
+}
+
+/* Sorting the compactor and promoting every other sample means that, for any
+ * value, the number of samples below it changes by at most one sample's
+ * weight, up or down with equal probability. If the compactor has an odd
+ * number of samples, the smallest one stays behind so the rest pair up.
+ */
+void QuantileSketch::compress() {
+  for (size_t h = 0; h < compactors.size(); h++) {
+    if (compactors[h].size() < capacityOf(h)) continue;
+
+    /* Make room for the promoted samples before taking any references. */
+    if (h + 1 == compactors.size()) addCompactor();
+
+    vector<int>& level = compactors[h];
+    vector<int>& above = compactors[h + 1];
+    sort(level.begin(), level.end());
+
+    size_t first = level.size() % 2;
+    size_t offset = gen() & 1;
+    for (size_t i = first + offset; i < level.size(); i += 2) {
+      above.push_back(level[i]);
+    }
+
+    retained -= (level.size() - first) / 2;
+    level.resize(first);
+    return;
+  }
+}
+
+void QuantileSketch::refreshSorted() const {
+  if (sortedIsCurrent) return;
+
+  sorted.clear();
+  sorted.reserve(retained);
+  for (size_t h = 0; h < compactors.size(); h++) {
+    for (int value: compactors[h]) {
+      sorted.emplace_back(value, uint64_t(1) << h);
+    }
+  }
+  sort(sorted.begin(), sorted.end());
+
+  /* Turn the weights into running totals. */
+  uint64_t total = 0;
+  for (auto& entry: sorted) {
+    total += entry.second;
+    entry.second = total;
+  }
+  sortedIsCurrent = true;
+}
+
+uint64_t QuantileSketch::rankOf(int value) const {
+  refreshSorted();
+  auto itr = lower_bound(sorted.begin(), sorted.end(), value,
+                         [](const pair<int, uint64_t>& entry, int value) {
+    return entry.first < value;
+  });
+  return itr == sorted.begin()? 0 : prev(itr)->second;
+}
+
+/* The answer is the first sample whose running total passes the rank. */
+int QuantileSketch::select(uint64_t rank) const {
+  if (rank >= numSamples) {
+    throw runtime_error("QuantileSketch::select(): rank out of range.");
+  }
+
+  refreshSorted();
+  auto itr = upper_bound(sorted.begin(), sorted.end(), rank,
+                         [](uint64_t rank, const pair<int, uint64_t>& entry) {
+    return rank < entry.second;
+  });
+  return itr->first;
+}
+
+double QuantileSketch::quantile(double q) const {
+  if (numSamples == 0) return numeric_limits<double>::quiet_NaN();
+
+  double position = min(max(q, 0.0), 1.0) * double(numSamples - 1);
+  return select(uint64_t(llround(position)));
+}
+
+/* The empirical fit for KLL sketches from the Apache DataSketches library,
+ * which holds at 99% confidence.
+ */
+double QuantileSketch::errorBound() const {
+  return 2.446 / pow(double(k), 0.9433);
+}
@@ -0,0 +1,122 @@
+/******************************************************************************
+ * File: QuantileSketch.h
+ *
+ * An approximate companion to RedBlackTree for streams too big to hold every
+ * sample. It answers rank, select, and quantile queries in space that grows
+ * only logarithmically with the number of samples, at the cost of some error
+ * in the ranks it reports.
+ *
+ * This is a KLL sketch (Karnin, Lang, and Liberty, "Optimal Quantile
+ * Approximation in Streams"). Samples are kept in a stack of compactors.
+ * Compactor h holds samples that each stand in for 2^h samples from the
+ * stream. When the sketch gets too big, a compactor that's over its capacity
+ * is sorted and either its even-indexed or its odd-indexed samples (chosen at
+ * random) are promoted to the compactor above, which halves the number of
+ * samples while keeping every rank unbiased. Lower compactors get
+ * geometrically smaller capacities, which is what keeps the error from
+ * piling up.
+ *
+ * The accuracy is controlled by k, the capacity of the top compactor. A
+ * rank reported by the sketch is within errorBound() * size() of the true
+ * rank with high probability (about 99%).
+ *
+ * Queries cache a sorted view of the samples, so unlike RedBlackTree, even
+ * const queries on one sketch mustn't run at the same time.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <utility>
+#include <vector>
+
+class QuantileSketch {
+public:
+  /**
+   * Creates an empty sketch with the given accuracy parameter. Larger values
+   * of k use more memory and give smaller errors; k = 200 gives ranks within
+   * about 1.7% of the number of samples. If k is less than 8, this throws a
+   * std::runtime_error.
+   */
+  explicit QuantileSketch(std::size_t k = 200, std::uint32_t seed = 137);
+
+  /**
+   * Adds a sample to the sketch. This takes amortized O(log k) time.
+   */
+  void add(int value);
+
+  /**
+   * Returns the number of samples added so far.
+   */
+  std::uint64_t size() const {
+    return numSamples;
+  }
+
+  /**
+   * Returns an estimate of the number of samples less than the given value.
+   */
+  std::uint64_t rankOf(int value) const;
+
+  /**
+   * Returns a sample whose rank is approximately the given rank. If the
+   * rank isn't less than size(), this throws a std::runtime_error.
+   */
+  int select(std::uint64_t rank) const;
+
+  /**
+   * Returns an estimate of the q-quantile (0 <= q <= 1) of the samples, the
+   * sample with rank closest to q * (size() - 1). If the sketch is empty,
+   * this returns NaN.
+   */
+  double quantile(double q) const;
+
+  /**
+   * The rank error, as a fraction of size(), that the sketch stays within
+   * with about 99% probability.
+   */
+  double errorBound() const;
+
+  /**
+   * Returns how many samples the sketch is currently holding on to, which
+   * determines how much memory it uses.
+   */
+  std::size_t numRetained() const {
+    return retained;
+  }
+
+private:
+  std::size_t   k;
+  std::uint64_t numSamples = 0;
+  std::size_t   retained   = 0;
+
+  /* compactors[h] holds samples of weight 2^h. */
+  std::vector<std::vector<int>> compactors;
+
+  /* The sum of all compactors' capacities. Once the sketch retains this many
+   * samples, something needs compacting.
+   */
+  std::size_t totalCapacity = 0;
+
+  /* Decides which half of a compactor gets promoted. */
+  std::mt19937 gen;
+
+  /* The retained samples in sorted order, paired with the total weight of
+   * all samples up to and including them. Rebuilt lazily by queries after
+   * the sketch changes.
+   */
+  mutable std::vector<std::pair<int, std::uint64_t>> sorted;
+  mutable bool sortedIsCurrent = true;
+
+  /* How many samples compactor h may hold before it must be compacted. */
+  std::size_t capacityOf(std::size_t h) const;
+
+  /* Adds a new compactor on top, shrinking the capacities of the others. */
+  void addCompactor();
+
+  /* Compacts the lowest compactor that's over capacity. */
+  void compress();
+
+  /* Makes sure that sorted reflects the current contents of the sketch. */
+  void refreshSorted() const;
+};
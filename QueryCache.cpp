@@ -0,0 +1,70 @@
+#include "QueryCache.h"
+#include <stdexcept>
+using namespace std;
+
+QueryCache::QueryCache(const RedBlackTree& tree, size_t capacity) : tree(tree) {
+  if (capacity == 0) {
+    throw runtime_error("QueryCache needs room for at least one result.");
+  }
+
+  size_t length = 1;
+  shift = 64;
+  while (length < capacity) {
+    length *= 2;
+    shift--;
+  }
+  entries.assign(length, Entry{ 0, 0, 0, Op::NONE });
+}
+
+/* Fibonacci hashing: multiply by 2^64 / phi and keep the top bits, which
+ * spreads out runs of consecutive keys and ranks. The op is folded in first
+ * so that rankOf(k) and select(k) don't always fight over the same slot.
+ */
+QueryCache::Entry& QueryCache::lookup(Op op, uint64_t argument, bool& hit) {
+  uint64_t hash = (argument * 2 + uint64_t(op == Op::SELECT)) * 0x9E3779B97F4A7C15ull;
+  Entry& entry = entries[shift == 64? 0 : size_t(hash >> shift)];
+
+  if (entry.op == op && entry.argument == argument) {
+    if (entry.version == tree.version()) {
+      hits++;
+      hit = true;
+      return entry;
+    }
+    staleMisses++;
+  }
+  misses++;
+  hit = false;
+  return entry;
+}
+
+size_t QueryCache::rankOf(int key) {
+  bool hit;
+  Entry& entry = lookup(Op::RANK_OF, uint64_t(int64_t(key)), hit);
+  if (!hit) {
+    entry = Entry{ tree.version(), uint64_t(int64_t(key)), tree.rankOf(key), Op::RANK_OF };
+  }
+  return size_t(entry.result);
+}
+
+/* An out-of-range select throws before the entry is touched, so whatever was
+ * in the slot is still good.
+ */
+int QueryCache::select(size_t rank) {
+  bool hit;
+  Entry& entry = lookup(Op::SELECT, rank, hit);
+  if (!hit) {
+    int key = tree.select(rank);
+    entry = Entry{ tree.version(), rank, uint64_t(int64_t(key)), Op::SELECT };
+  }
+  return int(int64_t(entry.result));
+}
+
+double QueryCache::hitRate() const {
+  size_t total = hits + misses;
+  return total == 0? 0.0 : double(hits) / double(total);
+}
+
+void QueryCache::clear() {
+  for (auto& entry: entries) entry.op = Op::NONE;
+  hits = misses = staleMisses = 0;
+}
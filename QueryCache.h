@@ -0,0 +1,95 @@
+/******************************************************************************
+ * File: QueryCache.h
+ *
+ * A small cache of rankOf and select results for a RedBlackTree, for
+ * workloads like dashboards and paginated listings that ask the same few
+ * questions over and over while the tree rarely changes. Each answer costs a
+ * full descent of the tree, which on a large tree is a cache miss at nearly
+ * every level; a repeat answered from here is one hash and one compare.
+ *
+ * Entries are tagged with the tree's version() at the time they were
+ * computed, and an entry only counts as a hit while the tree is still at
+ * that version. Every change to the tree bumps the version, so nothing ever
+ * has to be invalidated explicitly and the tree's write path pays nothing
+ * but an increment. The flip side is that one insert makes every entry
+ * stale at once, so the cache only helps when queries far outnumber writes.
+ *
+ * The table is direct-mapped: each (operation, argument) pair has exactly one
+ * slot it can live in, and a new result simply overwrites whatever was there.
+ *
+ * A QueryCache isn't thread-safe, even if the tree is only being read. Give
+ * each reader its own.
+ */
+#pragma once
+
+#include "RedBlackTree.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class QueryCache {
+public:
+  /**
+   * Creates an empty cache in front of the given tree, with room for at
+   * least the given number of results. The tree must outlive the cache. If
+   * the capacity is zero, this throws a std::runtime_error.
+   */
+  explicit QueryCache(const RedBlackTree& tree, std::size_t capacity = 1024);
+
+  /**
+   * These return exactly what the tree would. A select past the end of the
+   * tree throws, just as the tree does, and isn't cached.
+   */
+  std::size_t rankOf(int key);
+  int         select(std::size_t rank);
+
+  /**
+   * Returns how many queries were answered from the cache and how many went
+   * to the tree. Of the misses, staleMisses counts the ones whose slot held
+   * the same query from an older version of the tree.
+   */
+  std::size_t numHits() const {
+    return hits;
+  }
+  std::size_t numMisses() const {
+    return misses;
+  }
+  std::size_t numStaleMisses() const {
+    return staleMisses;
+  }
+
+  /**
+   * Returns the fraction of queries answered from the cache, or zero if
+   * there haven't been any.
+   */
+  double hitRate() const;
+
+  /**
+   * Forgets every cached result and zeroes the statistics.
+   */
+  void clear();
+
+private:
+  enum class Op : std::uint8_t { NONE, RANK_OF, SELECT };
+
+  struct Entry {
+    std::uint64_t version;
+    std::uint64_t argument;
+    std::uint64_t result;
+    Op            op;
+  };
+
+  const RedBlackTree& tree;
+  std::vector<Entry>  entries;   // Size is a power of two
+  unsigned            shift;     // 64 - log2(entries.size())
+
+  std::size_t hits        = 0;
+  std::size_t misses      = 0;
+  std::size_t staleMisses = 0;
+
+  /* Returns the slot for the query, bumping the statistics. If the slot holds
+   * a current answer, sets hit and leaves the answer in the entry; otherwise
+   * the caller fills it in.
+   */
+  Entry& lookup(Op op, std::uint64_t argument, bool& hit);
+};
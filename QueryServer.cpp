@@ -0,0 +1,271 @@
+#include "QueryServer.h"
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+using namespace std;
+
+namespace {
+  /* How much to read from a socket at once. */
+  const size_t kReadBytes = 1 << 16;
+
+  void putFrame(vector<unsigned char>& out, uint8_t tag, uint32_t value) {
+    out.push_back(tag);
+    for (int shift = 0; shift < 32; shift += 8) out.push_back((value >> shift) & 0xFF);
+  }
+
+  uint32_t valueOf(const unsigned char* frame) {
+    return uint32_t(frame[1]) | uint32_t(frame[2]) << 8 | uint32_t(frame[3]) << 16 | uint32_t(frame[4]) << 24;
+  }
+
+  /* Returns the address of the socket at the given path, which has to fit in
+   * the small fixed-size array Unix uses for it.
+   */
+  sockaddr_un addressOf(const string& path) {
+    sockaddr_un result;
+    memset(&result, 0, sizeof(result));
+    result.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(result.sun_path)) {
+      throw runtime_error("Socket path \"" + path + "\" is too long.");
+    }
+    memcpy(result.sun_path, path.c_str(), path.size());
+    return result;
+  }
+
+  /* Writes all of the data, retrying short writes. Returns false if the
+   * other end has gone away.
+   */
+  bool sendAll(int fd, const unsigned char* data, size_t length) {
+    while (length > 0) {
+      ssize_t sent = ::send(fd, data, length, MSG_NOSIGNAL);
+      if (sent < 0 && errno == EINTR) continue;
+      if (sent <= 0) return false;
+      data   += sent;
+      length -= size_t(sent);
+    }
+    return true;
+  }
+
+  bool isWrite(TraceOp op) {
+    return op == TraceOp::INSERT;
+  }
+}
+
+QueryServer::QueryServer(RedBlackTree& tree, const string& path) : tree(tree), path(path) {
+  sockaddr_un address = addressOf(path);
+
+  listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    throw runtime_error("Cannot create a socket.");
+  }
+  unlink(path.c_str());
+  if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+      listen(listener, SOMAXCONN) != 0) {
+    close(listener);
+    throw runtime_error("Cannot listen on socket \"" + path + "\".");
+  }
+  if (pipe(wakeup) != 0) {
+    close(listener);
+    unlink(path.c_str());
+    throw runtime_error("Cannot create a pipe.");
+  }
+}
+
+QueryServer::~QueryServer() {
+  close(listener);
+  close(wakeup[0]);
+  close(wakeup[1]);
+  unlink(path.c_str());
+}
+
+void QueryServer::stop() {
+  char byte = 0;
+  while (write(wakeup[1], &byte, 1) < 0 && errno == EINTR) { }
+}
+
+/* Waits on both the listening socket and the wakeup pipe, so that stop() can
+ * get us out of an accept that would otherwise block forever. Connection
+ * threads are detached, so a long-running server doesn't hold on to one
+ * thread object per connection it has ever served. Each of them blocks in
+ * recv, so we shut their sockets down to wake them up, then wait for the last
+ * one to take its connection out of the set.
+ */
+void QueryServer::run() {
+  while (true) {
+    pollfd waitFor[2] = { { listener, POLLIN, 0 }, { wakeup[0], POLLIN, 0 } };
+    if (poll(waitFor, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (waitFor[1].revents != 0) break;
+
+    int connection = accept(listener, nullptr, nullptr);
+    if (connection < 0) continue;
+    {
+      lock_guard<mutex> guard(connectionsLock);
+      connections.insert(connection);
+    }
+    thread(&QueryServer::serve, this, connection).detach();
+  }
+
+  {
+    unique_lock<mutex> guard(connectionsLock);
+    for (int connection: connections) shutdown(connection, SHUT_RDWR);
+    allClosed.wait(guard, [&] { return connections.empty(); });
+  }
+
+  char byte;
+  while (read(wakeup[0], &byte, 1) < 0 && errno == EINTR) { }
+}
+
+/* Anything after the last complete frame stays in the buffer until the rest
+ * of it arrives. The connection is closed and taken out of the set in one
+ * step, so that accept can't hand out the same descriptor in between. That's
+ * the last time this thread touches the server, which run() may return from
+ * as soon as the lock is released.
+ */
+void QueryServer::serve(int connection) {
+  vector<unsigned char> pending, replies;
+  unique_ptr<unsigned char[]> buffer(new unsigned char[kReadBytes]);
+  while (true) {
+    ssize_t received = recv(connection, buffer.get(), kReadBytes, 0);
+    if (received < 0 && errno == EINTR) continue;
+    if (received <= 0) break;
+    pending.insert(pending.end(), buffer.get(), buffer.get() + received);
+
+    size_t complete = pending.size() - pending.size() % kQueryFrameBytes;
+    replies.clear();
+    execute(pending.data(), pending.data() + complete, replies);
+    pending.erase(pending.begin(), pending.begin() + complete);
+    if (!sendAll(connection, replies.data(), replies.size())) break;
+  }
+
+  lock_guard<mutex> guard(connectionsLock);
+  close(connection);
+  connections.erase(connection);
+  if (connections.empty()) allClosed.notify_all();
+}
+
+/* A stretch is every frame up to the next switch between reads and writes.
+ * Unknown opcodes count as reads, since answering them doesn't touch the
+ * tree. The contains keys in a read stretch are looked up together first, and
+ * then the replies go out in request order, taking each contains answer from
+ * the batch as its turn comes up.
+ */
+void QueryServer::execute(const unsigned char* begin, const unsigned char* end,
+                          vector<unsigned char>& replies) {
+  vector<int>        keys;
+  unique_ptr<bool[]> found;
+
+  for (const unsigned char* stretch = begin; stretch != end; ) {
+    bool writing = isWrite(TraceOp(stretch[0]));
+    const unsigned char* stretchEnd = stretch;
+    while (stretchEnd != end && isWrite(TraceOp(stretchEnd[0])) == writing) {
+      stretchEnd += kQueryFrameBytes;
+    }
+    batches++;
+    requests += size_t(stretchEnd - stretch) / kQueryFrameBytes;
+
+    if (writing) {
+      lock_guard<shared_mutex> guard(treeLock);
+      for (; stretch != stretchEnd; stretch += kQueryFrameBytes) {
+        putFrame(replies, uint8_t(QueryStatus::OK), tree.insert(int(valueOf(stretch))));
+      }
+      continue;
+    }
+
+    shared_lock<shared_mutex> guard(treeLock);
+    keys.clear();
+    for (const unsigned char* frame = stretch; frame != stretchEnd; frame += kQueryFrameBytes) {
+      if (TraceOp(frame[0]) == TraceOp::CONTAINS) keys.push_back(int(valueOf(frame)));
+    }
+    if (!keys.empty()) {
+      found.reset(new bool[keys.size()]);
+      tree.containsBatch(keys.data(), keys.size(), found.get());
+    }
+
+    size_t nextFound = 0;
+    for (; stretch != stretchEnd; stretch += kQueryFrameBytes) {
+      uint32_t argument = valueOf(stretch);
+      switch (TraceOp(stretch[0])) {
+        case TraceOp::CONTAINS:
+          putFrame(replies, uint8_t(QueryStatus::OK), found[nextFound++]);
+          break;
+        case TraceOp::RANK_OF:
+          putFrame(replies, uint8_t(QueryStatus::OK), uint32_t(tree.rankOf(int(argument))));
+          break;
+        case TraceOp::SELECT:
+          if (argument < tree.getSize()) {
+            putFrame(replies, uint8_t(QueryStatus::OK), uint32_t(tree.select(argument)));
+          } else {
+            putFrame(replies, uint8_t(QueryStatus::OUT_OF_RANGE), 0);
+          }
+          break;
+        default:
+          putFrame(replies, uint8_t(QueryStatus::BAD_REQUEST), 0);
+          break;
+      }
+    }
+  }
+}
+
+QueryClient::QueryClient(const string& path) {
+  sockaddr_un address = addressOf(path);
+  socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (socket < 0) {
+    throw runtime_error("Cannot create a socket.");
+  }
+  if (connect(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+    close(socket);
+    throw runtime_error("Cannot connect to socket \"" + path + "\".");
+  }
+}
+
+QueryClient::~QueryClient() {
+  close(socket);
+}
+
+void QueryClient::send(const vector<QueryRequest>& requests) {
+  vector<unsigned char> frames;
+  frames.reserve(requests.size() * kQueryFrameBytes);
+  for (const auto& request: requests) putFrame(frames, uint8_t(request.op), request.argument);
+  if (!sendAll(socket, frames.data(), frames.size())) {
+    throw runtime_error("QueryClient::send(): the server hung up.");
+  }
+}
+
+QueryReply QueryClient::receive() {
+  while (received.size() - position < kQueryFrameBytes) {
+    received.erase(received.begin(), received.begin() + position);
+    position = 0;
+
+    size_t have = received.size();
+    received.resize(have + kReadBytes);
+    ssize_t count;
+    do {
+      count = recv(socket, received.data() + have, kReadBytes, 0);
+    } while (count < 0 && errno == EINTR);
+    if (count <= 0) {
+      received.resize(have);
+      throw runtime_error("QueryClient::receive(): the server hung up.");
+    }
+    received.resize(have + size_t(count));
+  }
+
+  const unsigned char* frame = received.data() + position;
+  position += kQueryFrameBytes;
+  return { QueryStatus(frame[0]), valueOf(frame) };
+}
+
+vector<QueryReply> QueryClient::call(const vector<QueryRequest>& requests) {
+  send(requests);
+  vector<QueryReply> result;
+  result.reserve(requests.size());
+  for (size_t i = 0; i < requests.size(); i++) result.push_back(receive());
+  return result;
+}
@@ -0,0 +1,159 @@
+/******************************************************************************
+ * File: QueryServer.h
+ *
+ * Serves a RedBlackTree to other processes on the same machine over a Unix
+ * domain socket, so that services don't have to fork ./explore and talk to
+ * it a line of text at a time.
+ *
+ * Requests and replies are fixed five-byte frames. A request is an opcode
+ * byte (a TraceOp, the same vocabulary as trace files) followed by a 32-bit
+ * little-endian argument: the key for insert, contains, and rankOf, and the
+ * rank for select. A reply is a status byte followed by a 32-bit
+ * little-endian result: 0 or 1 for insert and contains, the rank for rankOf,
+ * and the key for select.
+ *
+ * Clients may pipeline as many requests as they like without waiting for
+ * replies, and replies come back in order. The server reads whatever has
+ * arrived on a connection, splits it into stretches of reads between writes,
+ * and runs each stretch as a batch: reads under one shared lock, so that
+ * connections are served concurrently, and inserts under an exclusive one.
+ * The contains requests in a stretch all go through a single containsBatch,
+ * however they're interleaved with the other reads. All the replies for one
+ * read go out in a single write.
+ */
+#pragma once
+
+#include "RedBlackTree.h"
+#include "Trace.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+/* Size of every request and reply on the wire. */
+const std::size_t kQueryFrameBytes = 5;
+
+enum class QueryStatus : std::uint8_t {
+  OK,             // The value is the result
+  OUT_OF_RANGE,   // A select past the end of the tree
+  BAD_REQUEST     // An opcode the server doesn't know
+};
+
+struct QueryRequest {
+  TraceOp       op;
+  std::uint32_t argument;   // An int key, or a rank, stored as 32 bits
+};
+
+struct QueryReply {
+  QueryStatus   status;
+  std::uint32_t value;      // An int key, a rank, or 0/1, stored as 32 bits
+};
+
+class QueryServer {
+public:
+  /**
+   * Starts listening at the given socket path, replacing any socket left
+   * there by an earlier run. The tree must outlive the server. If the socket
+   * can't be created, this throws a std::runtime_error.
+   */
+  QueryServer(RedBlackTree& tree, const std::string& path);
+
+  /**
+   * Stops the server, closes every connection, and removes the socket file.
+   */
+  ~QueryServer();
+
+  /**
+   * Accepts and serves connections, each on its own thread, until stop() is
+   * called.
+   */
+  void run();
+
+  /**
+   * Makes run() return once it's closed every connection. This can be called
+   * from any thread.
+   */
+  void stop();
+
+  /**
+   * Returns how many requests have been answered, and in how many batches.
+   */
+  std::size_t numRequests() const {
+    return requests.load();
+  }
+  std::size_t numBatches() const {
+    return batches.load();
+  }
+
+private:
+  RedBlackTree&     tree;
+  std::shared_mutex treeLock;
+  std::string       path;
+
+  int listener;
+  int wakeup[2];     // A pipe that stop() writes to, to interrupt run()
+
+  /* Open connections, so that stopping can shut them down and then wait on
+   * allClosed for every one to be closed.
+   */
+  std::mutex              connectionsLock;
+  std::condition_variable allClosed;
+  std::set<int>           connections;
+
+  std::atomic<std::size_t> requests{0};
+  std::atomic<std::size_t> batches{0};
+
+  void serve(int connection);
+
+  /* Answers every request in [begin, end), appending the replies. */
+  void execute(const unsigned char* begin, const unsigned char* end,
+               std::vector<unsigned char>& replies);
+
+  QueryServer(const QueryServer &) = delete;
+  void operator= (QueryServer) = delete;
+};
+
+/* A connection to a QueryServer. */
+class QueryClient {
+public:
+  /**
+   * Connects to the server at the given socket path, throwing a
+   * std::runtime_error on failure.
+   */
+  explicit QueryClient(const std::string& path);
+  ~QueryClient();
+
+  /**
+   * Sends the requests without waiting for any replies. The server stops
+   * reading while its replies are backed up, so a client that pipelines
+   * more than a few tens of thousands of requests must read replies as it
+   * goes.
+   */
+  void send(const std::vector<QueryRequest>& requests);
+
+  /**
+   * Waits for the next reply. If the server hangs up, this throws a
+   * std::runtime_error.
+   */
+  QueryReply receive();
+
+  /**
+   * Sends the requests, then waits for all of their replies.
+   */
+  std::vector<QueryReply> call(const std::vector<QueryRequest>& requests);
+
+private:
+  int socket;
+
+  /* Bytes received but not yet handed out as replies. */
+  std::vector<unsigned char> received;
+  std::size_t                position = 0;
+
+  QueryClient(const QueryClient &) = delete;
+  void operator= (QueryClient) = delete;
+};
@@ -2,424 +2,803 @@
 #include <iostream>
 #include <iomanip>
 #include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <charconv>
+#include <cstring>
+#include <utility>
+#include <atomic>
+#include <cerrno>
+#include <thread>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
 using namespace std;
 
-RedBlackTree::~RedBlackTree() {
-  /* Deallocates all memory used by the tree. This algorithm uses O(1) auxiliary
-   * storage space and is not recursive. It's due to a friend of mine, Leo
-   * Shamis, who mentioned it to me after I told him that I wasn't sure whether
-   * such an algorithm even existed!
-   *
-   * The algorithm is very simple. If the root has no left child, we just delete
-   * it and move on. Otherwise, it has a left child, so we do a right rotation
-   * to reduce the size of the right subtree a bit.
+namespace {
+  /* Collects output in a fixed-size buffer and hands it to the underlying
+   * stream in large chunks, which is much faster than many small writes when
+   * exporting big trees.
    */
-  while (root != nullptr) {
-    /* Case 1: The root has no left child. */
-    if (root->left == nullptr) {
-      Node* next = root->right;
-      delete root;
-      root = next;
+  class BufferedWriter {
+  public:
+    explicit BufferedWriter(ostream& out) : out(out) {}
+    
+    ~BufferedWriter() {
+      flush();
+    }
+    
+    BufferedWriter& operator<< (const char* text) {
+      size_t length = strlen(text);
+      if (used + length > sizeof(buffer)) flush();
+      if (length > sizeof(buffer)) {
+        out.write(text, length);
+      } else {
+        memcpy(buffer + used, text, length);
+        used += length;
+      }
+      return *this;
+    }
+    
+    BufferedWriter& operator<< (char ch) {
+      if (used == sizeof(buffer)) flush();
+      buffer[used++] = ch;
+      return *this;
     }
-    /* Case 2: There is a left child, so do a right rotation. */
-    else {
-      /* We could go through the rotateWithParent function, but that's
-       * unnecessary given that we're destroying the tree.
-       */
-      Node* leftChild = root->left;
-      root->left = leftChild->right;
-      leftChild->right = root;
-      root = leftChild;
+    
+    template <typename Integer> BufferedWriter& operator<< (Integer value) {
+      if (used + 32 > sizeof(buffer)) flush();
+      used = to_chars(buffer + used, buffer + sizeof(buffer), value).ptr - buffer;
+      return *this;
+    }
+    
+    void flush() {
+      out.write(buffer, used);
+      used = 0;
+    }
+    
+  private:
+    ostream& out;
+    char     buffer[1 << 15];
+    size_t   used = 0;
+  };
+  
+  /* A parallel walk cuts the tree into about this many pieces per thread, so
+   * that a thread whose share lands in a lopsided part of the tree doesn't
+   * hold everyone else up, but never into pieces smaller than the minimum,
+   * below which splitting costs more than it saves.
+   */
+  const size_t kPiecesPerThread = 8;
+  const size_t kMinPieceKeys    = 4096;
+  
+  /* How many keys writeTo collects before each write. */
+  const size_t kWriteBatchKeys = 1 << 14;
+  
+  /* Up to this many quantiles at once, quantiles keeps its scratch space on
+   * the stack. That covers the usual handful of percentiles without touching
+   * the allocator.
+   */
+  const size_t kStackQuantiles = 16;
+  
+  /* Picks a value between the keys lo and hi, which sit at adjacent ranks (or
+   * the same rank), for a quantile the given fraction of the way from one to
+   * the other.
+   */
+  double interpolate(double lo, double hi, double fraction, RedBlackTreeBase::Interpolation policy) {
+    switch (policy) {
+      case RedBlackTreeBase::Interpolation::LOWER:    return lo;
+      case RedBlackTreeBase::Interpolation::HIGHER:   return hi;
+      case RedBlackTreeBase::Interpolation::NEAREST:  return fraction <= 0.5? lo : hi;
+      case RedBlackTreeBase::Interpolation::LINEAR:   return lo + fraction * (hi - lo);
+      case RedBlackTreeBase::Interpolation::MIDPOINT: return (lo + hi) / 2;
     }
+    return lo;
   }
 }
 
-/* Standard tree search. */
-bool RedBlackTree::contains(int key) const {
-  Node* curr = root;
-  while (curr != nullptr) {
-    if      (key == curr->key)   return true;
-    else if (key <  curr->key)   curr = curr->left;
-    else /*  key >  curr->key */ curr = curr->right;
+/* Everything about a tree, including where its nodes come from, lives in these
+ * members, so moving a tree just means trading them.
+ */
+template <typename Summary>
+BasicRedBlackTree<Summary>::BasicRedBlackTree(BasicRedBlackTree&& rhs) noexcept
+  : duplicates(rhs.duplicates), policy(rhs.policy) {
+  swap(rhs);
+}
+
+template <typename Summary>
+BasicRedBlackTree<Summary>& BasicRedBlackTree<Summary>::operator= (BasicRedBlackTree&& rhs) noexcept {
+  /* Move into a temporary first so that our old nodes are freed now, rather
+   * than whenever rhs happens to be destroyed.
+   */
+  BasicRedBlackTree temp(std::move(rhs));
+  swap(temp);
+  return *this;
+}
+
+template <typename Summary>
+void BasicRedBlackTree<Summary>::swap(BasicRedBlackTree& rhs) noexcept {
+  using std::swap;
+  swap(size,       rhs.size);
+  swap(numNodes,   rhs.numNodes);
+  swap(duplicates, rhs.duplicates);
+  swap(policy,     rhs.policy);
+  Core::swap(rhs);
+  
+  /* Both trees now hold something different, so both need a version neither
+   * has had before.
+   */
+  modifications = rhs.modifications = max(modifications, rhs.modifications) + 1;
+}
+
+/* Forgets about every node in the tree. The chunks they came from are kept, so
+ * this doesn't depend on the size of the tree.
+ */
+template <typename Summary>
+void BasicRedBlackTree<Summary>::clear() {
+  forgetNodes();
+  size     = 0;
+  numNodes = 0;
+  modifications++;
+}
+
+template <typename Summary>
+bool BasicRedBlackTree<Summary>::contains(int key) const {
+  return find(key) != nullptr;
+}
+
+/* Each pass over the group moves every unfinished lookup down one level and
+ * prefetches the node it lands on. By the time the pass comes back around to
+ * that lookup, the other lookups in the group have given the prefetch time
+ * to finish.
+ */
+template <typename Summary>
+size_t BasicRedBlackTree<Summary>::containsBatch(const int* keys, size_t numKeys, bool* results) const {
+  size_t numFound = 0;
+  Node* curr[kLookupGroupSize];
+  
+  for (size_t base = 0; base < numKeys; base += kLookupGroupSize) {
+    size_t groupSize = min(kLookupGroupSize, numKeys - base);
+    for (size_t i = 0; i < groupSize; i++) {
+      curr[i] = root;
+      results[base + i] = false;
+    }
+    
+    for (size_t active = groupSize; active > 0; ) {
+      active = 0;
+      for (size_t i = 0; i < groupSize; i++) {
+        Node* node = curr[i];
+        if (node == nullptr) continue;
+        
+        int key = keys[base + i];
+        if (key == node->key) {
+          results[base + i] = true;
+          numFound++;
+          curr[i] = nullptr;
+          continue;
+        }
+        
+        node = key < node->key? node->left : node->right;
+        curr[i] = node;
+        if (node != nullptr) {
+          __builtin_prefetch(node);
+          active++;
+        }
+      }
+    }
   }
-  return false;
+  return numFound;
+}
+
+/* Standard tree search, reporting the count at the node we find. */
+template <typename Summary>
+size_t BasicRedBlackTree<Summary>::count(int key) const {
+  Node* node = find(key);
+  return node == nullptr? 0 : node->count;
 }
 
 /* Insertion works in two phases. First, we do the regular BST insertion. Then,
  * we apply fixup rules to correct the tree
  */
-bool RedBlackTree::insert(int key) {
+template <typename Summary>
+bool BasicRedBlackTree<Summary>::insert(int key) {
   /* Insert the key and get a pointer to the new node. The insertion function
-   * returns null if the key already existed.
+   * returns null if the key already existed, in which case a multiset will
+   * have counted the new copy and a set will have done nothing.
+   *
+   * Top-down insertion does its fixups on the way down, so it's done at this
+   * point. Bottom-up insertion still needs to restore the red/black properties.
    */
-  Node* node = insertKey(key);
-  if (node == nullptr) return false;
+  bool countDuplicates = duplicates == Duplicates::COUNT;
+  Path path;
+  Node* node = policy == InsertPolicy::TOP_DOWN? insertTopDown(key, countDuplicates)
+                                               : insertKey(key, countDuplicates, path);
+  if (node == nullptr && duplicates == Duplicates::REJECT) return false;
   
-  /* Now, perform fixup logic to restore the red/black properties. */
-  fixupFrom(node);
+  if (node != nullptr) {
+    if (policy == InsertPolicy::BOTTOM_UP) RedBlackBalancing::insertFixup(static_cast<Core&>(*this), node, path);
+    numNodes++;
+  }
 
   /* Update the tree size. */
   size++;
+  modifications++;
 
   return true;
 }
 
-/* Inserts the given key into the red/black tree, returning either a pointer to
- * the newly-created node holding it or a null pointer if the key already was
- * present in the tree.
+/* Top-down insertion, in a single pass from the root to the insertion point.
+ *
+ * Bottom-up insertion may have to split a chain of 4-nodes all the way back up
+ * to the root after the insertion. Top-down insertion avoids that by splitting
+ * every 4-node it passes on the way down, so when it reaches the bottom the
+ * parent is guaranteed to be a 2-node or a 3-node with room for the new key.
+ * That way, everything happens on the way down; we never need to revisit an
+ * ancestor, so no parent pointers are read.
+ *
+ * Splitting a 4-node (a black node with two red children) just flips its
+ * colors, kicking the middle key up into the node above. If that node was a
+ * 3-node, this gives us two reds in a row, fixed with the same rotations as in
+ * the bottom-up 3-node case.
+ *
+ * Subtree sizes are updated in the same pass: we add the new key to each node
+ * as we leave it heading downward. Rotations recompute sizes from children, so
+ * after a rotation we restart from the top of the rotated nodes, all of which
+ * were recomputed without the new key, before heading down again.
  */
-RedBlackTree::Node* RedBlackTree::insertKey(int key) {
+template <typename Summary>
+typename BasicRedBlackTree<Summary>::Node* BasicRedBlackTree<Summary>::insertTopDown(int key, bool countDuplicates) {
+  /* As with bottom-up insertion, we need to know up front whether this is a new
+   * key. Duplicates don't change the shape of the tree, so they're handled in
+   * the usual way.
+   */
   if (this->contains(key)) {
+    if (countDuplicates) {
+      Path unused;
+      insertKey(key, true, unused);
+    }
     return nullptr;
   }
-  /* Step one: Find the insertion point. */
-  Node* prev = nullptr;
-  Node* curr = root;
   
-  while (curr != nullptr) {
-    prev = curr;
+  auto isRed = [](Node* n) {
+    return n != nullptr && n->balance == Color::RED;
+  };
+  
+  /* Ancestors of the current node. Each of these has already had the new key
+   * added into its sizes and summary; the current node hasn't.
+   */
+  Path path;
+  
+  /* Given a red node whose parent is also red, rotates them (and the black
+   * grandparent) into a black node with two red children. Returns the node now
+   * on top, having popped the parent and grandparent off the path.
+   */
+  auto fixRedRed = [&](Node* node) {
+    Node* parent      = path.up(1);
+    Node* grandparent = path.up(2);
+    Node* above       = path.up(3);
+    path.depth -= 2;
     
-    if      (key == curr->key)   return nullptr;       // Already present
-    else if (key <  curr->key)   {
-      curr = curr->left;
-      prev->numLeft++;
-      prev->numTotal++;
+    if ((node == parent->left) != (parent == grandparent->left)) {
+      /* Zig-zag: the node moves up two levels. */
+      rotateUp(node, parent, grandparent);
+      rotateUp(node, grandparent, above);
+      node->balance        = Color::BLACK;
+      grandparent->balance = Color::RED;
+      return node;
+    } else {
+      /* Zig-zig: the parent moves up a level. */
+      rotateUp(parent, grandparent, above);
+      parent->balance      = Color::BLACK;
+      grandparent->balance = Color::RED;
+      return parent;
     }
-    else /*  key >  curr->key */ {
-      curr = curr->right;
-      prev->numRight++;
-      prev->numTotal++;
+  };
+  
+  for (Node* curr = root; curr != nullptr; ) {
+    /* Split 4-nodes on the way down. */
+    if (isRed(curr->left) && isRed(curr->right)) {
+      curr->balance        = Color::RED;
+      curr->left->balance  = Color::BLACK;
+      curr->right->balance = Color::BLACK;
+      
+      if (isRed(path.up(1))) curr = fixRedRed(curr);
     }
+    
+    /* Add the new key into this node, then step down. */
+    curr->numTotal++;
+    if (key < curr->key) curr->numLeft++;
+    else                 curr->numRight++;
+    curr->summary = Summary::combine(curr->summary, Summary::ofKey(key));
+    
+    path.push(curr);
+    curr = key < curr->key? curr->left : curr->right;
   }
   
-  /* Step two: Do the actual insertion. */
-  Node* node   = new Node;
-  node->key    = key;
-  node->color  = Color::BLACK; // Default to black, can change later.
-  node->left   = node->right = nullptr; // No children
-  node->parent = prev; // Parent is the last node we saw
+  /* Hang the new node off the last node we saw. It's red unless it's the root,
+   * which may need one last rotation if its parent is red.
+   */
+  Node* node     = allocateNode();
+  node->key      = key;
+  node->balance  = Color::RED;
+  node->count    = 1;
+  node->left     = node->right = nullptr;
+#if RBT_PARENT_POINTERS
+  node->parent   = path.up(1);
+#endif
+  node->numTotal = 1;
+  node->numLeft  = node->numRight = 0;
+  node->summary  = Summary::ofKey(key);
   
-  /* Step three: Wire this node into the tree. */
-  if (prev == nullptr) {
+  if (path.depth == 0) {
     root = node;
-  } else if (key < prev->key) {
-    prev->left = node;
-  } else /*  key > prev->key */ {
-    prev->right = node;
+  } else {
+    Node* parent = path.up(1);
+    if (key < parent->key) parent->left  = node;
+    else                   parent->right = node;
+    
+    if (isRed(parent)) fixRedRed(node);
   }
-
-  /* Sizes */
-  node->numTotal = 1; // Leaf node
-  node->numLeft = node->numRight = 0; // No children, left and right sizes are 0
-
   
+  root->balance = Color::BLACK;
   return node;
 }
 
-/* Applies the fixup rules to restore the red/black tree invariants. */
-void RedBlackTree::fixupFrom(Node* node) {
-  while (true) {
-    /* If the node is the root, then there's nothing to do. */
-    if (node->parent == nullptr) break;
-  
-    /* For simplicity, get pointers to our parent, sibling, aunt, and grandparent.
-     * These are the nodes marked in this diagram:
-     *
-     *           G
-     *          / \
-     *         P   A
-     *        / \
-     *       N   S
-     *
-     * Here, N is the node itself.
-     */       
-    Node* parent = node->parent;
-    Node* grandparent = parent->parent;
-    
-    /* The SIBLING of a node is the other child of its parent. Its AUNT is its
-     * parent's sibling.
-     */
-    Node* sibling = siblingOf(node);
-    Node* aunt    = siblingOf(parent);
-    
-    /* If the parent corresponds to a node with one key in the 2-3-4 tree (that
-     * is, the parent is a black node), then via the isometry we add ourselves
-     * to that node by coloring ourselves red. At that point, we're done.
-     *
-     * To see if our parent corresponds to a node with one key in the 2-3-4
-     * tree, we need to check that
-     *
-     *   1. the parent is black (if it's red, we're in part of a larger node), and
-     *   2. the parent has no red children (if it does, then it's part of a larger
-     *      node).
-     *
-     * To do this, we'll find our sibling node (the node across from us under our
-     * parent) and confirm that it's not red.
-     */
-    if (parent->color == Color::BLACK && (sibling == nullptr || sibling->color == Color::BLACK)) {
-      //cout << "Insert into 2-node." << endl;
-      node->color = Color::RED;
-      break;
-    }
-    
-    /* If the parent is part of a node with two keys in the 2-3-4 tree, add
-     * ourselves to that node. There are several cases to consider here, and
-     * they're all symmetric. A node with two keys has one of these shapes,
-     * with all possible insertion points marked with an I:
-     *
-     *          B              B
-     *         / \            / \
-     *        R   I          I   R
-     *       / \                / \
-     *      I   I              I   I
-     *
-     * The commonality is that we would be in one of two cases:
-     *
-     *    1. We have a black parent and a red sibling.
-     *    2. We have a red parent and a black aunt.
-     *
-     * These two cases function differently. If we're in case 1, we just color
-     * ourselves red:
-     *
-     *         B             B
-     *        / \    -->    / \
-     *       N   R         R   R
-     *
-     * Fun fact - this subcase of inserting into a 3-node can be combined with
-     * the logic for inserting into a 2-node. Do you see why?
-     */
-    if (parent->color == Color::BLACK && sibling != nullptr && sibling->color == Color::RED) {
-      //cout << "Insert into 3-node, black parent." << endl;
-      node->color = Color::RED;
-      break;
-    } 
-     
-    /* That takes us to the second option. */
-    if (parent->color == Color::RED && (aunt == nullptr || aunt->color == Color::BLACK)) {
-      /* There are two subcases here, which correspond to the relative ordering
-       * at which the node to insert appears relative to the two other nodes in
-       * the 3-node. The first option is the "zig zag" case:
-       *
-       *       B                   B                   N                B
-       *      / \                 / \                 / \              / \
-       *     R   B   --->        N   B    --->       R   B    --->    R   R
-       *      \     rotate      /        rotate           \  recolor       \
-       *       N   N with R    R        N with B           B                B
-       * 
-       * To see whether we're in this case, we have to see whether the orientation
-       * of the parent/child and grandparent/parent relations are reversed.
-       */
-      if ((node == parent->left) != (parent == grandparent->left)) {
-        //cout << "Insert into 3-node, zig-zag." << endl;
-        rotateWithParent(node);
-        rotateWithParent(node);
-        grandparent->color = Color::RED;
-      }
-      
-      /* The other option is the "zig-zig" case:
-       *
-       *      B               R                  B
-       *     / \             / \                / \
-       *    R   B   --->    N   B      --->    R   R
-       *   /       rotate        \    recolor       \
-       *  N       R with B        B                  B
-       */
-      else {
-        //cout << "Insert into 3-node, zig-zig." << endl;
-        rotateWithParent(parent);
-        parent->color      = Color::BLACK;
-        node->color        = Color::RED;
-        grandparent->color = Color::RED;
-      }
-      
-      /* Both cases are terminal; we've inserted into a 3-node. */
-      break;
-    }
-    
-    /* Otherwise, we are inserting into a 4-node. There are several orientations
-     * possible here, but with mirroring excluded there are basically two unique
-     * insertion points
-     *
-     *          B              B
-     *        /   \          /   \
-     *       R     R        R     R
-     *      /                \
-     *     I                  I
-     *
-     * We are splitting a node with four keys into a node with two keys, a node
-     * with one key, and then kicking one key higher up. This can be done purely
-     * by recoloring the nodes and continuing the search from a starred node that
-     * is colored black beforehand:
-     *
-     *          B              B
-     *        /   \          /   \
-     *       R     R        R     R
-     *      /                \
-     *     I                  I
-     *         vvv            vvvv
-     *
-     *          *              *
-     *        /   \          /   \
-     *       B     B        B     B
-     *      /                \
-     *     R                  R
-     *
-     * In other words, we just flip the colors of the nodes and propagate the
-     * search upward from the grandparent.
-     */
-    //cout << "Insert into 4-node, zig-zag." << endl;
-    parent->color = Color::BLACK;
-    aunt->color   = Color::BLACK;
-    node->color   = Color::RED;
-    
-    node = grandparent;
+/* Removes one copy of the key, if present. If that was the last copy, the node
+ * holding it is spliced out of the tree and the red/black properties are
+ * restored using the standard deletion fixup.
+ */
+template <typename Summary>
+bool BasicRedBlackTree<Summary>::erase(int key) {
+  /* Find the node, remembering how we got there. */
+  Path path;
+  Node* node = findPath(key, path);
+  if (node == nullptr) return false;
+  size--;
+  modifications++;
+  
+  /* Easy case: there are other copies of the key, so nothing moves. */
+  if (node->count > 1) {
+    node->count--;
+    updateAugmentation(node);
+    updateAlong(path);
+    return true;
   }
+  
+  /* Otherwise the node has to go. Keep it around until the fixup is done,
+   * since the fixup needs to know what color it was.
+   */
+  Node* child;
+  Node* removed = removeNode(node, path, child);
+  RedBlackBalancing::eraseFixup(static_cast<Core&>(*this), removed, child, path);
+  
+  releaseNode(removed);
+  numNodes--;
+  return true;
 }
 
-/* Standard rotation logic. We just have to remember to adjust the root and
- * parent pointers as needed.
+/* Sets aside room for the nodes all at once. */
+template <typename Summary>
+void BasicRedBlackTree<Summary>::reserve(size_t numKeys) {
+  Core::reserve(numKeys);
+}
+
+/* Splits the keys into runs of equal keys, then hangs the runs off of a
+ * perfectly balanced tree. In such a tree every missing child is on one of the
+ * last two levels, so if everything above the last level is black and the
+ * last level (with m distinct keys, depth floor(lg m)) is red, every path
+ * from the root to a null has the same number of black nodes and no red node
+ * has a red child. The one exception is a lone root, which stays black.
  */
-void RedBlackTree::rotateWithParent(Node* node) {
-  /* If we're the root, something terrible has happened. */
-  if (node->parent == nullptr) {
-    throw runtime_error("Rotating node with no parent?");
+template <typename Summary>
+BasicRedBlackTree<Summary> BasicRedBlackTree<Summary>::fromSorted(const int* keys, size_t numKeys,
+                                                                  Duplicates duplicates, InsertPolicy policy,
+                                                                  NodeMemory memory) {
+  vector<int>    distinct;
+  vector<size_t> counts;
+  for (size_t i = 0; i < numKeys; i++) {
+    if (i > 0 && keys[i] < keys[i - 1]) {
+      throw runtime_error("Keys passed to fromSorted aren't in sorted order.");
+    }
+    
+    if (i > 0 && keys[i] == keys[i - 1]) {
+      if (duplicates == Duplicates::COUNT) counts.back()++;
+    } else {
+      distinct.push_back(keys[i]);
+      counts.push_back(1);
+    }
   }
   
-  /* Step 1: Do the logic to "locally" rotate the nodes. This repositions the
-   * node, its parent, and the middle child. However, it leaves the parent
-   * pointers of these nodes unmodified; we'll handle that later.
-   */
-  Node* child;
+  BasicRedBlackTree result(duplicates, policy);
+  result.setNodeMemory(memory);
+  if (distinct.empty()) return result;
+  
+  size_t redDepth = 0;
+  while ((size_t(2) << redDepth) <= distinct.size()) redDepth++;
+  
+  result.reserve(distinct.size());
+  result.root     = result.buildBalanced(distinct.data(), counts.data(), 0, distinct.size(),
+                                         0, redDepth, nullptr);
+  result.numNodes = distinct.size();
+  result.size     = result.root->numTotal;
+  return result;
+}
 
-  if (node == node->parent->left) {
-    /* Rotate right. */
-    child = node->right;
-    node->right = node->parent;
-    node->parent->left = child;
+template <typename Summary>
+BasicRedBlackTree<Summary> BasicRedBlackTree<Summary>::fromSorted(const vector<int>& keys,
+                                                                  Duplicates duplicates, InsertPolicy policy,
+                                                                  NodeMemory memory) {
+  return fromSorted(keys.data(), keys.size(), duplicates, policy, memory);
+}
 
-    /* Update sizes. */
-    node->parent->numLeft = child ? child->numTotal : 0;
-    node->parent->numTotal = node->parent->numLeft + node->parent->numRight + 1;
+template <typename Summary>
+typename BasicRedBlackTree<Summary>::Node* BasicRedBlackTree<Summary>::buildBalanced(const int* keys, const size_t* counts,
+                                                                                     size_t begin, size_t end,
+                                                                                     size_t depth, size_t redDepth, Node* parent) {
+  if (begin == end) return nullptr;
+  
+  size_t mid    = begin + (end - begin) / 2;
+  Node* node    = allocateNode();
+  node->key     = keys[mid];
+  node->count   = counts[mid];
+  node->balance = depth == redDepth && depth > 0? Color::RED : Color::BLACK;
+#if RBT_PARENT_POINTERS
+  node->parent  = parent;
+#else
+  (void) parent;
+#endif
+  
+  node->left  = buildBalanced(keys, counts, begin,   mid, depth + 1, redDepth, node);
+  node->right = buildBalanced(keys, counts, mid + 1, end, depth + 1, redDepth, node);
+  updateAugmentation(node);
+  return node;
+}
 
-    node->numRight = node->parent->numTotal;
-    node->numTotal = node->numLeft + node->numRight + 1;
-    // cout << "Right rotate on " << node->key << '\n';
+/* Rank and select are the same for every balanced tree. */
+template <typename Summary>
+size_t BasicRedBlackTree<Summary>::rankOf(int key) const {
+  return Core::rankOf(key);
+}
 
-  } else {
-    /* Rotate left. */
-    child = node->left;
-    node->left = node->parent;
-    node->parent->right = child;
+template <typename Summary>
+int BasicRedBlackTree<Summary>::select(size_t rank) const {
+  if (rank >= this->size) {
+    throw runtime_error("select(): rank out of range.\n");
+  }
+  return Core::select(rank);
+}
 
-    /* Update sizes. */
-    node->parent->numRight = child ? child->numTotal : 0;
-    node->parent->numTotal = node->parent->numRight + node->parent->numLeft + 1;
+/* A single quantile needs at most the two keys on either side of its
+ * fractional rank, each found with a plain select. The second is skipped
+ * whenever the policy doesn't look at it.
+ */
+template <typename Summary>
+double BasicRedBlackTree<Summary>::quantile(double q, Interpolation policy) const {
+  if (size == 0 || std::isnan(q)) return numeric_limits<double>::quiet_NaN();
+  
+  double position = min(max(q, 0.0), 1.0) * double(size - 1);
+  double lowRank  = floor(position);
+  double fraction = position - lowRank;
+  
+  double lo = Core::select(size_t(lowRank));
+  bool needHi = fraction > 0 && policy != Interpolation::LOWER &&
+                (policy != Interpolation::NEAREST || fraction > 0.5);
+  double hi = needHi? Core::select(size_t(lowRank) + 1) : lo;
+  return interpolate(lo, hi, fraction, policy);
+}
 
-    node->numLeft = node->parent->numTotal;
-    node->numTotal = node->numLeft + node->numRight + 1;
-    // cout << "Left rotate on " << node->key << '\n';
+template <typename Summary>
+vector<double> BasicRedBlackTree<Summary>::quantiles(const vector<double>& qs, Interpolation policy) const {
+  vector<double> result(qs.size());
+  quantiles(qs.data(), qs.size(), result.data(), policy);
+  return result;
+}
 
+/* Each quantile needs at most two ranks, so that's how much scratch space to
+ * set aside. Only an unusually long list of quantiles goes to the heap.
+ */
+template <typename Summary>
+void BasicRedBlackTree<Summary>::quantiles(const double* qs, size_t count, double* out,
+                                           Interpolation policy) const {
+  if (count <= kStackQuantiles) {
+    size_t ranks[2 * kStackQuantiles];
+    int    keys [2 * kStackQuantiles];
+    quantilesInto(qs, count, out, policy, ranks, keys);
+  } else {
+    vector<size_t> ranks(2 * count);
+    vector<int>    keys (2 * count);
+    quantilesInto(qs, count, out, policy, ranks.data(), keys.data());
   }
+}
+
+/* Each quantile maps to a fractional rank sitting between two integer ranks.
+ * The fractional ranks are parked in out until the end. We gather up all the
+ * integer ranks we need, sort them, look them all up in one pass down the
+ * tree, and then combine the results according to the policy.
+ */
+template <typename Summary>
+void BasicRedBlackTree<Summary>::quantilesInto(const double* qs, size_t count, double* out,
+                                               Interpolation policy, size_t* ranks, int* keys) const {
+  const double kNaN = numeric_limits<double>::quiet_NaN();
   
-  /* Step 2: Make the node's grandparent now point at it. */
-  Node* grandparent = node->parent->parent;
+  if (size == 0) {
+    fill(out, out + count, kNaN);
+    return;
+  }
   
-  if (grandparent != nullptr) {
-    if (grandparent->left == node->parent) {
-      grandparent->left = node;
-      grandparent->numLeft = node->numTotal;
+  /* Find the fractional rank of each quantile, along with its neighbors. */
+  size_t numRanks = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (std::isnan(qs[i])) {
+      out[i] = kNaN;
+      continue;
     }
-    else {
-      grandparent->right = node;
-      grandparent->numRight = node->numTotal;
-    }
-    grandparent->numTotal = grandparent->numLeft + grandparent->numRight + 1;
-  } else {
-    root = node; 
+    
+    out[i] = min(max(qs[i], 0.0), 1.0) * double(size - 1);
+    ranks[numRanks++] = size_t(floor(out[i]));
+    ranks[numRanks++] = size_t(ceil (out[i]));
   }
   
-  /* Step 3: Update parent pointers.
-   *
-   *  1. The child node that got swapped needs its parent updated.
-   *  2. The node we rotated now has a new parent.
-   *  3. The node's old parent now points to the node we rotated.
-   *
-   * We have to be super careful about this, though, because some of these
-   * nodes might not exist and we need to not lose any pointers.
-   */
-  if (child != nullptr) child->parent = node->parent;
-
-  Node* oldParent = node->parent;
-  node->parent = oldParent->parent;
-  oldParent->parent = node;
+  sort(ranks, ranks + numRanks);
+  numRanks = unique(ranks, ranks + numRanks) - ranks;
+  selectSorted(root, 0, ranks, ranks + numRanks, keys);
+  
+  /* Looks up the key at one of the ranks we gathered. */
+  auto keyAt = [&](size_t rank) {
+    return double(keys[lower_bound(ranks, ranks + numRanks, rank) - ranks]);
+  };
+  
+  for (size_t i = 0; i < count; i++) {
+    if (std::isnan(out[i])) continue;
+    
+    double lowRank = floor(out[i]);
+    out[i] = interpolate(keyAt(size_t(lowRank)), keyAt(size_t(ceil(out[i]))),
+                         out[i] - lowRank, policy);
+  }
 }
 
-/* Returns the sibling of a node, the other child of its parent. */
-RedBlackTree::Node* RedBlackTree::siblingOf(Node* node) {
-  Node* parent = node->parent;
+/* Splits the sorted ranks into those that belong in the left subtree, those
+ * that hit this node exactly, and those that belong in the right subtree, then
+ * recurses on each side that still has ranks to find. The offset is the number
+ * of keys that come before this subtree.
+ */
+template <typename Summary>
+void BasicRedBlackTree<Summary>::selectSorted(const Node* root, size_t offset, const size_t* begin,
+                                              const size_t* end, int* out) {
+  if (begin == end) return;
   
-  /* A node with no parent has no sibling. */
-  if (parent == nullptr) return nullptr;
+  size_t rankHere = offset + root->numLeft;
+  size_t rankNext = rankHere + root->count;
+  const size_t* here  = lower_bound(begin, end, rankHere);
+  const size_t* right = lower_bound(here,  end, rankNext);
   
-  /* Otherwise, return the opposite child. */
-  return node == parent->left? parent->right : parent->left;
+  selectSorted(root->left, offset, begin, here, out);
+  fill(out + (here - begin), out + (right - begin), root->key);
+  selectSorted(root->right, rankNext, right, end, out + (right - begin));
 }
 
-/* Rank operation. */
-size_t RedBlackTree::rankOf(int key) const {
-    return rankOfHelper(root, key);
+/* Weighted rank works just like rank, except that everything we skip over to
+ * the left contributes its sum rather than its size.
+ */
+template <typename Summary>
+template <typename, typename>
+long long BasicRedBlackTree<Summary>::weightedRankOf(int key) const {
+  long long result = 0;
+  
+  Node* curr = root;
+  while (curr != nullptr) {
+    if (key < curr->key) {
+      curr = curr->left;
+    } else if (key > curr->key) {
+      result += summaryOf(curr->left).sum + (long long)curr->key * (long long)curr->count;
+      curr = curr->right;
+    } else /* key == curr->key */ {
+      return result + summaryOf(curr->left).sum;
+    }
+  }
+  return result;
 }
 
-size_t RedBlackTree::rankOfHelper(Node* root, int key) const {
-  if (root == nullptr) {
-    return 0;
-  } else if (key < root->key) {
-    // If the key is less than the current node's key, go to the left subtree.
-    return rankOfHelper(root->left, key);
-  } else if (key > root->key) {
-    // If the key is greater than the current node's key, go to the right subtree.
-    // Add 1 to account for the current node and the nodes in the left subtree.
-    return 1 + root->numLeft + rankOfHelper(root->right, key);
-  } else /* key == root->key */ {
-    // If the current node's key matches the key, return the count of nodes
-    // in the left subtree (nodes with keys smaller than the current node).
-    return root->numLeft;
+/* Weighted select. At each node, we either find enough weight in the left
+ * subtree, find that this node's key pushes us over the line, or subtract out
+ * everything up to and including this node and keep looking to the right.
+ */
+template <typename Summary>
+template <typename, typename>
+int BasicRedBlackTree<Summary>::selectByWeight(long long weight) const {
+  if (root == nullptr || weight > root->summary.sum) {
+    throw runtime_error("selectByWeight(): weight out of range.\n");
+  }
+  
+  Node* curr = root;
+  while (true) {
+    long long leftSum = summaryOf(curr->left).sum;
+    long long hereSum = (long long)curr->key * (long long)curr->count;
+    
+    if (curr->left != nullptr && weight <= leftSum) {
+      curr = curr->left;
+    } else if (weight <= leftSum + hereSum || curr->right == nullptr) {
+      return curr->key;
+    } else {
+      weight -= leftSum + hereSum;
+      curr = curr->right;
+    }
   }
 }
 
-
-/* Select operation. */
-int RedBlackTree::select(size_t rank) const {
-  if (rank >= this->size || rank < 0) {
-    throw runtime_error("select(): rank out of range.\n");
+/* Pieces come out in sorted order, so each thread's share is a contiguous
+ * run of them: thread t takes the pieces that start in the t-th slice of the
+ * ranks. Nothing is shared between the threads but the tree, which they only
+ * read.
+ */
+template <typename Summary>
+void BasicRedBlackTree<Summary>::forEachPiece(size_t numThreads, const function<void(const Piece&)>& visit) const {
+  if (numThreads == 0) {
+    throw runtime_error("A parallel walk needs at least one thread.");
   }
-  return selectHelper(this->root, rank);
+  if (root == nullptr) return;
+  
+  vector<Piece> pieces;
+  splitInto(root, 0, max(size / (numThreads * kPiecesPerThread), kMinPieceKeys), pieces);
+  
+  auto runShare = [&](size_t share) {
+    auto firstIn = [&](size_t rank) {
+      return lower_bound(pieces.begin(), pieces.end(), rank, [](const Piece& piece, size_t rank) {
+        return piece.offset < rank;
+      });
+    };
+    auto end = firstIn(size / numThreads * (share + 1) + min(share + 1, size % numThreads));
+    for (auto piece = firstIn(size / numThreads * share + min(share, size % numThreads)); piece != end; ++piece) {
+      visit(*piece);
+    }
+  };
+  
+  vector<thread> workers;
+  for (size_t share = 1; share < numThreads; share++) {
+    workers.emplace_back(runShare, share);
+  }
+  runShare(0);
+  for (auto& worker: workers) worker.join();
 }
 
-int RedBlackTree::selectHelper(Node* root, size_t rank) const {
-  if (root == nullptr) {
-    return 0;
-  } 
-  size_t leftcount;
-  if (root->left == nullptr) {
-    leftcount = 0;
-  } else {
-    leftcount = root->numLeft;
+/* This recurses, but only until the pieces get down to the grain size, and
+ * never deeper than the height of the tree.
+ */
+template <typename Summary>
+void BasicRedBlackTree<Summary>::splitInto(const Node* root, size_t offset, size_t grain, vector<Piece>& pieces) {
+  if (root == nullptr) return;
+  if (root->numTotal <= grain) {
+    pieces.push_back({ root, true, offset });
+    return;
   }
+  
+  splitInto(root->left, offset, grain, pieces);
+  pieces.push_back({ root, false, offset + root->numLeft });
+  splitInto(root->right, offset + root->numLeft + root->count, grain, pieces);
+}
 
-  if (rank < leftcount) {
-    return selectHelper(root->left, rank);
-  } else if (rank == leftcount) {
-    return root->key;
-  } else {
-    return selectHelper(root->right, rank - leftcount - 1);
+/* Each piece fills a contiguous slice, so this writes through a cursor rather
+ * than at each key's rank. In a set, where every count is 1, that means the
+ * address of each write doesn't wait on reading the previous node's count,
+ * which is worth about 20% on a tree much larger than the cache.
+ */
+template <typename Summary>
+void BasicRedBlackTree<Summary>::toSortedArray(int* out, size_t numThreads) const {
+  bool isSet = duplicates == Duplicates::REJECT;
+  forEachPiece(numThreads, [&](const Piece& piece) {
+    int* cursor = out + piece.offset;
+    auto copyKey    = [&](int key, size_t, size_t)       { *cursor++ = key; };
+    auto copyCopies = [&](int key, size_t count, size_t) { cursor = fill_n(cursor, count, key); };
+    
+    if (!piece.wholeSubtree) copyCopies(piece.node->key, piece.node->count, piece.offset);
+    else if (isSet)          walk(piece.node, piece.offset, copyKey);
+    else                     walk(piece.node, piece.offset, copyCopies);
+  });
+}
+
+template <typename Summary>
+vector<int> BasicRedBlackTree<Summary>::toSortedArray(size_t numThreads) const {
+  vector<int> result(size);
+  toSortedArray(result.data(), numThreads);
+  return result;
+}
+
+/* The file is sized up front, so the threads can each pwrite their slice at
+ * its final offset in any order. A failed write can't be thrown from a worker
+ * thread, so it's noted and reported once they're all done.
+ */
+template <typename Summary>
+void BasicRedBlackTree<Summary>::writeTo(const string& path, size_t numThreads) const {
+  if (numThreads == 0) {
+    throw runtime_error("A parallel walk needs at least one thread.");
+  }
+  
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    throw runtime_error("Cannot open file \"" + path + "\" for writing.");
+  }
+  
+  atomic<bool> failed(ftruncate(fd, off_t(size * sizeof(int))) != 0);
+  auto writeAll = [&](const int* keys, size_t numKeys, size_t rank) {
+    const char* data   = reinterpret_cast<const char*>(keys);
+    size_t      length = numKeys * sizeof(int);
+    off_t       at     = off_t(rank * sizeof(int));
+    while (length > 0 && !failed) {
+      ssize_t written = pwrite(fd, data, length, at);
+      if (written < 0 && errno == EINTR) continue;
+      if (written <= 0) {
+        failed = true;
+        break;
+      }
+      data   += written;
+      length -= size_t(written);
+      at     += written;
+    }
+  };
+  
+  if (!failed) {
+    forEachPiece(numThreads, [&](const Piece& piece) {
+      vector<int> batch;
+      batch.reserve(kWriteBatchKeys);
+      size_t batchRank = piece.offset;
+      auto add = [&](int key, size_t count, size_t) {
+        for (size_t i = 0; i < count; i++) {
+          batch.push_back(key);
+          if (batch.size() == kWriteBatchKeys) {
+            writeAll(batch.data(), batch.size(), batchRank);
+            batchRank += batch.size();
+            batch.clear();
+          }
+        }
+      };
+      
+      if (piece.wholeSubtree) walk(piece.node, piece.offset, add);
+      else add(piece.node->key, piece.node->count, piece.offset);
+      writeAll(batch.data(), batch.size(), batchRank);
+    });
+  }
+  
+  if (close(fd) != 0) failed = true;
+  if (failed) {
+    throw runtime_error("Cannot write to file \"" + path + "\".");
   }
 }
 
+template <typename Summary>
+size_t BasicRedBlackTree<Summary>::bytesPerNode() {
+  return sizeof(Node);
+}
+
+template <typename Summary>
+size_t BasicRedBlackTree<Summary>::height() const {
+  return Core::height();
+}
 
+/* Everything about the shape of the tree is checked by the core and the
+ * balancing rule. What's left is the bookkeeping only a RedBlackTree does.
+ */
+template <typename Summary>
+void BasicRedBlackTree<Summary>::checkInvariants() const {
+  checkStructure();
+  RedBlackBalancing::checkBalance(root);
+  
+  size_t nodes = 0;
+  bool   repeats = false;
+  forEach([&](int, size_t count) {
+    nodes++;
+    if (count != 1) repeats = true;
+  });
+  if (size != (root == nullptr? 0 : root->numTotal) || numNodes != nodes) {
+    throw runtime_error("Tree size doesn't match its nodes.");
+  }
+  if (repeats && duplicates == Duplicates::REJECT) {
+    throw runtime_error("A set holds more than one copy of a key.");
+  }
+}
 
 /* Prints debugging information. This is just to make testing a bit easier. */
-void RedBlackTree::printDebugInfo() const {
+template <typename Summary>
+void BasicRedBlackTree<Summary>::printDebugInfo() const {
   printDebugInfoRec(root, 0);
   cout << flush;
 }
@@ -429,21 +808,139 @@ void RedBlackTree::printDebugInfo() const {
  * Optional TODO: Edit this function to print out additional debugging
  * information for testing.
  */
-void RedBlackTree::printDebugInfoRec(Node* root, unsigned indent) const {
+template <typename Summary>
+void BasicRedBlackTree<Summary>::printDebugInfoRec(Node* root, unsigned indent) const {
   if (root == nullptr) {
     cout << setw(indent) << "" << "null" << '\n';
   } else {
     cout << setw(indent) << "" << "\x1B[32mNode       \x1B[0m" << root << '\n';
-    string color = colorToString(root->color);
-    if (color == "red") cout << setw(indent) << "" << "Color:     \x1B[31m" << color << "\x1B[0m\n";
+    const char* color = RedBlackBalancing::colorToString(root->balance);
+    if (root->balance == Color::RED) cout << setw(indent) << "" << "Color:     \x1B[31m" << color << "\x1B[0m\n";
     else cout << setw(indent) << "" << "Color:     " << color << '\n';
     cout << setw(indent) << "" << "Key:       " << root->key << '\n';
-    cout << setw(indent) << "" << "Size:      " << root->numTotal << endl;
-    cout << setw(indent) << "" << "          / \\" << endl;
-    cout << setw(indent) << "" << "         " << root->numLeft << "   " << root->numRight << endl;
+    if (root->count != 1) cout << setw(indent) << "" << "Count:     " << root->count << '\n';
+    cout << setw(indent) << "" << "Size:      " << root->numTotal << '\n';
+    if constexpr (is_same<Summary, SubtreeSummary>::value) {
+      cout << setw(indent) << "" << "Sum:       " << root->summary.sum
+           << " (min " << root->summary.min << ", max " << root->summary.max << ")" << '\n';
+    }
+    cout << setw(indent) << "" << "          / \\" << '\n';
+    cout << setw(indent) << "" << "         " << root->numLeft << "   " << root->numRight << '\n';
     cout << setw(indent) << "" << "Left Child:" << '\n';
     printDebugInfoRec(root->left,  indent + 4);
     cout << setw(indent) << "" << "Right Child:" << '\n';
     printDebugInfoRec(root->right, indent + 4);
   }
 }
+
+/* Exports the tree. All three formats visit the nodes in preorder, using an
+ * explicit stack of nodes still to be visited. Since we always visit a node's
+ * left child right after the node itself, the stack only ever holds the right
+ * children of nodes along the current path, plus one more.
+ */
+template <typename Summary>
+void BasicRedBlackTree<Summary>::exportTo(ostream& out, ExportFormat format, size_t nodeLimit,
+                                          size_t depthLimit) const {
+  struct Frame {
+    const Node* node;
+    size_t      depth;   // 0 for the root
+    size_t      parent;  // Preorder index of the parent, if there is one
+    char        side;    // 'L' or 'R' for children, 0 for the root
+  };
+  Frame  stack[kMaxTreeHeight + 1];
+  size_t stackSize = 0;
+  
+  /* Per-level statistics, for the LEVELS format. */
+  size_t levelNodes[kMaxTreeHeight] = {};
+  size_t levelRed[kMaxTreeHeight]   = {};
+  size_t levelLeaves[kMaxTreeHeight] = {};
+  
+  BufferedWriter writer(out);
+  if (format == ExportFormat::DOT) {
+    writer << "digraph RedBlackTree {\n"
+           << "  node [style=filled, fontcolor=white, shape=circle];\n";
+  } else if (format == ExportFormat::JSON) {
+    writer << "{\"size\":" << size << ",\"distinct\":" << numNodes << ",\"nodes\":[";
+  }
+  
+  size_t visited = 0;
+  bool   truncated = false;
+  if (root != nullptr) stack[stackSize++] = { root, 0, 0, 0 };
+  
+  while (stackSize != 0) {
+    Frame frame = stack[--stackSize];
+    const Node* node = frame.node;
+    
+    if (visited == nodeLimit || frame.depth >= depthLimit) {
+      truncated = true;
+      if (visited == nodeLimit) break;
+      continue;
+    }
+    size_t id = visited++;
+    
+    switch (format) {
+      case ExportFormat::DOT:
+        writer << "  n" << id << " [label=\"" << node->key;
+        if (node->count != 1) writer << " x" << node->count;
+        writer << "\\n" << node->numTotal << "\", fillcolor="
+               << (node->balance == Color::RED? "red" : "black") << "];\n";
+        if (frame.side != 0) {
+          writer << "  n" << frame.parent << " -> n" << id
+                 << (frame.side == 'L'? " [tailport=sw];\n" : " [tailport=se];\n");
+        }
+        break;
+        
+      case ExportFormat::JSON:
+        if (id != 0) writer << ',';
+        writer << "{\"id\":" << id << ",\"key\":" << node->key << ",\"count\":" << node->count
+               << ",\"color\":\"" << RedBlackBalancing::colorToString(node->balance) << "\",\"size\":" << node->numTotal;
+        if (frame.side != 0) {
+          writer << ",\"parent\":" << frame.parent << ",\"side\":\"" << frame.side << '"';
+        }
+        writer << '}';
+        break;
+        
+      case ExportFormat::LEVELS:
+        levelNodes[frame.depth]++;
+        if (node->balance == Color::RED) levelRed[frame.depth]++;
+        if (node->left == nullptr && node->right == nullptr) levelLeaves[frame.depth]++;
+        break;
+    }
+    
+    /* Push the right child first so that the left child is visited next. */
+    if (node->right != nullptr) stack[stackSize++] = { node->right, frame.depth + 1, id, 'R' };
+    if (node->left  != nullptr) stack[stackSize++] = { node->left,  frame.depth + 1, id, 'L' };
+  }
+  
+  switch (format) {
+    case ExportFormat::DOT:
+      if (truncated) writer << "  truncated [label=\"...\", shape=plaintext, fontcolor=black];\n";
+      writer << "}\n";
+      break;
+      
+    case ExportFormat::JSON:
+      writer << "],\"truncated\":" << (truncated? "true" : "false") << "}\n";
+      break;
+      
+    case ExportFormat::LEVELS:
+      writer << "depth\tnodes\tred\tblack\tleaves\n";
+      for (size_t depth = 0; depth < kMaxTreeHeight && levelNodes[depth] != 0; depth++) {
+        writer << depth << '\t' << levelNodes[depth] << '\t' << levelRed[depth] << '\t'
+               << levelNodes[depth] - levelRed[depth] << '\t' << levelLeaves[depth] << '\n';
+      }
+      writer << "Visited " << visited << " of " << numNodes << " nodes";
+      if (truncated) writer << " (truncated)";
+      writer << ".\n";
+      break;
+  }
+  writer.flush();
+  out.flush();
+}
+
+/* Every red/black tree there is. Weighted queries are member templates, so
+ * they have to be asked for on their own.
+ */
+template class BasicRedBlackTree<SizeOnly>;
+template class BasicRedBlackTree<SubtreeSummary>;
+template long long WeightedRedBlackTree::weightedRankOf(int) const;
+template int       WeightedRedBlackTree::selectByWeight(long long) const;
@@ -2,51 +2,214 @@
  * File: RedBlackTree.h
  * Author: Keith Schwarz (htiek@cs.stanford.edu)
  *
- * A partial implementation of a balanced BST backed by a red/black tree. This
- * implementation only handles insertions, not deletions, since we didn't cover
- * deletions in class.
+ * A partial implementation of a balanced BST backed by a red/black tree. The
+ * tree can either act as a set (the default), rejecting duplicate keys, or as
+ * a multiset that counts how many copies of each key it holds. Either way,
+ * each distinct key gets one node.
+ *
+ * Every node keeps the size of its subtree, and can also keep a summary of
+ * the keys in it (see SubtreeSummary.h), chosen by a template parameter. A
+ * plain RedBlackTree keeps nothing more than the sizes. A WeightedRedBlackTree
+ * also keeps the sum, minimum, and maximum of each subtree, which is what its
+ * weighted rank queries run on, at the cost of bigger nodes. Both are compiled
+ * once, in RedBlackTree.cpp.
  *
  * Feel free to copy the code in here and use it however you see fit!
  */
 #pragma once
 
+#include "Balancing.h"
 #include <cstddef> // For std::size_t
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <vector>
 
-class RedBlackTree {
+/**
+ * The parts of a red/black tree that don't depend on which summary it keeps,
+ * so that RedBlackTree::Duplicates and WeightedRedBlackTree::Duplicates are
+ * one and the same.
+ */
+class RedBlackTreeBase {
 public:
   /**
-   * Constructs a new, empty red/black tree.
+   * How quantile queries pick a value when the requested quantile falls between
+   * two keys. If the quantile q lands at fractional rank h = q * (n - 1), with
+   * neighboring keys lo = select(floor(h)) and hi = select(ceil(h)), then
+   *
+   *   LOWER    returns lo,
+   *   HIGHER   returns hi,
+   *   NEAREST  returns whichever of lo and hi is closer in rank (ties go to lo),
+   *   LINEAR   interpolates linearly between lo and hi, and
+   *   MIDPOINT returns the average of lo and hi.
+   */
+  enum class Interpolation {
+    LOWER, HIGHER, NEAREST, LINEAR, MIDPOINT
+  };
+  
+  /**
+   * What insert does with a key that's already in the tree. With REJECT, the
+   * tree is a set, and duplicates are ignored. With COUNT, the tree is a
+   * multiset: each node records how many copies of its key have been added,
+   * and rankOf, select, etc. count every copy.
+   */
+  enum class Duplicates {
+    REJECT, COUNT
+  };
+  
+  /**
+   * How insert restores the red/black properties. BOTTOM_UP inserts the new key
+   * at the bottom of the tree and then walks back up fixing things, following
+   * parent pointers. TOP_DOWN splits any 4-nodes it passes on the way down so
+   * that the insertion is done in a single downward pass.
+   */
+  enum class InsertPolicy {
+    BOTTOM_UP, TOP_DOWN
+  };
+  
+  /**
+   * Where node storage comes from; see TreeCore.h.
+   */
+  using NodeMemory = ::NodeMemory;
+  
+  /**
+   * Formats understood by exportTo:
    *
-   * Because no explicit initialization is required here, this constructor is
-   * defined using the = default syntax, which uses the compiler-generated
-   * default.
+   *   DOT     a Graphviz digraph, with nodes labeled by key and subtree size,
+   *   JSON    compact JSON listing each node with its parent's id, and
+   *   LEVELS  a table of how many nodes (red, black, and leaves) are at each
+   *           depth, for getting a feel for the shape of a big tree.
    */
-  RedBlackTree() = default;
+  enum class ExportFormat {
+    DOT, JSON, LEVELS
+  };
+
+protected:
+  /* Lets a member exist only in trees that keep the sums of their keys. */
+  template <typename Summary>
+  using HasSums = std::enable_if_t<std::is_same<Summary, SubtreeSummary>::value>;
+};
+
+template <typename Summary = SizeOnly>
+class BasicRedBlackTree: public RedBlackTreeBase,
+                         private TreeCore<RedBlackBalancing::Color, Summary> {
+public:
+  /**
+   * Constructs a new, empty red/black tree that handles duplicate keys and
+   * insertions as specified.
+   */
+  explicit BasicRedBlackTree(Duplicates duplicates = Duplicates::REJECT,
+                             InsertPolicy policy = InsertPolicy::BOTTOM_UP)
+    : duplicates(duplicates), policy(policy) {}
   
   /**
    * Frees all memory allocated by the red/black tree.
    */
-  ~RedBlackTree();
+  ~BasicRedBlackTree() = default;
+  
+  /**
+   * Moves the contents of another tree into this one. This takes O(1) time and
+   * never allocates. The other tree is left empty, keeping its duplicate and
+   * insertion policies.
+   */
+  BasicRedBlackTree(BasicRedBlackTree&& rhs) noexcept;
+  BasicRedBlackTree& operator= (BasicRedBlackTree&& rhs) noexcept;
+  
+  /**
+   * Exchanges the contents of this tree and another in O(1) time, along with
+   * their duplicate and insertion policies.
+   */
+  void swap(BasicRedBlackTree& rhs) noexcept;
   
   /**
    * Returns whether the given key is present in the tree.
    */
   bool contains(int key) const; 
+  
+  /**
+   * Looks up a batch of keys at once, storing whether keys[i] is present in
+   * results[i] and returning how many of the keys were present. The lookups
+   * walk down the tree in lockstep, prefetching each node before it's needed,
+   * so when the tree doesn't fit in cache the memory stalls overlap instead of
+   * happening one after the other.
+   */
+  std::size_t containsBatch(const int* keys, std::size_t numKeys, bool* results) const;
 
   /**
-   * Returns the size of the tree. 
+   * Returns the size of the tree. In a multiset, every copy of every key is
+   * counted.
   */
-  size_t getSize() {
+  size_t getSize() const {
     return this->size;
   }
   
+  /**
+   * Returns the number of distinct keys in the tree, which is also the number
+   * of nodes. For a set, this is the same as getSize().
+   */
+  size_t distinctSize() const {
+    return this->numNodes;
+  }
+  
+  /**
+   * Returns how many copies of the given key are in the tree. For a set, this
+   * is always 0 or 1.
+   */
+  size_t count(int key) const;
+  
   /**
    * Inserts the given key into the red/black tree. If the element was added,
-   * this function returns true. If the element already existed, then this
-   * function returns false and does not modify the tree.
+   * this function returns true. If the element already existed, then in a set
+   * this function returns false and does not modify the tree, while in a
+   * multiset it adds another copy of the key and returns true.
    */ 
   bool insert(int key);
   
+  /**
+   * Removes one copy of the given key from the tree, returning whether there
+   * was a copy to remove.
+   */
+  bool erase(int key);
+  
+  /**
+   * Removes every key from the tree. The memory backing the nodes is kept so
+   * that refilling the tree doesn't allocate, and is returned when the tree is
+   * destroyed. This takes O(1) time, no matter how many keys or storage
+   * chunks there are.
+   */
+  void clear();
+  
+  /**
+   * Sets aside enough memory for the tree to grow to the given number of
+   * distinct keys without allocating.
+   */
+  void reserve(std::size_t numKeys);
+  
+  /**
+   * Chooses where memory for new nodes comes from. Nodes that have already
+   * been allocated stay where they are.
+   */
+  void setNodeMemory(NodeMemory memory) {
+    Core::setNodeMemory(memory);
+  }
+  
+  /**
+   * Builds a tree holding the given keys in O(n) time, without any rotations
+   * or recoloring. The keys must be in nondecreasing order; if they aren't,
+   * this function throws a std::runtime_error. Repeated keys are dropped in a
+   * set and counted in a multiset.
+   */
+  static BasicRedBlackTree fromSorted(const int* keys, std::size_t numKeys,
+                                      Duplicates duplicates = Duplicates::REJECT,
+                                      InsertPolicy policy = InsertPolicy::BOTTOM_UP,
+                                      NodeMemory memory = NodeMemory::DEFAULT);
+  static BasicRedBlackTree fromSorted(const std::vector<int>& keys,
+                                      Duplicates duplicates = Duplicates::REJECT,
+                                      InsertPolicy policy = InsertPolicy::BOTTOM_UP,
+                                      NodeMemory memory = NodeMemory::DEFAULT);
+  
   /**
    * Returns the rank of the specified key, which is the number of elements
    * in the data set less than the key. That is, the rank of the smallest
@@ -76,67 +239,288 @@ public:
    */
   int select(std::size_t rank) const;
   
+  /**
+   * Returns the q-quantile of the keys in the tree, where q is between 0 and 1.
+   * For example, quantile(0.5) is the median and quantile(0.99) is the 99th
+   * percentile. Values of q outside of [0, 1] are clamped to that range.
+   *
+   * Unlike select, this function doesn't throw; if the tree is empty or q is
+   * NaN, it returns NaN. It takes one or two descents of the tree and never
+   * allocates memory.
+   */
+  double quantile(double q, Interpolation policy = Interpolation::LINEAR) const;
+  
+  /**
+   * Computes many quantiles at once, writing the result for qs[i] into out[i].
+   * All of the ranks involved are found in a single shared walk down the tree,
+   * so asking for p50, p90, p99, and p99.9 together is considerably cheaper
+   * than asking for each of them separately. This doesn't allocate memory
+   * unless it's asked for more than 16 quantiles at once.
+   */
+  void quantiles(const double* qs, std::size_t count, double* out,
+                 Interpolation policy = Interpolation::LINEAR) const;
+  
+  /**
+   * Convenience wrapper around the above that returns the quantiles as a vector.
+   */
+  std::vector<double> quantiles(const std::vector<double>& qs,
+                                Interpolation policy = Interpolation::LINEAR) const;
+  
+  /**
+   * Returns the sum of all keys in the tree strictly less than the given key.
+   * This is the weighted analog of rankOf, where each key counts for its own
+   * value rather than for one. For example, in a red/black tree containing
+   * 103, 161, 166, and 261, the weighted rank of 166 is 103 + 161 = 264.
+   *
+   * Runs in time O(log n). Only a WeightedRedBlackTree has this.
+   */
+  template <typename S = Summary, typename = HasSums<S>>
+  long long weightedRankOf(int key) const;
+  
+  /**
+   * Returns the smallest key k such that the sum of all keys less than or equal
+   * to k is at least the given weight. This is the weighted analog of select.
+   * If the weight exceeds the sum of all the keys in the tree, this function
+   * throws a std::runtime_error.
+   *
+   * For example, if the BST contains 103, 161, 166, and 261, then selecting
+   * weight 1 or weight 103 returns 103, selecting weight 104 returns 161, and
+   * selecting weight 692 throws a std::runtime_error.
+   *
+   * Prefix sums only increase from key to key if the keys are nonnegative, so
+   * results are only meaningful if all keys in the tree are nonnegative.
+   *
+   * Runs in time O(log n). Only a WeightedRedBlackTree has this.
+   */
+  template <typename S = Summary, typename = HasSums<S>>
+  int selectByWeight(long long weight) const;
+  
+  /**
+   * Returns the summary of all keys in the tree, which for a
+   * WeightedRedBlackTree is their sum, minimum, and maximum. For an empty
+   * tree, this is Summary::identity().
+   */
+  Summary summary() const {
+    return Core::summaryOf(root);
+  }
+  
+  /**
+   * Calls fn(key, count) on each distinct key in the tree, in sorted order,
+   * where count is the number of copies of that key (always 1 in a set). This
+   * walks the tree iteratively using a small fixed-size stack, so it neither
+   * recurses nor allocates memory.
+   */
+  template <typename Function> void forEach(Function fn) const {
+    auto visit = [&](int key, std::size_t count, std::size_t) { fn(key, count); };
+    walk(root, 0, visit);
+  }
+  
+  /**
+   * Like forEach, but splits the tree into subtrees and walks them on the
+   * given number of threads at once, calling fn(key, count, rank), where rank
+   * is the rank of the key's first copy. Every subtree knows how many keys it
+   * holds, so each thread knows exactly where in the sorted order its share
+   * starts without talking to the others. Each thread sees a contiguous run
+   * of keys in sorted order, but different threads' calls interleave, so fn
+   * must be safe to call concurrently and must not throw. If numThreads is
+   * zero, this throws a std::runtime_error.
+   */
+  template <typename Function> void parallelForEach(Function fn, std::size_t numThreads) const {
+    forEachPiece(numThreads, [&](const Piece& piece) {
+      if (piece.wholeSubtree) walk(piece.node, piece.offset, fn);
+      else fn(piece.node->key, piece.node->count, piece.offset);
+    });
+  }
+  
+  /**
+   * Writes every key in the tree, with every copy in a multiset, to
+   * out[0 .. getSize()) in sorted order, using the given number of threads.
+   * Each thread fills its own slice of the output. If numThreads is zero,
+   * this throws a std::runtime_error.
+   */
+  void toSortedArray(int* out, std::size_t numThreads = 1) const;
+  
+  /**
+   * Convenience wrapper around the above that returns the keys as a vector.
+   */
+  std::vector<int> toSortedArray(std::size_t numThreads = 1) const;
+  
+  /**
+   * Writes the keys, as toSortedArray would produce them, to the given file
+   * as raw ints in the machine's byte order, replacing anything already
+   * there. Each thread writes its own slice of the file at its own offset.
+   * The result can be mapped straight back into memory and handed to
+   * fromSorted. If the file can't be written or numThreads is zero, this
+   * throws a std::runtime_error.
+   */
+  void writeTo(const std::string& path, std::size_t numThreads = 1) const;
+  
+  /**
+   * Returns the number of bytes of memory used by each node (that is, each
+   * distinct key) in the tree.
+   */
+  static std::size_t bytesPerNode();
+  
+  /**
+   * Statistics for comparing this tree against other balanced trees: the
+   * number of nodes on the longest path from the root to a leaf, and the
+   * number of rotations done since the tree was created.
+   */
+  std::size_t height() const;
+  std::size_t numRotations() const {
+    return rotations;
+  }
+  
+  /**
+   * Returns a counter that goes up every time the tree's contents change,
+   * including when it's cleared, moved, or swapped. A result computed at one
+   * version is still right as long as the version hasn't moved. Lookups that
+   * don't change anything, like inserting a key that's already in a set,
+   * leave it alone.
+   */
+  std::uint64_t version() const {
+    return modifications;
+  }
+  
   /**
    * For testing and debugging purposes, prints out a representation of the
    * red/black tree
    */
   void printDebugInfo() const;
+  
+  /**
+   * For testing and debugging purposes, confirms that the tree is a valid
+   * red/black tree: the root is black, no red node has a red child, and every
+   * path down from the root passes through the same number of black nodes.
+   * Also confirms that the keys are in order and that every node's count,
+   * subtree sizes, summary, and parent pointer are right. If anything is
+   * wrong, this throws a std::runtime_error describing the first problem.
+   */
+  void checkInvariants() const;
+  
+  /**
+   * Writes a representation of the tree to the given stream. Unlike
+   * printDebugInfo, this is suitable for very large trees: it doesn't recurse,
+   * doesn't allocate, and writes its output in large chunks. Nodes are visited
+   * in preorder; at most nodeLimit of them are written, and nodes deeper than
+   * depthLimit (with the root at depth 0) are skipped.
+   */
+  void exportTo(std::ostream& out, ExportFormat format,
+                std::size_t nodeLimit  = SIZE_MAX,
+                std::size_t depthLimit = SIZE_MAX) const;
 
 private:
 
   /* Number of elements in the tree. 0 by default. */
   size_t size = 0; 
-
-  /* Type representing a color. */
-  enum class Color {
-    BLACK, RED
-  };
   
-  /* Map a color to a string, for debugging purposes. */
-  static const char* colorToString(Color c) {
-    if (c == Color::BLACK) return "black";
-    if (c == Color::RED)   return "red";
-    return "(?)";
-  }
+  /* Number of nodes (distinct keys) in the tree. */
+  size_t numNodes = 0;
+  
+  /* Whether this is a set or a multiset. */
+  Duplicates duplicates;
+  
+  /* Which insertion algorithm to use. */
+  InsertPolicy policy;
+  
+  /* Bumped by every change to the contents; see version(). */
+  std::uint64_t modifications = 0;
+  
+  /* How many lookups containsBatch runs in lockstep. This should be enough to
+   * keep the memory system busy without overflowing the line fill buffers.
+   */
+  static constexpr std::size_t kLookupGroupSize = 16;
+  
+  /* The node layout, rotations, and storage are shared with the other
+   * balanced trees, and the red/black fixups live in RedBlackBalancing. What's
+   * here is what only a red/black tree does: top-down insertion, building
+   * from sorted keys, and the queries and walks that use every node.
+   */
+  using Color = RedBlackBalancing::Color;
+  using Core  = TreeCore<Color, Summary>;
+  using Node  = typename Core::Node;
+  using Path  = typename Core::Path;
+  
+  using Core::root;
+  using Core::rotations;
+  using Core::find;
+  using Core::findPath;
+  using Core::insertKey;
+  using Core::removeNode;
+  using Core::rotateUp;
+  using Core::updateAlong;
+  using Core::allocateNode;
+  using Core::releaseNode;
+  using Core::forgetNodes;
+  using Core::summaryOf;
+  using Core::checkStructure;
+  
+  /* Inserts a key into the tree using top-down insertion, which leaves the
+   * tree fully fixed up. Returns the newly-inserted node, or null if no new
+   * node was needed.
+   */
+  Node* insertTopDown(int key, bool countDuplicates);
 
-  struct Node {
-    int    key;         // The key itself
-    Color  color;       // What color we are
-    
-    Node*  left;        // Left and right children
-    Node*  right;
+  /* Calls fn(key, count, rank) on each node of the given subtree in sorted
+   * order, where rank is the rank of the key's first copy and the subtree's
+   * first key has the given rank. This uses a small fixed-size stack, so it
+   * neither recurses nor allocates memory.
+   */
+  template <typename Function>
+  static void walk(const Node* root, std::size_t rank, Function& fn) {
+    const Node* stack[kMaxTreeHeight];
+    std::size_t depth = 0;
     
-    Node*  parent;      // Parent pointer. This is used to simplify the insertion
-                        // procedure, but isn't strictly necessary.
-
-    size_t numTotal;    // The size of the subtree from this node (inclusive)
-    size_t numLeft;     // The size of the left subtree
-    size_t numRight;    // The size of the right subtree
+    for (const Node* curr = root; curr != nullptr || depth != 0; ) {
+      /* Go as far left as possible, then visit the node we stopped at and
+       * repeat from its right subtree.
+       */
+      for (; curr != nullptr; curr = curr->left) stack[depth++] = curr;
+      curr = stack[--depth];
+      fn(curr->key, curr->count, rank);
+      rank += curr->count;
+      curr = curr->right;
+    }
+  }
+  
+  /* A part of the tree for a parallel walk: either a whole subtree, or just
+   * the node at its root. offset is the rank of its first key.
+   */
+  struct Piece {
+    const Node* node;
+    bool        wholeSubtree;
+    std::size_t offset;
   };
   
-  Node* root = nullptr;
+  /* Cuts the tree into pieces and calls visit on every one of them, spread
+   * across the given number of threads, each of which handles a contiguous
+   * range of ranks.
+   */
+  void forEachPiece(std::size_t numThreads, const std::function<void(const Piece&)>& visit) const;
   
-  /* Rotates a node with its parent. */
-  void rotateWithParent(Node* curr);
+  /* Appends the pieces of the given subtree, in order, cutting it up until
+   * no whole subtree holds more than grain keys.
+   */
+  static void splitInto(const Node* root, std::size_t offset, std::size_t grain,
+                        std::vector<Piece>& pieces);
   
-  /* Inserts a key into the tree without doing any fixups. Returns a pointer
-   * to the newly-inserted node.
+  /* Recursive helper that selects many ranks in one pass. The ranks in
+   * [begin, end) must be sorted, and offset is the number of keys that come
+   * before the given subtree; the key for begin[i] is written to out[i].
    */
-  Node* insertKey(int key);
-
-  /* Recursive helper function for rankOf */
-  std::size_t rankOfHelper(Node* root, int key) const;
-
-  /* Recursive helper function for select. */
-  int selectHelper(Node* root, std::size_t rank) const;
+  static void selectSorted(const Node* root, std::size_t offset, const std::size_t* begin,
+                           const std::size_t* end, int* out);
   
-  /* Performs the fixup logic given the position of the node in need of fixing. */
-  void fixupFrom(Node* node);
+  /* Does the work of quantiles, given room for 2 * count ranks and keys. */
+  void quantilesInto(const double* qs, std::size_t count, double* out, Interpolation policy,
+                     std::size_t* ranks, int* keys) const;
   
-  /* Returns the sibling of a node. Since this is essentially a function that
-   * works on nodes and doesn't require a receiver object, we mark it static.
+  /* Builds a perfectly balanced subtree out of the given range of distinct keys
+   * and their counts, coloring the nodes at redDepth red and all others black.
    */
-  static Node* siblingOf(Node* node);
+  Node* buildBalanced(const int* keys, const std::size_t* counts,
+                      std::size_t begin, std::size_t end,
+                      std::size_t depth, std::size_t redDepth, Node* parent);
   
   /* Prints debug information about the given node, indented appropriately. */
   void printDebugInfoRec(Node* node, unsigned indent) const;
@@ -144,6 +528,15 @@ private:
   /* For simplicity, disallow copying. This is here simply to ensure that you
    * don't accidentally copy the tree without meaning to.
    */
-  RedBlackTree(const RedBlackTree &) = delete;
-  void operator= (RedBlackTree) = delete;
+  BasicRedBlackTree(const BasicRedBlackTree &) = delete;
+  BasicRedBlackTree& operator= (const BasicRedBlackTree &) = delete;
 };
+
+using RedBlackTree         = BasicRedBlackTree<>;
+using WeightedRedBlackTree = BasicRedBlackTree<SubtreeSummary>;
+
+/* Found by argument-dependent lookup, so std::swap-style code works. */
+template <typename Summary>
+void swap(BasicRedBlackTree<Summary>& lhs, BasicRedBlackTree<Summary>& rhs) noexcept {
+  lhs.swap(rhs);
+}
@@ -0,0 +1,230 @@
+#include "ReplicatedTree.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+using namespace std;
+
+namespace {
+  /* Parses a Linux CPU or node list such as "0-3,8,10-11". Returns an empty
+   * list if the text is malformed.
+   */
+  vector<int> parseCpuList(const string& text) {
+    vector<int> result;
+    istringstream input(text);
+    for (string range; getline(input, range, ','); ) {
+      if (range.empty() || range == "\n") continue;
+
+      istringstream parts(range);
+      int low, high;
+      if (!(parts >> low)) return {};
+      high = low;
+      if (parts.peek() == '-') {
+        parts.get();
+        if (!(parts >> high) || high < low) return {};
+      }
+      for (int cpu = low; cpu <= high; cpu++) result.push_back(cpu);
+    }
+    return result;
+  }
+
+  /* Returns the contents of the first line of the given file, or the empty
+   * string if it can't be read.
+   */
+  string readLine(const string& path) {
+    ifstream input(path);
+    string result;
+    getline(input, result);
+    return result;
+  }
+
+  /* Restricts the calling thread to the given CPUs, if there are any. Failing
+   * to pin only costs locality, so errors are ignored.
+   */
+  void pinCurrentThread(const vector<int>& cpus) {
+#ifdef __linux__
+    if (cpus.empty()) return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu: cpus) {
+      if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void) cpus;
+#endif
+  }
+}
+
+ReplicatedTree::Topology ReplicatedTree::numaTopology() {
+  const string root = "/sys/devices/system/node/";
+
+  Topology result;
+  for (int node: parseCpuList(readLine(root + "online"))) {
+    vector<int> cpus = parseCpuList(readLine(root + "node" + to_string(node) + "/cpulist"));
+    if (!cpus.empty()) result.push_back(std::move(cpus));
+  }
+
+  /* Without NUMA information, one unpinned replica serves everyone. */
+  if (result.empty()) result.emplace_back();
+  return result;
+}
+
+ReplicatedTree::ReplicatedTree(const ReplicationOptions& options, const Topology& topology)
+  : options(options), primary(options.duplicates) {
+  if (topology.empty()) {
+    throw runtime_error("ReplicatedTree(): the topology has no nodes.");
+  }
+
+  for (size_t i = 0; i < topology.size(); i++) {
+    for (int cpu: topology[i]) {
+      if (cpu < 0) {
+        throw runtime_error("ReplicatedTree(): negative CPU number in topology.");
+      }
+      if (size_t(cpu) >= replicaOfCpu.size()) replicaOfCpu.resize(cpu + 1, 0);
+      replicaOfCpu[cpu] = i;
+    }
+
+    replicas.emplace_back(new Replica);
+    replicas.back()->cpus    = topology[i];
+    replicas.back()->current = make_shared<const RedBlackTree>(options.duplicates);
+  }
+
+  for (auto& replica: replicas) {
+    replica->builder = thread(&ReplicatedTree::runBuilder, this, ref(*replica));
+  }
+  if (options.refreshInterval.count() > 0) {
+    refresher = thread(&ReplicatedTree::runRefresher, this);
+  }
+}
+
+ReplicatedTree::~ReplicatedTree() {
+  if (refresher.joinable()) {
+    {
+      lock_guard<mutex> guard(refresherLock);
+      refresherStopping = true;
+    }
+    refresherWakeup.notify_one();
+    refresher.join();
+  }
+
+  for (auto& replica: replicas) {
+    {
+      lock_guard<mutex> guard(replica->lock);
+      replica->stopping = true;
+    }
+    replica->wakeup.notify_one();
+    replica->builder.join();
+  }
+}
+
+bool ReplicatedTree::insert(int key) {
+  lock_guard<mutex> guard(writeLock);
+  dirty = true;
+  return primary.insert(key);
+}
+
+bool ReplicatedTree::erase(int key) {
+  lock_guard<mutex> guard(writeLock);
+  bool result = primary.erase(key);
+  dirty |= result;
+  return result;
+}
+
+/* The keys are copied out once and shared by all the builders, so writers
+ * are only held up for the copy and not for the rebuilds.
+ */
+void ReplicatedTree::refresh() {
+  lock_guard<mutex> refreshGuard(refreshLock);
+
+  shared_ptr<const vector<int>> keys;
+  {
+    lock_guard<mutex> guard(writeLock);
+    keys  = make_shared<const vector<int>>(primary.toSortedArray());
+    dirty = false;
+  }
+
+  uint64_t target = numRefreshes.load() + 1;
+  for (auto& replica: replicas) {
+    {
+      lock_guard<mutex> guard(replica->lock);
+      replica->pending        = keys;
+      replica->pendingVersion = target;
+    }
+    replica->wakeup.notify_one();
+  }
+
+  for (auto& replica: replicas) {
+    unique_lock<mutex> guard(replica->lock);
+    replica->done.wait(guard, [&] { return replica->builtVersion >= target; });
+  }
+  numRefreshes.store(target);
+}
+
+ReplicatedTree::Snapshot ReplicatedTree::snapshot() const {
+  return snapshot(localReplica());
+}
+
+ReplicatedTree::Snapshot ReplicatedTree::snapshot(size_t replica) const {
+  if (replica >= replicas.size()) {
+    throw runtime_error("ReplicatedTree::snapshot(): replica out of range.");
+  }
+  return atomic_load(&replicas[replica]->current);
+}
+
+size_t ReplicatedTree::localReplica() const {
+#ifdef __linux__
+  int cpu = sched_getcpu();
+  if (cpu >= 0 && size_t(cpu) < replicaOfCpu.size()) return replicaOfCpu[cpu];
+#endif
+  return 0;
+}
+
+/* Builds happen on this thread, which is pinned to the replica's CPUs, so the
+ * pages holding the new tree are first touched, and therefore placed, on the
+ * replica's own node.
+ */
+void ReplicatedTree::runBuilder(Replica& replica) {
+  pinCurrentThread(replica.cpus);
+
+  unique_lock<mutex> guard(replica.lock);
+  while (true) {
+    replica.wakeup.wait(guard, [&] { return replica.stopping || replica.pending; });
+    if (replica.stopping) return;
+
+    auto     keys    = std::move(replica.pending);
+    uint64_t version = replica.pendingVersion;
+    replica.pending.reset();
+    guard.unlock();
+
+    auto built = make_shared<const RedBlackTree>(
+      RedBlackTree::fromSorted(*keys, options.duplicates,
+                               RedBlackTree::InsertPolicy::BOTTOM_UP, options.memory)
+    );
+    atomic_store(&replica.current, Snapshot(std::move(built)));
+
+    guard.lock();
+    replica.builtVersion = version;
+    replica.done.notify_all();
+  }
+}
+
+void ReplicatedTree::runRefresher() {
+  unique_lock<mutex> guard(refresherLock);
+  while (!refresherWakeup.wait_for(guard, options.refreshInterval,
+                                   [&] { return refresherStopping; })) {
+    bool needed;
+    {
+      lock_guard<mutex> writeGuard(writeLock);
+      needed = dirty;
+    }
+    if (needed) refresh();
+  }
+}
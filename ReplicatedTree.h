@@ -0,0 +1,154 @@
+/******************************************************************************
+ * File: ReplicatedTree.h
+ *
+ * A read-mostly red/black tree with one read-only replica per NUMA node. On a
+ * multi-socket machine, a query against memory on another socket pays extra
+ * latency for every node it visits, so each socket gets its own copy of the
+ * tree and queries go to the copy on the socket they're running on.
+ *
+ * Writes go to a single primary tree and are published to the replicas by
+ * refresh(), either when it's called explicitly or every so often on a
+ * background thread. Each replica is rebuilt by a thread pinned to its NUMA
+ * node's CPUs, so under Linux's first-touch policy its nodes end up in that
+ * node's memory. Readers grab a snapshot of their local replica, which stays
+ * valid and unchanged for as long as they hold it.
+ *
+ * The NUMA layout comes from /sys/devices/system/node. On machines without
+ * NUMA (or without that directory), there's one replica and everything still
+ * works, which keeps this testable on a laptop.
+ */
+#pragma once
+
+#include "RedBlackTree.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* How a ReplicatedTree should store and refresh its replicas. */
+struct ReplicationOptions {
+  RedBlackTree::Duplicates duplicates = RedBlackTree::Duplicates::REJECT;
+  RedBlackTree::NodeMemory memory     = RedBlackTree::NodeMemory::DEFAULT;
+
+  /* If nonzero, a background thread refreshes the replicas this often when
+   * there have been writes. Otherwise, only refresh() does.
+   */
+  std::chrono::milliseconds refreshInterval{0};
+};
+
+class ReplicatedTree {
+public:
+  /* An immutable version of one replica. */
+  using Snapshot = std::shared_ptr<const RedBlackTree>;
+
+  /* For each replica, the CPUs whose queries it serves. An empty list means
+   * the replica's builder isn't pinned anywhere.
+   */
+  using Topology = std::vector<std::vector<int>>;
+
+  /**
+   * Returns the CPUs of each NUMA node on this machine, or a single unpinned
+   * node if the layout can't be determined.
+   */
+  static Topology numaTopology();
+
+  /**
+   * Creates an empty tree with a replica for each entry in the topology. If
+   * the topology is empty, this throws a std::runtime_error.
+   */
+  explicit ReplicatedTree(const ReplicationOptions& options = ReplicationOptions(),
+                          const Topology& topology = numaTopology());
+
+  /**
+   * Stops the background threads. Snapshots that readers still hold remain
+   * valid.
+   */
+  ~ReplicatedTree();
+
+  /**
+   * Updates the primary tree, returning what the RedBlackTree operations
+   * would. Replicas don't see the change until the next refresh.
+   */
+  bool insert(int key);
+  bool erase(int key);
+
+  /**
+   * Publishes the primary tree's current contents to every replica, and
+   * waits until all of them have it.
+   */
+  void refresh();
+
+  /**
+   * Returns how many times the replicas have been refreshed.
+   */
+  std::uint64_t version() const {
+    return numRefreshes.load();
+  }
+
+  /**
+   * Returns the latest version of the replica for the CPU this thread is
+   * running on, or of the given replica.
+   */
+  Snapshot snapshot() const;
+  Snapshot snapshot(std::size_t replica) const;
+
+  std::size_t numReplicas() const {
+    return replicas.size();
+  }
+
+  /**
+   * Returns which replica serves queries from the CPU this thread is
+   * running on.
+   */
+  std::size_t localReplica() const;
+
+private:
+  /* One replica, along with the pinned thread that rebuilds it. Requests come
+   * in through pending, guarded by lock; the builder bumps builtVersion and
+   * signals done when it has published a new tree.
+   */
+  struct Replica {
+    std::vector<int> cpus;
+    Snapshot current;            // Only accessed with std::atomic_load/store
+
+    std::mutex lock;
+    std::condition_variable wakeup;
+    std::condition_variable done;
+    std::shared_ptr<const std::vector<int>> pending;  // Keys to rebuild from
+    std::uint64_t pendingVersion = 0;
+    std::uint64_t builtVersion   = 0;
+    bool stopping = false;
+
+    std::thread builder;
+  };
+
+  ReplicationOptions options;
+  std::vector<std::unique_ptr<Replica>> replicas;
+  std::vector<std::size_t> replicaOfCpu;   // Indexed by CPU number
+
+  /* The primary copy, which takes all writes. */
+  std::mutex   writeLock;
+  RedBlackTree primary;
+  bool         dirty = false;
+
+  /* Only one refresh runs at a time. */
+  std::mutex refreshLock;
+  std::atomic<std::uint64_t> numRefreshes{0};
+
+  /* The periodic refresher, if there is one. */
+  std::mutex              refresherLock;
+  std::condition_variable refresherWakeup;
+  bool                    refresherStopping = false;
+  std::thread             refresher;
+
+  void runBuilder(Replica& replica);
+  void runRefresher();
+
+  ReplicatedTree(const ReplicatedTree &) = delete;
+  void operator= (ReplicatedTree) = delete;
+};
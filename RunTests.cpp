@@ -1,4 +1,18 @@
 #include "RedBlackTree.h"
+#include "SlidingWindow.h"
+#include "PublishedTree.h"
+#include "ShardedTree.h"
+#include "QuantileSketch.h"
+#include "OrderedIntSet.h"
+#include "BalancedTree.h"
+#include "ReplicatedTree.h"
+#include "CompressedIndex.h"
+#include "BufferedTree.h"
+#include "IndexedSequence.h"
+#include "SmallTree.h"
+#include "QueryServer.h"
+#include "QueryCache.h"
+#include "Trace.h"
 #include <iostream>
 #include <vector>
 #include <set>
@@ -6,6 +20,16 @@
 #include <random>
 #include <algorithm>
 #include <cstddef>
+#include <cmath>
+#include <climits>
+#include <deque>
+#include <sstream>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <unistd.h>
 using namespace std;
 
 namespace {
@@ -20,6 +44,1485 @@ namespace {
   const int    kMinValue   = 0;
   const int    kMaxValue   = 1000;
   const int    kNumInserts = (kMaxValue - kMinValue) * 10;
+  
+  /* How many insertions to make between checks of the weighted and quantile
+   * queries.
+   */
+  const int    kWeightedCheckInterval = 64;
+  
+  /* Confirms that a batched lookup of every value, in a scrambled order, agrees
+   * with the (sorted) reference list.
+   */
+  template <typename Tree> void checkContainsBatch(const Tree& t, const vector<int>& ref) {
+    vector<int> values;
+    for (int value = kMinValue - 1; value <= kMaxValue + 1; value++) {
+      values.push_back((value * 7919) % (kMaxValue + 3) - 1);
+    }
+    
+    unique_ptr<bool[]> results(new bool[values.size()]);
+    size_t numFound = t.containsBatch(values.data(), values.size(), results.get());
+    
+    size_t expectedFound = 0;
+    for (size_t i = 0; i < values.size(); i++) {
+      bool expected = binary_search(ref.begin(), ref.end(), values[i]);
+      if (results[i] != expected) {
+        fail("containsBatch operation did not behave as expected.");
+      }
+      expectedFound += expected;
+    }
+    if (numFound != expectedFound) {
+      fail("containsBatch miscounted the keys it found.");
+    }
+  }
+  
+  /* Confirms that weightedRankOf, selectByWeight, and the tree summary agree
+   * with the (sorted) reference list.
+   */
+  void checkWeightedQueries(const WeightedRedBlackTree& t, const vector<int>& ref) {
+    long long below = 0;
+    size_t index = 0;
+    for (int value = kMinValue; value <= kMaxValue; value++) {
+      while (index < ref.size() && ref[index] < value) below += ref[index++];
+      if (t.weightedRankOf(value) != below) {
+        fail("weightedRankOf operation did not behave as expected.");
+      }
+    }
+    
+    long long prefix = 0;
+    for (size_t i = 0; i < ref.size(); i++) {
+      if (ref[i] != 0 && t.selectByWeight(prefix + 1) != ref[i]) {
+        fail("selectByWeight operation did not behave as expected.");
+      }
+      prefix += ref[i];
+      if (t.selectByWeight(prefix) != ref[i]) {
+        fail("selectByWeight operation did not behave as expected.");
+      }
+    }
+    
+    SubtreeSummary summary = t.summary();
+    if (summary.sum != prefix ||
+        (!ref.empty() && (summary.min != ref.front() || summary.max != ref.back()))) {
+      fail("Tree summary did not match the keys in the tree.");
+    }
+  }
+  
+  /* Confirms that forEach visits exactly the keys in the reference list, in
+   * order.
+   */
+  template <typename Tree> void checkForEach(const Tree& t, const vector<int>& ref) {
+    size_t index = 0;
+    t.forEach([&](int key, size_t count) {
+      if (index >= ref.size() || key != ref[index] || count != 1) {
+        fail("forEach operation did not behave as expected.");
+      }
+      index++;
+    });
+    if (index != ref.size()) {
+      fail("forEach operation did not visit every key.");
+    }
+  }
+  
+  /* Spot-checks the exporters: every node should show up exactly once, and the
+   * limits should be respected.
+   */
+  template <typename Tree> void checkExport(const Tree& t) {
+    ostringstream levels;
+    t.exportTo(levels, RedBlackTree::ExportFormat::LEVELS);
+    string expected = "Visited " + to_string(t.distinctSize()) + " of " + to_string(t.distinctSize()) + " nodes.";
+    if (levels.str().find(expected) == string::npos) {
+      fail("LEVELS export did not visit every node.");
+    }
+    
+    ostringstream dot;
+    t.exportTo(dot, RedBlackTree::ExportFormat::DOT, 10);
+    string edges = dot.str();
+    if (size_t(count(edges.begin(), edges.end(), '>')) != min<size_t>(t.distinctSize(), 10) - 1) {
+      fail("DOT export did not respect the node limit.");
+    }
+    
+    ostringstream json;
+    t.exportTo(json, RedBlackTree::ExportFormat::JSON, SIZE_MAX, 1);
+    if (json.str().find("\"id\":1,") != string::npos) {
+      fail("JSON export did not respect the depth limit.");
+    }
+  }
+  
+  /* Reference implementation of RedBlackTree::quantile. */
+  double referenceQuantile(const vector<int>& ref, double q, RedBlackTree::Interpolation policy) {
+    q = min(max(q, 0.0), 1.0);
+    double position = q * double(ref.size() - 1);
+    double fraction = position - floor(position);
+    double lo = ref[size_t(floor(position))];
+    double hi = ref[size_t(ceil(position))];
+    
+    switch (policy) {
+      case RedBlackTree::Interpolation::LOWER:    return lo;
+      case RedBlackTree::Interpolation::HIGHER:   return hi;
+      case RedBlackTree::Interpolation::NEAREST:  return fraction <= 0.5? lo : hi;
+      case RedBlackTree::Interpolation::LINEAR:   return lo + fraction * (hi - lo);
+      case RedBlackTree::Interpolation::MIDPOINT: return (lo + hi) / 2;
+    }
+    abort();
+  }
+  
+  /* Confirms that quantile and quantiles agree with the reference list. */
+  template <typename Tree> void checkQuantiles(const Tree& t, const vector<int>& ref) {
+    const vector<double> qs = { 0.5, 0.0, 0.1, 0.25, 0.9, 0.99, 0.999, 1.0, -0.5, 1.5, 0.5 };
+    const RedBlackTree::Interpolation policies[] = {
+      RedBlackTree::Interpolation::LOWER,  RedBlackTree::Interpolation::HIGHER,
+      RedBlackTree::Interpolation::NEAREST, RedBlackTree::Interpolation::LINEAR,
+      RedBlackTree::Interpolation::MIDPOINT
+    };
+    
+    for (auto policy: policies) {
+      vector<double> batch = t.quantiles(qs, policy);
+      for (size_t i = 0; i < qs.size(); i++) {
+        if (ref.empty()) {
+          if (!std::isnan(batch[i]) || !std::isnan(t.quantile(qs[i], policy))) {
+            fail("quantile of an empty tree should be NaN.");
+          }
+          continue;
+        }
+        
+        double expected = referenceQuantile(ref, qs[i], policy);
+        if (t.quantile(qs[i], policy) != expected) {
+          fail("quantile operation did not behave as expected.");
+        }
+        if (batch[i] != expected) {
+          fail("quantiles operation did not behave as expected.");
+        }
+      }
+    }
+    
+    /* More quantiles than quantiles keeps on the stack, a NaN among them,
+     * should get the same answers as asking for each one separately.
+     */
+    vector<double> many;
+    for (int i = 0; i <= 40; i++) many.push_back(i / 40.0);
+    many.push_back(std::nan(""));
+    for (auto policy: policies) {
+      vector<double> batch = t.quantiles(many, policy);
+      for (size_t i = 0; i < many.size(); i++) {
+        double single = t.quantile(many[i], policy);
+        if (batch[i] != single && !(std::isnan(batch[i]) && std::isnan(single))) {
+          fail("quantiles operation did not behave as expected on a long batch.");
+        }
+      }
+    }
+  }
+  
+  /* Runs a random mix of insertions and deletions against a multiset tree and
+   * confirms that copies are counted correctly.
+   */
+  void checkMultiset(mt19937& gen) {
+    const int kNumOps = 5000;
+    const int kMaxKey = 50;
+    
+    RedBlackTree t(RedBlackTree::Duplicates::COUNT);
+    vector<int> ref;  // Sorted, with repeats
+    
+    uniform_int_distribution<int> keys(0, kMaxKey);
+    uniform_int_distribution<int> coin(0, 2);
+    
+    for (int i = 0; i < kNumOps; i++) {
+      int key = keys(gen);
+      auto itr = lower_bound(ref.begin(), ref.end(), key);
+      
+      /* Insert twice as often as we erase so the tree tends to grow. */
+      if (coin(gen) != 0) {
+        if (!t.insert(key)) fail("Multiset insert did not behave as expected.");
+        ref.insert(itr, key);
+      } else {
+        bool expected = itr != ref.end() && *itr == key;
+        if (t.erase(key) != expected) fail("Multiset erase did not behave as expected.");
+        if (expected) ref.erase(itr);
+      }
+      
+      size_t distinct = 0;
+      for (size_t j = 0; j < ref.size(); j++) {
+        if (j == 0 || ref[j] != ref[j - 1]) distinct++;
+      }
+      
+      if (t.getSize() != ref.size()) fail("Multiset getSize did not behave as expected.");
+      if (t.distinctSize() != distinct) fail("Multiset distinctSize did not behave as expected.");
+      for (int value = 0; value <= kMaxKey + 1; value++) {
+        auto range = equal_range(ref.begin(), ref.end(), value);
+        if (t.count(value) != size_t(range.second - range.first)) {
+          fail("Multiset count did not behave as expected.");
+        }
+        if (t.rankOf(value) != size_t(range.first - ref.begin())) {
+          fail("Multiset rankOf did not behave as expected.");
+        }
+      }
+      for (size_t j = 0; j < ref.size(); j++) {
+        if (t.select(j) != ref[j]) fail("Multiset select did not behave as expected.");
+      }
+    }
+  }
+  
+  /* Runs a tree's own consistency checks, turning a problem into a failed
+   * test.
+   */
+  template <typename Tree> void checkInvariantsOf(const Tree& t, const string& name) {
+    try {
+      t.checkInvariants();
+    } catch (const runtime_error& e) {
+      fail(name + " broke an invariant: " + e.what());
+    }
+  }
+  
+  /* Runs rounds of mixed insertions and deletions against sets and multisets
+   * under both insertion policies, checking every invariant after each round.
+   * The keys come from a small range, so erases hit often and every fixup
+   * case comes up many times over.
+   */
+  template <typename Tree> void checkInvariants(mt19937& gen) {
+    const int kRounds      = 200;
+    const int kOpsPerRound = 50;
+    const int kMaxKey      = 300;
+    
+    uniform_int_distribution<int> keys(0, kMaxKey);
+    for (auto duplicates: { RedBlackTree::Duplicates::REJECT, RedBlackTree::Duplicates::COUNT }) {
+      for (auto policy: { RedBlackTree::InsertPolicy::BOTTOM_UP, RedBlackTree::InsertPolicy::TOP_DOWN }) {
+        Tree t(duplicates, policy);
+        multiset<int> ref;
+        
+        for (int round = 0; round < kRounds; round++) {
+          /* Lean towards inserts for the first half and erases for the second. */
+          bool growing = round < kRounds / 2;
+          for (int op = 0; op < kOpsPerRound; op++) {
+            int key = keys(gen);
+            if ((gen() % 3 != 0) == growing) {
+              t.insert(key);
+              if (duplicates == RedBlackTree::Duplicates::COUNT || ref.count(key) == 0) ref.insert(key);
+            } else {
+              t.erase(key);
+              auto itr = ref.find(key);
+              if (itr != ref.end()) ref.erase(itr);
+            }
+          }
+          
+          checkInvariantsOf(t, "Red/black tree");
+          if (t.getSize() != ref.size()) {
+            fail("Red/black tree holds the wrong number of keys after mixed updates.");
+          }
+        }
+      }
+    }
+  }
+  
+  /* A tree that doesn't keep sums shouldn't have room for them in its nodes. */
+  void checkNodeSizes() {
+    if (RedBlackTree::bytesPerNode() + sizeof(SubtreeSummary) != WeightedRedBlackTree::bytesPerNode()) {
+      fail("Only a weighted tree's nodes should hold a summary.");
+    }
+  }
+  
+  /* Overwrites a file with exactly the given bytes. */
+  void writeBytes(const string& path, const vector<unsigned char>& bytes) {
+    ofstream out(path, ios::binary | ios::trunc);
+    out.write(reinterpret_cast<const char*>(bytes.data()), streamsize(bytes.size()));
+  }
+  
+  /* Confirms that reading the given file as a trace fails. */
+  void checkBadTrace(const string& path, const vector<unsigned char>& bytes, const string& what) {
+    writeBytes(path, bytes);
+    try {
+      readTrace(path);
+      fail("readTrace accepted " + what + ".");
+    } catch (const runtime_error &) {
+      /* Expected */
+    }
+  }
+  
+  /* Round-trips events through a trace file, including the extreme values of
+   * each field and enough events to make the writer flush part way through,
+   * then checks that damaged files are rejected rather than misread.
+   */
+  void checkTraceFiles(mt19937& gen) {
+    string path = "/tmp/rbt-tests-" + to_string(getpid()) + ".trace";
+    
+    const int64_t  kEdgeArguments[]   = { 0, 1, -1, 63, -64, 64, -65, INT32_MAX, INT32_MIN, INT64_MAX, INT64_MIN };
+    const uint64_t kEdgeNanoseconds[] = { 0, 1, 127, 128, 16383, 16384, UINT32_MAX, UINT64_MAX };
+    
+    vector<TraceEvent> events;
+    for (int64_t argument: kEdgeArguments) {
+      for (uint64_t nanoseconds: kEdgeNanoseconds) {
+        events.push_back({ TraceOp(events.size() % kNumTraceOps), argument, nanoseconds });
+      }
+    }
+    uniform_int_distribution<int64_t>  arguments(-1000000, 1000000);
+    uniform_int_distribution<unsigned> shifts(0, 63);
+    for (size_t i = 0; i < 50000; i++) {
+      events.push_back({ TraceOp(gen() % kNumTraceOps), arguments(gen), (uint64_t(gen()) << 32 | gen()) >> shifts(gen) });
+    }
+    
+    {
+      TraceWriter writer(path);
+      for (const auto& event: events) writer.append(event);
+      if (writer.numEvents() != events.size()) fail("TraceWriter miscounted its events.");
+    }
+    vector<TraceEvent> read = readTrace(path);
+    if (read.size() != events.size()) fail("readTrace returned the wrong number of events.");
+    for (size_t i = 0; i < events.size(); i++) {
+      if (read[i].op != events[i].op || read[i].argument != events[i].argument ||
+          read[i].nanoseconds != events[i].nanoseconds) {
+        fail("An event did not survive a round trip through a trace file.");
+      }
+    }
+    
+    ifstream in(path, ios::binary);
+    vector<unsigned char> valid((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    in.close();
+    
+    /* The header alone is an empty trace. */
+    { TraceWriter writer(path); }
+    if (!readTrace(path).empty()) fail("readTrace found events in an empty trace.");
+    
+    vector<unsigned char> header(valid.begin(), valid.begin() + 9);
+    auto withHeader = [&](vector<unsigned char> records) {
+      records.insert(records.begin(), header.begin(), header.end());
+      return records;
+    };
+    
+    checkBadTrace(path, {}, "an empty file");
+    checkBadTrace(path, vector<unsigned char>(header.begin(), header.end() - 1), "a file cut off inside the header");
+    checkBadTrace(path, { 'N', 'O', 'T', 'A', 'T', 'R', 'A', 'C', 'E' }, "a file with the wrong magic number");
+    
+    vector<unsigned char> newer = header;
+    newer.back()++;
+    checkBadTrace(path, newer, "a trace from a newer version");
+    
+    checkBadTrace(path, vector<unsigned char>(valid.begin(), valid.end() - 1), "a trace cut off inside a record");
+    checkBadTrace(path, withHeader({ 0 }), "a record with no argument");
+    checkBadTrace(path, withHeader({ 0, 0x80 }), "a varint cut off part way");
+    checkBadTrace(path, withHeader({ 0, 2 }), "a record with no latency");
+    checkBadTrace(path, withHeader({ uint8_t(kNumTraceOps), 0, 0 }), "an unknown operation");
+    checkBadTrace(path, withHeader(vector<unsigned char>{ 0, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0, 0 }),
+                  "a varint longer than 64 bits");
+    unlink(path.c_str());
+    
+    try {
+      readTrace("/nonexistent-directory/trace");
+      fail("readTrace did not report a file it couldn't open.");
+    } catch (const runtime_error &) {
+      /* Expected */
+    }
+    try {
+      TraceWriter writer("/nonexistent-directory/trace");
+      fail("TraceWriter did not report a file it couldn't create.");
+    } catch (const runtime_error &) {
+      /* Expected */
+    }
+    
+    /* Every write to /dev/full fails as though the disk were full. */
+    if (access("/dev/full", W_OK) == 0) {
+      TraceWriter writer("/dev/full");
+      writer.append({ TraceOp::INSERT, 0, 0 });
+      try {
+        writer.flush();
+        fail("TraceWriter did not report a failed write.");
+      } catch (const runtime_error &) {
+        /* Expected */
+      }
+    }
+  }
+  
+  /* Drives a traced tree alongside a plain one, checking that every call
+   * returns what the plain tree does and is recorded in order with its
+   * argument, including a select that throws.
+   */
+  void checkTracedTree(mt19937& gen) {
+    string path = "/tmp/rbt-tests-" + to_string(getpid()) + ".trace";
+    
+    RedBlackTree traced, plain;
+    vector<TraceEvent> expected;
+    {
+      TraceWriter writer(path);
+      TracedRedBlackTree t(traced, &writer);
+      uniform_int_distribution<int> keys(-500, 500);
+      for (size_t i = 0; i < 2000; i++) {
+        int key = keys(gen);
+        TraceOp op = TraceOp(gen() % kNumTraceOps);
+        if (op == TraceOp::INSERT) {
+          if (t.insert(key) != plain.insert(key)) fail("Traced insert did not match the tree's.");
+        } else if (op == TraceOp::CONTAINS) {
+          if (t.contains(key) != plain.contains(key)) fail("Traced contains did not match the tree's.");
+        } else if (op == TraceOp::RANK_OF) {
+          if (t.rankOf(key) != plain.rankOf(key)) fail("Traced rankOf did not match the tree's.");
+        } else {
+          key = int(gen() % (plain.getSize() + 1));
+          if (size_t(key) == plain.getSize()) {
+            try {
+              t.select(size_t(key));
+              fail("Traced select did not pass on an out-of-range rank.");
+            } catch (const runtime_error &) {
+              /* Expected */
+            }
+          } else if (t.select(size_t(key)) != plain.select(size_t(key))) {
+            fail("Traced select did not match the tree's.");
+          }
+        }
+        expected.push_back({ op, key, 0 });
+      }
+      if (t.getSize() != plain.getSize()) fail("Traced tree holds the wrong number of keys.");
+    }
+    
+    vector<TraceEvent> read = readTrace(path);
+    unlink(path.c_str());
+    if (read.size() != expected.size()) fail("Traced tree recorded the wrong number of calls.");
+    for (size_t i = 0; i < expected.size(); i++) {
+      if (read[i].op != expected[i].op || read[i].argument != expected[i].argument) {
+        fail("Traced tree recorded the wrong call.");
+      }
+    }
+    
+    /* Without a writer, calls are simply forwarded. */
+    RedBlackTree untraced;
+    TracedRedBlackTree t(untraced);
+    if (!t.insert(7) || t.insert(7) || !t.contains(7) || t.rankOf(7) != 0 || t.select(0) != 7) {
+      fail("Untraced tree did not forward its calls.");
+    }
+  }
+  
+  /* Checks that a histogram's percentiles bound the true ones from above by at
+   * most an eighth, that small latencies are reported exactly, and that
+   * merging two histograms gives the same answers as recording everything in
+   * one.
+   */
+  void checkLatencyHistogram(mt19937& gen) {
+    LatencyHistogram empty;
+    if (empty.numSamples() != 0 || empty.percentile(50) != 0 || empty.max() != 0 || empty.mean() != 0) {
+      fail("An empty histogram reported samples.");
+    }
+    
+    LatencyHistogram small;
+    for (uint64_t ns = 1; ns <= 10; ns++) small.record(ns);
+    if (small.percentile(0) != 1 || small.percentile(50) != 5 || small.percentile(90) != 9 ||
+        small.percentile(100) != 10 || small.max() != 10 || small.mean() != 5.5) {
+      fail("Histogram did not report small latencies exactly.");
+    }
+    
+    LatencyHistogram all, evens, odds;
+    vector<uint64_t> samples;
+    /* Shifting away a random number of bits spreads the samples over every
+     * power of two up to 2^32.
+     */
+    uniform_int_distribution<unsigned> shifts(0, 32);
+    for (size_t i = 0; i < 10000; i++) {
+      uint64_t ns = uint64_t(gen()) >> shifts(gen);
+      samples.push_back(ns);
+      all.record(ns);
+      (i % 2 == 0? evens : odds).record(ns);
+    }
+    sort(samples.begin(), samples.end());
+    
+    for (double p: { 0.0, 1.0, 10.0, 50.0, 90.0, 99.0, 99.9, 100.0 }) {
+      size_t rank = size_t(ceil(p / 100.0 * samples.size()));
+      uint64_t exact  = samples[rank == 0? 0 : rank - 1];
+      uint64_t approx = all.percentile(p);
+      if (approx < exact || approx > exact + exact / 8) {
+        fail("Histogram percentile is not within an eighth of the true one.");
+      }
+    }
+    if (all.max() != samples.back()) fail("Histogram reported the wrong maximum.");
+    
+    evens.merge(odds);
+    if (evens.numSamples() != all.numSamples() || evens.max() != all.max() || evens.mean() != all.mean()) {
+      fail("Merged histogram does not match one that saw every sample.");
+    }
+    for (double p = 0; p <= 100; p += 0.5) {
+      if (evens.percentile(p) != all.percentile(p)) {
+        fail("Merged histogram reports different percentiles.");
+      }
+    }
+  }
+  
+  /* Confirms that a sliding window holds exactly the most recent samples, by
+   * both count and age, including repeated samples.
+   */
+  void checkSlidingWindow(mt19937& gen) {
+    const size_t   kCapacity  = 200;
+    const uint64_t kMaxAge    = 150;
+    const int      kNumAdds   = 5000;
+    const int      kMaxSample = 100;
+    
+    SlidingWindow window(kCapacity, kMaxAge);
+    deque<pair<int, uint64_t>> recent;  // Reference: (value, timestamp) pairs
+    
+    uniform_int_distribution<int> values(0, kMaxSample);
+    uniform_int_distribution<int> steps(0, 3);
+    uint64_t now = 0;
+    
+    for (int i = 0; i < kNumAdds; i++) {
+      /* Every so often, jump ahead far enough that most of the window, but
+       * not all of it, ages out at once.
+       */
+      now += i % 500 == 499? kMaxAge - 20 : steps(gen);
+      int value = values(gen);
+      window.add(value, now);
+      
+      recent.emplace_back(value, now);
+      while (recent.size() > kCapacity || now - recent.front().second >= kMaxAge) {
+        recent.pop_front();
+      }
+      
+      vector<int> ref;
+      for (const auto& sample: recent) ref.push_back(sample.first);
+      sort(ref.begin(), ref.end());
+      
+      if (window.size() != ref.size()) {
+        fail("SlidingWindow holds the wrong number of samples.");
+      }
+      for (int value = 0; value <= kMaxSample; value += 7) {
+        if (window.rankOf(value) != size_t(lower_bound(ref.begin(), ref.end(), value) - ref.begin())) {
+          fail("SlidingWindow rankOf did not behave as expected.");
+        }
+      }
+      for (size_t j = 0; j < ref.size(); j += 13) {
+        if (window.select(j) != ref[j]) {
+          fail("SlidingWindow select did not behave as expected.");
+        }
+      }
+      if (window.quantile(0.99) != referenceQuantile(ref, 0.99, RedBlackTree::Interpolation::LINEAR)) {
+        fail("SlidingWindow quantile did not behave as expected.");
+      }
+    }
+    
+    /* Jump far enough ahead that everything ages out. */
+    window.advanceTo(now + kMaxAge);
+    if (window.size() != 0 || !std::isnan(window.quantile(0.5))) {
+      fail("SlidingWindow did not evict aged-out samples.");
+    }
+  }
+
+  /* Confirms that a published tree applies rebuilds in order, that readers
+   * always see a complete, sorted version while rebuilds happen around them,
+   * and that a snapshot never changes once taken.
+   */
+  void checkPublishedTree(mt19937& gen) {
+    const int kNumRebuilds = 40;
+    const int kMaxKey      = 500;
+    
+    PublishedTree published(RedBlackTree::Duplicates::COUNT);
+    vector<int> ref;  // Sorted, with repeats
+    
+    atomic<bool> done(false);
+    atomic<bool> sawBadVersion(false);
+    thread reader([&] {
+      while (!done) {
+        PublishedTree::Snapshot snapshot = published.snapshot();
+        for (size_t i = 1; i < snapshot->getSize(); i += 17) {
+          if (snapshot->select(i - 1) > snapshot->select(i) ||
+              snapshot->rankOf(snapshot->select(i)) > i) {
+            sawBadVersion = true;
+          }
+        }
+      }
+    });
+    
+    uniform_int_distribution<int> keys(0, kMaxKey);
+    PublishedTree::Snapshot held = published.snapshot();
+    for (int round = 0; round < kNumRebuilds; round++) {
+      vector<int> inserts, erases;
+      for (int i = 0; i < 100; i++) inserts.push_back(keys(gen));
+      for (int i = 0; i < 50;  i++) erases.push_back(keys(gen));
+      
+      /* Every so often, start over from an unsorted list instead. */
+      if (round % 10 == 9) {
+        ref = inserts;
+        sort(ref.begin(), ref.end());
+        published.rebuild(inserts);
+      } else {
+        for (int key: inserts) ref.insert(upper_bound(ref.begin(), ref.end(), key), key);
+        for (int key: erases) {
+          auto itr = lower_bound(ref.begin(), ref.end(), key);
+          if (itr != ref.end() && *itr == key) ref.erase(itr);
+        }
+        published.rebuildWithDelta(inserts, erases);
+      }
+      
+      if (round % 4 == 0) published.wait();
+    }
+    published.wait();
+    done = true;
+    reader.join();
+    
+    if (sawBadVersion) {
+      fail("A reader saw an inconsistent version of a PublishedTree.");
+    }
+    if (held->getSize() != 0) {
+      fail("A PublishedTree snapshot changed after it was taken.");
+    }
+    if (published.version() != uint64_t(kNumRebuilds)) {
+      fail("PublishedTree published the wrong number of versions.");
+    }
+    
+    PublishedTree::Snapshot latest = published.snapshot();
+    if (latest->getSize() != ref.size()) {
+      fail("PublishedTree holds the wrong number of keys.");
+    }
+    for (size_t i = 0; i < ref.size(); i++) {
+      if (latest->select(i) != ref[i]) {
+        fail("PublishedTree did not apply its rebuilds as expected.");
+      }
+    }
+  }
+  
+  /* Confirms that a sharded index answers global queries correctly, including
+   * across the rebalances caused by keys that all start out in one shard.
+   */
+  void checkShardedTree(mt19937& gen) {
+    const size_t kNumShards  = 4;
+    const int    kNumInserts = 20000;
+    const int    kMaxKey     = 5000;
+    
+    ShardedTree sharded(kNumShards, RedBlackTree::Duplicates::COUNT);
+    vector<int> ref;
+    
+    uniform_int_distribution<int> keys(0, kMaxKey);
+    for (int i = 1; i <= kNumInserts; i++) {
+      int key = keys(gen);
+      sharded.insert(key);
+      ref.push_back(key);
+      
+      if (i % 2500 != 0) continue;
+      sort(ref.begin(), ref.end());
+      if (sharded.getSize() != ref.size()) {
+        fail("ShardedTree holds the wrong number of keys.");
+      }
+      for (int value = -1; value <= kMaxKey + 1; value += 7) {
+        if (sharded.rankOf(value) != size_t(lower_bound(ref.begin(), ref.end(), value) - ref.begin()) ||
+            sharded.contains(value) != binary_search(ref.begin(), ref.end(), value)) {
+          fail("ShardedTree rankOf or contains did not behave as expected.");
+        }
+      }
+      for (size_t j = 0; j < ref.size(); j += 11) {
+        if (sharded.select(j) != ref[j]) {
+          fail("ShardedTree select did not behave as expected.");
+        }
+      }
+    }
+    
+    /* Everything started out in one shard, so the shards should have been
+     * evened out along the way.
+     */
+    if (sharded.numRebalances() == 0) {
+      fail("ShardedTree never rebalanced its shards.");
+    }
+    for (size_t i = 0; i < kNumShards; i++) {
+      if (sharded.shardSize(i) == 0) {
+        fail("ShardedTree left a shard empty after rebalancing.");
+      }
+    }
+  }
+  
+  /* Confirms that a quantile sketch stays within its error bound of the exact
+   * ranks from a multiset tree, while holding far fewer samples.
+   */
+  void checkQuantileSketch(mt19937& gen) {
+    const size_t kSketchK     = 100;
+    const size_t kNumSamples  = 100000;
+    const int    kMaxSample   = 1000000;
+    
+    QuantileSketch sketch(kSketchK);
+    RedBlackTree exact(RedBlackTree::Duplicates::COUNT);
+    if (!std::isnan(sketch.quantile(0.5))) {
+      fail("QuantileSketch quantile on an empty sketch did not return NaN.");
+    }
+    
+    uniform_int_distribution<int> samples(0, kMaxSample);
+    for (size_t i = 0; i < kNumSamples; i++) {
+      int sample = samples(gen);
+      sketch.add(sample);
+      exact.insert(sample);
+    }
+    
+    if (sketch.size() != kNumSamples || sketch.numRetained() > 4 * kSketchK) {
+      fail("QuantileSketch holds the wrong number of samples.");
+    }
+    
+    /* A rank estimate is off by the distance to the true rank. A selected
+     * sample is off by how far the requested rank is from the range of ranks
+     * that the sample actually occupies.
+     */
+    double allowed = sketch.errorBound() * double(kNumSamples);
+    for (size_t rank = 0; rank < kNumSamples; rank += 101) {
+      int value = exact.select(rank);
+      if (fabs(double(sketch.rankOf(value)) - double(exact.rankOf(value))) > allowed) {
+        fail("QuantileSketch rankOf is outside its error bound.");
+      }
+      
+      int chosen = sketch.select(rank);
+      double low  = double(exact.rankOf(chosen));
+      double high = low + double(exact.count(chosen));
+      if (double(rank) + allowed < low || double(rank) - allowed >= high) {
+        fail("QuantileSketch select is outside its error bound.");
+      }
+    }
+    
+    try {
+      (void) sketch.select(kNumSamples);
+      fail("QuantileSketch select did not behave as expected.");
+    } catch (const runtime_error &) {
+      // All is well!
+    }
+  }
+  
+  /* Confirms that a set with a declared key range matches a std::set through a
+   * random mix of inserts and erases, whichever representation it picks.
+   */
+  void checkOrderedIntSet(OrderedIntSet& keys, int minKey, int maxKey, mt19937& gen) {
+    const int kNumOps = 3000;
+    
+    set<int> ref;
+    uniform_int_distribution<int> dist(minKey, maxKey);
+    for (int i = 0; i < kNumOps; i++) {
+      int key = dist(gen);
+      if (i % 3 == 2) {
+        if (keys.erase(key) != (ref.erase(key) == 1)) {
+          fail("OrderedIntSet erase did not behave as expected.");
+        }
+      } else if (keys.insert(key) != ref.insert(key).second) {
+        fail("OrderedIntSet insert did not behave as expected.");
+      }
+      
+      if (i % 100 != 0) continue;
+      if (keys.getSize() != ref.size()) {
+        fail("OrderedIntSet holds the wrong number of keys.");
+      }
+      vector<int> sorted(ref.begin(), ref.end());
+      for (size_t j = 0; j < sorted.size(); j++) {
+        if (keys.select(j) != sorted[j] || keys.rankOf(sorted[j]) != j || !keys.contains(sorted[j])) {
+          fail("OrderedIntSet select, rankOf, or contains did not behave as expected.");
+        }
+      }
+      for (int j = 0; j < 50; j++) {
+        int probe = dist(gen);
+        if (keys.rankOf(probe) != size_t(lower_bound(sorted.begin(), sorted.end(), probe) - sorted.begin()) ||
+            keys.contains(probe) != ref.count(probe)) {
+          fail("OrderedIntSet rankOf or contains did not behave as expected.");
+        }
+      }
+    }
+    
+    try {
+      keys.insert(maxKey == INT_MAX? minKey - 1 : maxKey + 1);
+      fail("OrderedIntSet accepted a key out of range.");
+    } catch (const runtime_error &) {
+      // All is well!
+    }
+  }
+  
+  void checkOrderedIntSets(mt19937& gen) {
+    /* A small range, with a lower bound that isn't a multiple of 64 and keys
+     * spanning a few superblocks, is stored densely.
+     */
+    OrderedIntSet small(-37, 2000);
+    if (!small.isDense()) {
+      fail("OrderedIntSet didn't use a bitset for a small range.");
+    }
+    checkOrderedIntSet(small, -37, 2000, gen);
+    
+    OrderedIntSet large(-1000000000, 1000000000);
+    if (large.isDense()) {
+      fail("OrderedIntSet used a bitset for a huge range.");
+    }
+    checkOrderedIntSet(large, -1000000000, 1000000000, gen);
+    
+    /* Keys at the very ends of the range of ints. */
+    OrderedIntSet top(INT_MAX - 100, INT_MAX);
+    checkOrderedIntSet(top, INT_MAX - 100, INT_MAX, gen);
+    if (top.rankOf(INT_MIN) != 0 || top.contains(INT_MIN)) {
+      fail("OrderedIntSet mishandled a key below its range.");
+    }
+  }
+  
+  /* Confirms that a tree balanced by the given rule matches a std::set
+   * through a random mix of inserts and erases, and stays within its height
+   * bound.
+   */
+  template <typename Balancing> void checkBalancedTree(mt19937& gen, double heightFactor) {
+    const int kNumOps = 20000;
+    const int kMaxKey = 2000;
+    
+    BalancedTree<Balancing> t;
+    set<int> ref;
+    uniform_int_distribution<int> keys(0, kMaxKey);
+    for (int i = 0; i < kNumOps; i++) {
+      int key = keys(gen);
+      
+      /* Lean towards inserts for the first half and erases for the second. */
+      bool doInsert = (gen() % 4 != 0) == (i < kNumOps / 2);
+      if (doInsert) {
+        if (t.insert(key) != ref.insert(key).second) {
+          fail(string(Balancing::kName) + " tree insert did not behave as expected.");
+        }
+      } else if (t.erase(key) != (ref.erase(key) == 1)) {
+        fail(string(Balancing::kName) + " tree erase did not behave as expected.");
+      }
+      
+      if (t.height() > heightFactor * log2(double(ref.size()) + 1) + 1) {
+        fail(string(Balancing::kName) + " tree is taller than it should be.");
+      }
+      if (i % 500 != 0) continue;
+      
+      checkInvariantsOf(t, string(Balancing::kName) + " tree");
+      vector<int> sorted(ref.begin(), ref.end());
+      if (t.getSize() != sorted.size()) {
+        fail(string(Balancing::kName) + " tree holds the wrong number of keys.");
+      }
+      for (size_t j = 0; j < sorted.size(); j++) {
+        if (t.select(j) != sorted[j]) {
+          fail(string(Balancing::kName) + " tree select did not behave as expected.");
+        }
+      }
+      for (int value = -1; value <= kMaxKey + 1; value++) {
+        if (t.rankOf(value) != size_t(lower_bound(sorted.begin(), sorted.end(), value) - sorted.begin()) ||
+            t.contains(value) != ref.count(value)) {
+          fail(string(Balancing::kName) + " tree rankOf or contains did not behave as expected.");
+        }
+      }
+    }
+  }
+  
+  /* Checks that every replica of a ReplicatedTree holds exactly the given
+   * keys.
+   */
+  void checkReplicas(const ReplicatedTree& replicated, const set<int>& ref) {
+    vector<int> sorted(ref.begin(), ref.end());
+    for (size_t i = 0; i < replicated.numReplicas(); i++) {
+      ReplicatedTree::Snapshot replica = replicated.snapshot(i);
+      if (replica->getSize() != sorted.size()) {
+        fail("A ReplicatedTree replica holds the wrong number of keys.");
+      }
+      for (size_t j = 0; j < sorted.size(); j++) {
+        if (replica->select(j) != sorted[j]) {
+          fail("A ReplicatedTree replica holds the wrong keys.");
+        }
+      }
+    }
+  }
+  
+  void checkReplicatedTree(mt19937& gen) {
+    const int kMaxKey = 1000000;
+    
+    /* Two unpinned replicas stand in for a two-socket machine. */
+    ReplicationOptions options;
+    options.memory = RedBlackTree::NodeMemory::HUGE_PAGES;
+    ReplicatedTree replicated(options, { {}, {} });
+    if (replicated.numReplicas() != 2 || replicated.localReplica() >= 2) {
+      fail("ReplicatedTree didn't follow the topology it was given.");
+    }
+    
+    set<int> ref;
+    uniform_int_distribution<int> keys(0, kMaxKey);
+    for (int round = 0; round < 5; round++) {
+      ReplicatedTree::Snapshot held = replicated.snapshot();
+      size_t heldSize = held->getSize();
+      
+      for (int i = 0; i < 20000; i++) {
+        int key = keys(gen);
+        if (replicated.insert(key) != ref.insert(key).second) {
+          fail("ReplicatedTree insert did not behave as expected.");
+        }
+      }
+      for (int i = 0; i < 5000; i++) {
+        int key = keys(gen);
+        if (replicated.erase(key) != (ref.erase(key) == 1)) {
+          fail("ReplicatedTree erase did not behave as expected.");
+        }
+      }
+      
+      if (replicated.snapshot(1)->getSize() != heldSize) {
+        fail("A ReplicatedTree replica changed before it was refreshed.");
+      }
+      replicated.refresh();
+      if (held->getSize() != heldSize) {
+        fail("A ReplicatedTree snapshot changed after it was taken.");
+      }
+      checkReplicas(replicated, ref);
+    }
+    if (replicated.version() != 5) {
+      fail("ReplicatedTree counted its refreshes wrong.");
+    }
+    
+    /* With a refresh interval, writes show up on their own. */
+    options.refreshInterval = chrono::milliseconds(5);
+    ReplicatedTree periodic(options, { {}, {} });
+    for (int key = 0; key < 1000; key++) periodic.insert(key);
+    
+    auto deadline = chrono::steady_clock::now() + chrono::seconds(10);
+    while (periodic.snapshot(0)->getSize() != 1000 || periodic.snapshot(1)->getSize() != 1000) {
+      if (chrono::steady_clock::now() > deadline) {
+        fail("ReplicatedTree never refreshed on its own.");
+      }
+      this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    
+    /* The machine's own layout always has at least one node. */
+    ReplicatedTree local;
+    local.insert(137);
+    local.refresh();
+    if (!local.snapshot()->contains(137)) {
+      fail("ReplicatedTree on this machine's topology lost a key.");
+    }
+  }
+  
+  /* Grows a tree on huge pages one insert at a time, so it goes through many
+   * chunks, and compares it to a std::set.
+   */
+  void checkHugePages(mt19937& gen) {
+    RedBlackTree t;
+    t.setNodeMemory(RedBlackTree::NodeMemory::HUGE_PAGES);
+    set<int> ref;
+    uniform_int_distribution<int> keys(0, 1000000);
+    for (int i = 0; i < 200000; i++) {
+      int key = keys(gen);
+      if (t.insert(key) != ref.insert(key).second) {
+        fail("Insert into a tree on huge pages did not behave as expected.");
+      }
+    }
+    
+    vector<int> sorted(ref.begin(), ref.end());
+    if (t.getSize() != sorted.size()) {
+      fail("A tree on huge pages holds the wrong number of keys.");
+    }
+    for (size_t i = 0; i < sorted.size(); i += 97) {
+      if (t.select(i) != sorted[i] || t.rankOf(sorted[i]) != i) {
+        fail("A tree on huge pages holds the wrong keys.");
+      }
+    }
+    
+    t.clear();
+    for (int key = 0; key < 1000; key++) t.insert(key);
+    if (t.getSize() != 1000 || t.select(999) != 999) {
+      fail("A cleared tree on huge pages did not refill correctly.");
+    }
+  }
+  
+  /* Confirms that a compressed index answers every query the same way as a
+   * binary search over the sorted keys.
+   */
+  void checkCompressedIndex(const vector<int>& sorted, const vector<int>& probes) {
+    CompressedIndex index(sorted);
+    if (index.getSize() != sorted.size()) {
+      fail("CompressedIndex holds the wrong number of keys.");
+    }
+    for (size_t i = 0; i < sorted.size(); i++) {
+      if (index.select(i) != sorted[i]) {
+        fail("CompressedIndex select did not behave as expected.");
+      }
+    }
+    for (int key: probes) {
+      size_t rank = lower_bound(sorted.begin(), sorted.end(), key) - sorted.begin();
+      if (index.rankOf(key) != rank) {
+        fail("CompressedIndex rankOf did not behave as expected.");
+      }
+      if (index.contains(key) != binary_search(sorted.begin(), sorted.end(), key)) {
+        fail("CompressedIndex contains did not behave as expected.");
+      }
+    }
+  }
+  
+  void checkCompressedIndexes(mt19937& gen) {
+    const size_t kNumKeys = 20000;
+    
+    /* Sparse keys, dense keys with no low bits at all, and keys with lots of
+     * repeats. Every probe set includes each key and its neighbors.
+     */
+    for (int spread: { 1000000, 1, 3 }) {
+      uniform_int_distribution<int> keys(-spread * int(kNumKeys) / 2, spread * int(kNumKeys) / 2);
+      vector<int> sorted(kNumKeys);
+      for (int& key: sorted) key = keys(gen);
+      sort(sorted.begin(), sorted.end());
+      
+      vector<int> probes;
+      for (int key: sorted) {
+        probes.push_back(key - 1);
+        probes.push_back(key);
+        probes.push_back(key + 1);
+      }
+      probes.push_back(INT_MIN);
+      probes.push_back(INT_MAX);
+      checkCompressedIndex(sorted, probes);
+      
+      /* A set's worth of these, with one copy each. */
+      sorted.erase(unique(sorted.begin(), sorted.end()), sorted.end());
+      checkCompressedIndex(sorted, probes);
+    }
+    
+    /* The full range of ints, and the empty index. */
+    checkCompressedIndex({ INT_MIN, INT_MIN + 1, -1, 0, INT_MAX - 1, INT_MAX },
+                         { INT_MIN, INT_MIN + 1, INT_MIN + 2, -1, 0, 1, INT_MAX - 1, INT_MAX });
+    checkCompressedIndex({}, { INT_MIN, 0, INT_MAX });
+    
+    /* Exporting a multiset keeps every copy. */
+    RedBlackTree t(RedBlackTree::Duplicates::COUNT);
+    vector<int> sorted;
+    uniform_int_distribution<int> keys(0, 5000);
+    for (size_t i = 0; i < kNumKeys; i++) {
+      int key = keys(gen);
+      t.insert(key);
+      sorted.push_back(key);
+    }
+    sort(sorted.begin(), sorted.end());
+    CompressedIndex exported(t);
+    if (exported.getSize() != sorted.size() || exported.select(kNumKeys / 2) != sorted[kNumKeys / 2]) {
+      fail("CompressedIndex built from a tree holds the wrong keys.");
+    }
+    
+    /* Random 32-bit keys should fit in a few bytes each. */
+    uniform_int_distribution<int> anyKey(INT_MIN, INT_MAX);
+    vector<int> spread(100000);
+    for (int& key: spread) key = anyKey(gen);
+    sort(spread.begin(), spread.end());
+    if (CompressedIndex(spread).bytesUsed() > 3 * spread.size()) {
+      fail("CompressedIndex takes more space than it should.");
+    }
+    
+    try {
+      CompressedIndex unsorted(vector<int>{ 3, 1, 2 });
+      fail("CompressedIndex accepted unsorted keys.");
+    } catch (const runtime_error &) {
+      // All is well!
+    }
+  }
+  
+  /* Runs a buffered tree through a random mix of operations, comparing it
+   * against a sorted vector, with a buffer small enough that keys are spread
+   * over several runs as well as the tree.
+   */
+  void checkBufferedTree(RedBlackTree::Duplicates duplicates, mt19937& gen) {
+    const int kNumOps = 20000;
+    const int kMaxKey = 3000;
+    
+    BufferedTree t(duplicates, 5);
+    vector<int> ref;  // Sorted, with repeats in a multiset
+    uniform_int_distribution<int> keys(0, kMaxKey);
+    for (int i = 0; i < kNumOps; i++) {
+      int key = keys(gen);
+      auto itr = lower_bound(ref.begin(), ref.end(), key);
+      bool present = itr != ref.end() && *itr == key;
+      
+      if (gen() % 3 != 0) {
+        bool added = duplicates == RedBlackTree::Duplicates::COUNT || !present;
+        if (added) ref.insert(itr, key);
+        if (t.insert(key) != added) {
+          fail("BufferedTree insert did not behave as expected.");
+        }
+      } else {
+        if (present) ref.erase(itr);
+        if (t.erase(key) != present) {
+          fail("BufferedTree erase did not behave as expected.");
+        }
+      }
+      
+      if (t.getSize() != ref.size()) {
+        fail("BufferedTree holds the wrong number of keys.");
+      }
+      if (i % 97 != 0) continue;
+      
+      for (size_t j = 0; j < ref.size(); j++) {
+        if (t.select(j) != ref[j]) {
+          fail("BufferedTree select did not behave as expected.");
+        }
+      }
+      for (int value = -1; value <= kMaxKey + 1; value += 7) {
+        if (t.rankOf(value) != size_t(lower_bound(ref.begin(), ref.end(), value) - ref.begin()) ||
+            t.contains(value) != binary_search(ref.begin(), ref.end(), value)) {
+          fail("BufferedTree rankOf or contains did not behave as expected.");
+        }
+      }
+    }
+    
+    const RedBlackTree& merged = t.merged();
+    if (t.buffered() != 0 || merged.getSize() != ref.size() ||
+        (!ref.empty() && merged.select(ref.size() / 2) != ref[ref.size() / 2])) {
+      fail("BufferedTree did not merge its buffer correctly.");
+    }
+  }
+  
+  /* Confirms that an indexed sequence holds exactly the values in the vector
+   * and is as short as an AVL tree should be.
+   */
+  void checkSequenceContents(const IndexedSequence<int>& seq, const vector<int>& ref) {
+    if (seq.getSize() != ref.size()) {
+      fail("IndexedSequence holds the wrong number of values.");
+    }
+    vector<int> values;
+    seq.forEach([&](int value) {
+      values.push_back(value);
+    });
+    if (values != ref) {
+      fail("IndexedSequence holds the wrong values.");
+    }
+    if (seq.height() > 1.45 * log2(double(ref.size()) + 2)) {
+      fail("IndexedSequence is taller than it should be.");
+    }
+  }
+  
+  void checkIndexedSequence(mt19937& gen) {
+    const int kNumOps = 20000;
+    
+    IndexedSequence<int> seq;
+    vector<int> ref;
+    for (int i = 0; i < kNumOps; i++) {
+      size_t choice = gen() % 16;
+      
+      /* Lean towards inserts for the first half and erases for the second. */
+      bool growing = i < kNumOps / 2;
+      if (ref.empty() || choice < (growing? 10u : 5u)) {
+        size_t index = gen() % (ref.size() + 1);
+        int    value = int(gen() % 100000);
+        seq.insertAt(index, value);
+        ref.insert(ref.begin() + index, value);
+      } else if (choice < 14) {
+        size_t index = gen() % ref.size();
+        seq.eraseAt(index);
+        ref.erase(ref.begin() + index);
+      } else if (choice == 14) {
+        /* Cut a block out and paste it back somewhere else. */
+        size_t begin = gen() % (ref.size() + 1);
+        size_t end   = begin + gen() % (ref.size() - begin + 1);
+        IndexedSequence<int> block = seq.extract(begin, end);
+        vector<int> refBlock(ref.begin() + begin, ref.begin() + end);
+        ref.erase(ref.begin() + begin, ref.begin() + end);
+        checkSequenceContents(block, refBlock);
+        
+        size_t index = gen() % (ref.size() + 1);
+        seq.splice(index, std::move(block));
+        ref.insert(ref.begin() + index, refBlock.begin(), refBlock.end());
+        if (block.getSize() != 0) {
+          fail("IndexedSequence splice didn't empty the spliced sequence.");
+        }
+      } else {
+        /* Append a balanced block of a random size. */
+        vector<int> more(gen() % 200);
+        for (int& value: more) value = int(gen() % 100000);
+        seq.concat(IndexedSequence<int>::fromVector(more));
+        ref.insert(ref.end(), more.begin(), more.end());
+      }
+      
+      if (!ref.empty()) {
+        size_t index = gen() % ref.size();
+        if (seq.at(index) != ref[index]) {
+          fail("IndexedSequence at did not behave as expected.");
+        }
+      }
+      if (i % 500 == 0) checkSequenceContents(seq, ref);
+    }
+    checkSequenceContents(seq, ref);
+    
+    /* Writing through at changes just that value. */
+    if (!ref.empty()) {
+      seq.at(0) = -1;
+      ref[0]    = -1;
+      checkSequenceContents(seq, ref);
+    }
+    
+    try {
+      seq.insertAt(ref.size() + 1, 0);
+      fail("IndexedSequence inserted past the end.");
+    } catch (const runtime_error &) {
+      // All is well!
+    }
+  }
+  
+  /* Grows and shrinks a small tree across its inline capacity a few times,
+   * comparing it to a sorted vector, with keys at the ends of the range of
+   * ints mixed in.
+   */
+  void checkSmallTree(RedBlackTree::Duplicates duplicates, mt19937& gen) {
+    const int kNumOps = 20000;
+    
+    SmallTree<8> t(duplicates);
+    vector<int> ref;   // Sorted, with repeats in a multiset
+    const int kKeys[] = { INT_MIN, -5, -1, 0, 1, 2, 3, 5, 8, 13, 21, 34, 55, 89, INT_MAX - 1, INT_MAX };
+    bool wasInline = true, promoted = false, demoted = false;
+    for (int i = 0; i < kNumOps; i++) {
+      /* Drift up and down through the capacity every thousand steps. Erases
+       * usually pick a key that's there, so a multiset drains all the way.
+       */
+      bool doInsert = (gen() % 8 < 7) == ((i / 1000) % 2 == 0);
+      int key = kKeys[gen() % 16];
+      if (!doInsert && !ref.empty() && gen() % 4 != 0) key = ref[gen() % ref.size()];
+      
+      auto itr = lower_bound(ref.begin(), ref.end(), key);
+      bool present = itr != ref.end() && *itr == key;
+      if (doInsert) {
+        bool added = duplicates == RedBlackTree::Duplicates::COUNT || !present;
+        if (added) ref.insert(itr, key);
+        if (t.insert(key) != added) {
+          fail("SmallTree insert did not behave as expected.");
+        }
+      } else {
+        if (present) ref.erase(itr);
+        if (t.erase(key) != present) {
+          fail("SmallTree erase did not behave as expected.");
+        }
+      }
+      
+      promoted |= wasInline && !t.isInline();
+      demoted  |= !wasInline && t.isInline();
+      wasInline = t.isInline();
+      if (t.isInline() && ref.size() > 8) {
+        fail("SmallTree holds more keys inline than it has room for.");
+      }
+      
+      if (t.getSize() != ref.size()) {
+        fail("SmallTree holds the wrong number of keys.");
+      }
+      for (size_t j = 0; j < ref.size(); j++) {
+        if (t.select(j) != ref[j]) {
+          fail("SmallTree select did not behave as expected.");
+        }
+      }
+      for (int value: kKeys) {
+        if (t.rankOf(value) != size_t(lower_bound(ref.begin(), ref.end(), value) - ref.begin()) ||
+            t.contains(value) != binary_search(ref.begin(), ref.end(), value)) {
+          fail("SmallTree rankOf or contains did not behave as expected.");
+        }
+      }
+    }
+    
+    if (!promoted || !demoted) {
+      fail("SmallTree never moved between its array and a tree.");
+    }
+  }
+  
+  /* Runs a query server on a thread and sends it pipelined batches from two
+   * clients at once: one mixing inserts and reads, checked against a
+   * std::set, and one only reading.
+   */
+  void checkQueryServer(mt19937& gen) {
+    const int kMaxKey = 5000;
+    
+    string path = "/tmp/rbt-tests-" + to_string(getpid()) + ".sock";
+    RedBlackTree t;
+    QueryServer server(t, path);
+    thread serving([&] { server.run(); });
+    
+    atomic<bool> done(false);
+    atomic<bool> sawBadReply(false);
+    thread reader([&] {
+      QueryClient client(path);
+      vector<QueryRequest> requests;
+      for (int key = 0; key < 100; key++) requests.push_back({ TraceOp::RANK_OF, uint32_t(key * 50) });
+      while (!done) {
+        vector<QueryReply> replies = client.call(requests);
+        for (size_t i = 1; i < replies.size(); i++) {
+          if (replies[i].status != QueryStatus::OK || replies[i].value < replies[i - 1].value) {
+            sawBadReply = true;
+          }
+        }
+      }
+    });
+    
+    QueryClient client(path);
+    set<int> ref;
+    uniform_int_distribution<int> keys(-kMaxKey, kMaxKey);
+    for (int round = 0; round < 50; round++) {
+      /* Long runs of one operation, so that the server batches them. */
+      vector<QueryRequest> requests;
+      for (int run = 0; run < 8; run++) {
+        TraceOp op = TraceOp(gen() % kNumTraceOps);
+        for (size_t i = gen() % 40; i > 0; i--) {
+          uint32_t argument = op == TraceOp::SELECT? uint32_t(gen() % (ref.size() + 200))
+                                                   : uint32_t(keys(gen));
+          requests.push_back({ op, argument });
+        }
+      }
+      
+      vector<QueryReply> replies = client.call(requests);
+      for (size_t i = 0; i < requests.size(); i++) {
+        int key = int(requests[i].argument);
+        QueryReply expected = { QueryStatus::OK, 0 };
+        switch (requests[i].op) {
+          case TraceOp::INSERT:   expected.value = ref.insert(key).second; break;
+          case TraceOp::CONTAINS: expected.value = ref.count(key);         break;
+          case TraceOp::RANK_OF:
+            expected.value = uint32_t(distance(ref.begin(), ref.lower_bound(key)));
+            break;
+          case TraceOp::SELECT:
+            if (requests[i].argument < ref.size()) {
+              expected.value = uint32_t(*next(ref.begin(), requests[i].argument));
+            } else {
+              expected.status = QueryStatus::OUT_OF_RANGE;
+            }
+            break;
+        }
+        if (replies[i].status != expected.status || replies[i].value != expected.value) {
+          fail("QueryServer gave the wrong reply to a request.");
+        }
+      }
+    }
+    
+    /* An unknown opcode in the middle of a stretch of reads gets its own
+     * reply without throwing off the contains answers on either side of it.
+     */
+    int present = *ref.begin(), absent = kMaxKey + 1;
+    vector<QueryReply> mixed = client.call({ { TraceOp::CONTAINS, uint32_t(absent) }, { TraceOp(200), 0 },
+                                             { TraceOp::RANK_OF, uint32_t(present) },
+                                             { TraceOp::CONTAINS, uint32_t(present) } });
+    if (mixed[0].value != 0 || mixed[1].status != QueryStatus::BAD_REQUEST ||
+        mixed[2].value != 0 || mixed[3].value != 1) {
+      fail("QueryServer mixed up the replies to a stretch of reads.");
+    }
+    
+    done = true;
+    reader.join();
+    server.stop();
+    serving.join();
+    
+    if (sawBadReply) {
+      fail("A concurrent QueryServer reader got an inconsistent reply.");
+    }
+    if (server.numBatches() >= server.numRequests()) {
+      fail("QueryServer never batched requests together.");
+    }
+  }
+  
+  /* Mostly repeats a few queries through a small cache, with the odd write,
+   * clear, and swap mixed in, and checks every answer against the tree.
+   */
+  void checkQueryCache(mt19937& gen) {
+    const int kNumOps = 50000;
+    
+    RedBlackTree t(RedBlackTree::Duplicates::COUNT);
+    QueryCache cache(t, 16);
+    size_t queries = 0;
+    for (int i = 0; i < kNumOps; i++) {
+      int key = int(gen() % 64) - 32;
+      switch (gen() % 64) {
+        case 0: case 1: case 2:
+          t.insert(key);
+          break;
+        case 3:
+          t.erase(key);
+          break;
+        case 4:
+          if (gen() % 50 == 0) t.clear();
+          break;
+        case 5:
+          if (gen() % 50 == 0) {
+            RedBlackTree other = RedBlackTree::fromSorted(vector<int>{ 1, 2, 3 });
+            t.swap(other);
+            t.swap(other);
+          }
+          break;
+        default:
+          if (gen() % 2 == 0) {
+            queries++;
+            if (cache.rankOf(key) != t.rankOf(key)) {
+              fail("QueryCache rankOf disagrees with the tree.");
+            }
+          } else {
+            size_t rank = gen() % 40;
+            if (rank < t.getSize()) {
+              queries++;
+              if (cache.select(rank) != t.select(rank)) {
+                fail("QueryCache select disagrees with the tree.");
+              }
+            } else {
+              try {
+                cache.select(rank);
+                fail("QueryCache select did not throw past the end of the tree.");
+              } catch (const runtime_error &) {
+                /* Expected. It still counts as a miss. */
+              }
+              queries++;
+            }
+          }
+      }
+    }
+    
+    if (cache.numHits() + cache.numMisses() != queries) {
+      fail("QueryCache counted the wrong number of queries.");
+    }
+    if (cache.numHits() == 0 || cache.numStaleMisses() == 0 || cache.numStaleMisses() > cache.numMisses()) {
+      fail("QueryCache statistics are implausible.");
+    }
+    
+    /* A repeat is a hit, a rejected duplicate doesn't invalidate anything, and
+     * a real insert does.
+     */
+    RedBlackTree s = RedBlackTree::fromSorted(vector<int>{ 10, 20, 30 });
+    QueryCache small(s, 4);
+    small.rankOf(20);
+    small.rankOf(20);
+    s.insert(20);
+    small.rankOf(20);
+    if (small.numHits() != 2 || small.numMisses() != 1) {
+      fail("QueryCache missed a query it should have answered.");
+    }
+    s.insert(15);
+    if (small.rankOf(20) != 2 || small.numStaleMisses() != 1) {
+      fail("QueryCache answered from a stale entry.");
+    }
+    small.clear();
+    if (small.numHits() != 0 || small.numMisses() != 0 || small.hitRate() != 0.0) {
+      fail("QueryCache did not reset its statistics.");
+    }
+  }
+  
+  /* Checks parallel walks and exports, on trees big enough to be split into
+   * many pieces and on ones too small to split at all, against the order a
+   * serial forEach gives.
+   */
+  void checkParallelWalks(mt19937& gen) {
+    string path = "/tmp/rbt-tests-" + to_string(getpid()) + ".keys";
+    for (auto duplicates: { RedBlackTree::Duplicates::REJECT, RedBlackTree::Duplicates::COUNT }) {
+      for (size_t numKeys: { size_t(0), size_t(1), size_t(1000), size_t(100000) }) {
+        RedBlackTree t(duplicates);
+        uniform_int_distribution<int> keys(-int(numKeys), int(numKeys));
+        for (size_t i = 0; i < numKeys; i++) t.insert(keys(gen));
+        
+        vector<int> expected;
+        t.forEach([&](int key, size_t count) { expected.insert(expected.end(), count, key); });
+        
+        for (size_t numThreads: { 1, 2, 3, 8 }) {
+          if (t.toSortedArray(numThreads) != expected) {
+            fail("toSortedArray did not produce the keys in sorted order.");
+          }
+          
+          /* Every rank gets written exactly once, by the call for its key. */
+          vector<int>    seen(t.getSize());
+          atomic<size_t> calls(0);
+          t.parallelForEach([&](int key, size_t count, size_t rank) {
+            for (size_t i = 0; i < count; i++) seen[rank + i] = key;
+            calls++;
+          }, numThreads);
+          if (seen != expected || calls != t.distinctSize()) {
+            fail("parallelForEach did not visit each key once at its rank.");
+          }
+          
+          t.writeTo(path, numThreads);
+          ifstream in(path, ios::binary);
+          vector<int> written(t.getSize());
+          in.read(reinterpret_cast<char*>(written.data()), streamsize(written.size() * sizeof(int)));
+          if (!in || in.peek() != EOF || written != expected) {
+            fail("writeTo did not write the keys in sorted order.");
+          }
+        }
+        
+        try {
+          t.toSortedArray(size_t(0));
+          fail("A parallel walk ran with no threads.");
+        } catch (const runtime_error &) {
+          /* Expected */
+        }
+      }
+    }
+    unlink(path.c_str());
+    
+    try {
+      RedBlackTree().writeTo("/nonexistent-directory/keys", 2);
+      fail("writeTo did not report a file it couldn't open.");
+    } catch (const runtime_error &) {
+      /* Expected */
+    }
+  }
 }
 
 int main() {
@@ -33,7 +1536,11 @@ int main() {
   for (size_t round = 1; round <= kNumRounds; round++) {
     cout << "Round " << round << " / " << kNumRounds << "... " << flush;
     
-    RedBlackTree t;
+    /* Alternate between the two insertion algorithms from round to round. */
+    WeightedRedBlackTree t(RedBlackTree::Duplicates::REJECT,
+                           round % 2 == 0? RedBlackTree::InsertPolicy::TOP_DOWN
+                                         : RedBlackTree::InsertPolicy::BOTTOM_UP);
+    checkQuantiles(t, {});
     
     /* Reference implementation; is sorted. */
     vector<int> ref;
@@ -84,7 +1591,19 @@ int main() {
           fail("select operation did not behave as expected.");
         }
       }
+      
+      /* Periodically confirm the weighted queries work. */
+      if (i % kWeightedCheckInterval == 0) {
+        checkWeightedQueries(t, ref);
+        checkQuantiles(t, ref);
+        checkForEach(t, ref);
+        checkContainsBatch(t, ref);
+      }
     }
+    checkWeightedQueries(t, ref);
+    checkQuantiles(t, ref);
+    checkExport(t);
+    checkInvariantsOf(t, "Red/black tree");
     
     /* Just once, try doing an out-of-bounds select. */
     try {
@@ -96,8 +1615,139 @@ int main() {
       fail("select operation did not behave as expected.");
     }
     
+    /* Likewise for an out-of-bounds weighted select. */
+    try {
+      (void) t.selectByWeight(t.summary().sum + 1);
+      fail("selectByWeight operation did not behave as expected.");
+    } catch (const runtime_error &) {
+      // All is well!
+    } catch (...) {
+      fail("selectByWeight operation did not behave as expected.");
+    }
+    
+    /* Empty the tree, then refill it with the same keys in reverse so that the
+     * recycled storage gets used in a different shape.
+     */
+    t.clear();
+    if (t.getSize() != 0 || t.contains(ref.front()) || t.rankOf(kMaxValue) != 0) {
+      fail("clear operation did not behave as expected.");
+    }
+    for (size_t i = ref.size(); i > 0; i--) {
+      t.insert(ref[i - 1]);
+    }
+    for (size_t i = 0; i < ref.size(); i++) {
+      if (t.select(i) != ref[i]) {
+        fail("Tree did not behave as expected after being cleared.");
+      }
+    }
+    checkWeightedQueries(t, ref);
+    
+    /* Bulk-loading the same keys should give the same tree. */
+    WeightedRedBlackTree bulk = WeightedRedBlackTree::fromSorted(ref);
+    for (size_t i = 0; i < ref.size(); i++) {
+      if (bulk.select(i) != ref[i]) {
+        fail("fromSorted did not behave as expected.");
+      }
+    }
+    checkWeightedQueries(bulk, ref);
+    
+    /* Moving the tree around shouldn't disturb its contents. */
+    vector<WeightedRedBlackTree> trees;
+    trees.push_back(std::move(t));
+    trees.emplace_back();
+    trees.resize(8);
+    swap(trees[0], trees[7]);
+    if (t.getSize() != 0 || trees[0].getSize() != 0 || trees[7].getSize() != ref.size()) {
+      fail("Moving or swapping a tree did not behave as expected.");
+    }
+    t = std::move(trees[7]);
+    checkWeightedQueries(t, ref);
+    
     cout << "done!" << endl;
   }
   
+  cout << "Multiset... " << flush;
+  checkMultiset(gen);
+  cout << "done!" << endl;
+  
+  cout << "Invariants... " << flush;
+  checkInvariants<RedBlackTree>(gen);
+  checkInvariants<WeightedRedBlackTree>(gen);
+  checkNodeSizes();
+  cout << "done!" << endl;
+  
+  cout << "Trace files... " << flush;
+  checkTraceFiles(gen);
+  checkTracedTree(gen);
+  checkLatencyHistogram(gen);
+  cout << "done!" << endl;
+  
+  cout << "Sliding window... " << flush;
+  checkSlidingWindow(gen);
+  cout << "done!" << endl;
+  
+  cout << "Published tree... " << flush;
+  checkPublishedTree(gen);
+  cout << "done!" << endl;
+  
+  cout << "Sharded tree... " << flush;
+  checkShardedTree(gen);
+  cout << "done!" << endl;
+  
+  cout << "Quantile sketch... " << flush;
+  checkQuantileSketch(gen);
+  cout << "done!" << endl;
+  
+  cout << "Ordered int sets... " << flush;
+  checkOrderedIntSets(gen);
+  cout << "done!" << endl;
+  
+  /* AVL trees have height at most about 1.44 lg n, and red/black and WAVL
+   * trees at most 2 lg n.
+   */
+  cout << "Balancing policies... " << flush;
+  checkBalancedTree<RedBlackBalancing>(gen, 2);
+  checkBalancedTree<AvlBalancing>(gen, 1.45);
+  checkBalancedTree<WavlBalancing>(gen, 2);
+  cout << "done!" << endl;
+  
+  cout << "Huge pages... " << flush;
+  checkHugePages(gen);
+  cout << "done!" << endl;
+  
+  cout << "Replicated tree... " << flush;
+  checkReplicatedTree(gen);
+  cout << "done!" << endl;
+  
+  cout << "Compressed index... " << flush;
+  checkCompressedIndexes(gen);
+  cout << "done!" << endl;
+  
+  cout << "Buffered tree... " << flush;
+  checkBufferedTree(RedBlackTree::Duplicates::REJECT, gen);
+  checkBufferedTree(RedBlackTree::Duplicates::COUNT, gen);
+  cout << "done!" << endl;
+  
+  cout << "Indexed sequence... " << flush;
+  checkIndexedSequence(gen);
+  cout << "done!" << endl;
+  
+  cout << "Small trees... " << flush;
+  checkSmallTree(RedBlackTree::Duplicates::REJECT, gen);
+  checkSmallTree(RedBlackTree::Duplicates::COUNT, gen);
+  cout << "done!" << endl;
+  
+  cout << "Query server... " << flush;
+  checkQueryServer(gen);
+  cout << "done!" << endl;
+  
+  cout << "Query cache... " << flush;
+  checkQueryCache(gen);
+  cout << "done!" << endl;
+  
+  cout << "Parallel walks... " << flush;
+  checkParallelWalks(gen);
+  cout << "done!" << endl;
+  
   cout << "All tests passed!" << endl;
 }
@@ -0,0 +1,201 @@
+#include "ShardedTree.h"
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <stdexcept>
+using namespace std;
+
+namespace {
+  /* How many keys a shard collects before handing them to its worker. Bigger
+   * batches mean less locking, smaller ones keep the workers busier.
+   */
+  const size_t kBatchSize = 256;
+
+  /* The shards are rebalanced when the biggest one has more than kMaxSkew
+   * times its fair share of the keys, as long as there are at least
+   * kMinKeysPerShard keys per shard overall.
+   */
+  const size_t kMaxSkew         = 2;
+  const size_t kMinKeysPerShard = 1024;
+}
+
+ShardedTree::ShardedTree(size_t numShards, RedBlackTree::Duplicates duplicates)
+  : duplicates(duplicates), prefix(numShards + 1, 0) {
+  if (numShards == 0) {
+    throw runtime_error("ShardedTree(): there must be at least one shard.");
+  }
+
+  /* Carve the range of ints into equal pieces. */
+  for (size_t i = 1; i < numShards; i++) {
+    int64_t span = int64_t(UINT_MAX) + 1;
+    boundaries.push_back(int(int64_t(INT_MIN) + span * int64_t(i) / int64_t(numShards)));
+  }
+
+  for (size_t i = 0; i < numShards; i++) {
+    shards.emplace_back(new Shard(duplicates));
+    shards.back()->worker = thread(&Shard::run, shards.back().get());
+  }
+}
+
+ShardedTree::~ShardedTree() {
+  for (auto& shard: shards) {
+    handOff(*shard);
+    {
+      lock_guard<mutex> guard(shard->lock);
+      shard->stopping = true;
+    }
+    shard->wakeup.notify_one();
+  }
+  for (auto& shard: shards) {
+    shard->worker.join();
+  }
+}
+
+/* The worker sleeps until a batch arrives, applies it without holding the
+ * lock, and says when it's caught up. It only stops once its inbox is empty.
+ */
+void ShardedTree::Shard::run() {
+  vector<int> batch;
+  unique_lock<mutex> guard(lock);
+  while (true) {
+    wakeup.wait(guard, [&] { return !inbox.empty() || stopping; });
+    if (inbox.empty()) return;
+
+    batch.swap(inbox);
+    busy = true;
+    guard.unlock();
+
+    for (int key: batch) tree.insert(key);
+    batch.clear();
+
+    guard.lock();
+    busy = false;
+    if (inbox.empty()) done.notify_all();
+  }
+}
+
+size_t ShardedTree::shardFor(int key) const {
+  return upper_bound(boundaries.begin(), boundaries.end(), key) - boundaries.begin();
+}
+
+void ShardedTree::handOff(Shard& shard) {
+  if (shard.staged.empty()) return;
+  {
+    lock_guard<mutex> guard(shard.lock);
+    if (shard.inbox.empty()) {
+      shard.inbox.swap(shard.staged);
+    } else {
+      shard.inbox.insert(shard.inbox.end(), shard.staged.begin(), shard.staged.end());
+    }
+  }
+  shard.staged.clear();
+  shard.wakeup.notify_one();
+}
+
+void ShardedTree::waitIdle(Shard& shard) {
+  unique_lock<mutex> guard(shard.lock);
+  shard.done.wait(guard, [&] { return shard.inbox.empty() && !shard.busy; });
+}
+
+void ShardedTree::insert(int key) {
+  Shard& shard = *shards[shardFor(key)];
+  shard.staged.push_back(key);
+  if (shard.staged.size() >= kBatchSize) handOff(shard);
+}
+
+/* Once every worker is idle, the trees are safe to read and modify from this
+ * thread; the lock handoff in waitIdle makes the workers' changes visible.
+ */
+void ShardedTree::flush() {
+  for (auto& shard: shards) handOff(*shard);
+  for (auto& shard: shards) waitIdle(*shard);
+
+  if (isSkewed()) rebalance();
+
+  for (size_t i = 0; i < shards.size(); i++) {
+    prefix[i + 1] = prefix[i] + shards[i]->tree.getSize();
+  }
+}
+
+/* A rebalance costs time linear in the number of keys, so we also insist that
+ * the index has grown by half since the last one. Otherwise a pile of copies
+ * of one key, which can't be split up, would trigger a rebalance every flush.
+ */
+bool ShardedTree::isSkewed() const {
+  size_t total = 0, biggest = 0;
+  for (const auto& shard: shards) {
+    total  += shard->tree.getSize();
+    biggest = max(biggest, shard->tree.getSize());
+  }
+
+  if (total < kMinKeysPerShard * shards.size()) return false;
+  if (2 * total < 3 * lastRebalanceSize)        return false;
+  return biggest * shards.size() > kMaxSkew * total;
+}
+
+/* Since the shards cover consecutive ranges, listing their keys one shard
+ * after the other gives every key in sorted order. The new boundaries are
+ * the keys at evenly spaced ranks. All copies of a key have to land in the
+ * same shard, so each shard takes everything strictly less than its
+ * boundary.
+ */
+void ShardedTree::rebalance() {
+  size_t total = 0;
+  for (const auto& shard: shards) {
+    total += shard->tree.getSize();
+  }
+  vector<int> keys(total);
+  size_t offset = 0;
+  for (const auto& shard: shards) {
+    shard->tree.toSortedArray(keys.data() + offset);
+    offset += shard->tree.getSize();
+  }
+
+  size_t begin = 0;
+  for (size_t i = 0; i < shards.size(); i++) {
+    size_t end = keys.size();
+    if (i + 1 < shards.size()) {
+      boundaries[i] = keys[keys.size() * (i + 1) / shards.size()];
+      end = lower_bound(keys.begin() + begin, keys.end(), boundaries[i]) - keys.begin();
+    }
+
+    shards[i]->tree = RedBlackTree::fromSorted(keys.data() + begin, end - begin, duplicates);
+    begin = end;
+  }
+
+  lastRebalanceSize = keys.size();
+  rebalances++;
+}
+
+size_t ShardedTree::shardSize(size_t shard) const {
+  return prefix[shard + 1] - prefix[shard];
+}
+
+size_t ShardedTree::getSize() {
+  flush();
+  return prefix.back();
+}
+
+bool ShardedTree::contains(int key) {
+  flush();
+  return shards[shardFor(key)]->tree.contains(key);
+}
+
+size_t ShardedTree::rankOf(int key) {
+  flush();
+  size_t shard = shardFor(key);
+  return prefix[shard] + shards[shard]->tree.rankOf(key);
+}
+
+/* The shard holding the given rank is the last one whose prefix count is at
+ * most the rank.
+ */
+int ShardedTree::select(size_t rank) {
+  flush();
+  if (rank >= prefix.back()) {
+    throw runtime_error("ShardedTree::select(): rank out of range.");
+  }
+
+  size_t shard = upper_bound(prefix.begin(), prefix.end(), rank) - prefix.begin() - 1;
+  return shards[shard]->tree.select(rank - prefix[shard]);
+}
@@ -0,0 +1,141 @@
+/******************************************************************************
+ * File: ShardedTree.h
+ *
+ * An order statistics structure split across several red/black trees, each
+ * owned by its own worker thread, so that inserts can be applied on several
+ * cores at once.
+ *
+ * The keys are range-partitioned: shard i holds the keys between boundary
+ * i - 1 (inclusive) and boundary i (exclusive). Inserted keys are routed to
+ * the right shard and collected into batches, which are handed off to the
+ * shard's worker once they fill up. Queries first wait for every outstanding
+ * batch to be applied, then combine a per-shard query with a directory of
+ * prefix counts (how many keys live in all earlier shards), so a global rank
+ * or select costs one binary search plus one tree query.
+ *
+ * If the keys aren't spread evenly, some shards end up much bigger than others
+ * and stop sharing the work. When that happens, the boundaries are moved so
+ * that every shard holds about the same number of keys, and each shard is
+ * rebuilt from its new range of keys.
+ *
+ * A ShardedTree should only be used from one thread at a time; the
+ * parallelism is internal.
+ */
+#pragma once
+
+#include "RedBlackTree.h"
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ShardedTree {
+public:
+  /**
+   * Creates an empty index split into the given number of shards, each of
+   * which handles duplicates as specified. The initial boundaries divide the
+   * range of ints evenly. If numShards is zero, this throws a
+   * std::runtime_error.
+   */
+  explicit ShardedTree(std::size_t numShards,
+                       RedBlackTree::Duplicates duplicates = RedBlackTree::Duplicates::REJECT);
+
+  /**
+   * Applies any outstanding inserts, then stops the worker threads.
+   */
+  ~ShardedTree();
+
+  /**
+   * Queues up the given key to be inserted. This returns right away; the key
+   * is guaranteed to be in the index by the time any query or flush() returns.
+   */
+  void insert(int key);
+
+  /**
+   * Waits until every queued insert has been applied, and rebalances the
+   * shards if they've become skewed.
+   */
+  void flush();
+
+  /**
+   * Queries over the whole index. These behave exactly like their
+   * RedBlackTree counterparts, and each starts with a flush().
+   */
+  std::size_t getSize();
+  bool        contains(int key);
+  std::size_t rankOf(int key);
+  int         select(std::size_t rank);
+
+  /**
+   * Information about how the keys are spread across shards, for tests and
+   * benchmarks. Shard sizes are as of the last flush.
+   */
+  std::size_t numShards() const {
+    return shards.size();
+  }
+  std::size_t shardSize(std::size_t shard) const;
+  std::size_t numRebalances() const {
+    return rebalances;
+  }
+
+private:
+  /* One shard: a tree and the worker thread that inserts into it. Batches
+   * arrive in the inbox, which is guarded by lock, and the worker signals done
+   * once it has nothing left to apply.
+   */
+  struct Shard {
+    RedBlackTree tree;
+    std::vector<int> staged;     // Keys routed here but not yet handed off;
+                                 // only touched by the owning ShardedTree
+
+    std::mutex lock;
+    std::condition_variable wakeup;
+    std::condition_variable done;
+    std::vector<int> inbox;      // Keys handed off to the worker
+    bool busy     = false;       // Whether the worker is applying a batch
+    bool stopping = false;
+
+    std::thread worker;
+
+    explicit Shard(RedBlackTree::Duplicates duplicates) : tree(duplicates) {}
+    void run();
+  };
+
+  RedBlackTree::Duplicates duplicates;
+  std::vector<std::unique_ptr<Shard>> shards;
+
+  /* boundaries[i] is the smallest key that belongs in shard i + 1, so there's
+   * one fewer boundary than there are shards.
+   */
+  std::vector<int> boundaries;
+
+  /* prefix[i] is the number of keys in shards 0 through i - 1, so it has one
+   * more entry than there are shards. It's rebuilt by flush().
+   */
+  std::vector<std::size_t> prefix;
+
+  std::size_t rebalances        = 0;
+  std::size_t lastRebalanceSize = 0;  // Number of keys at the last rebalance
+
+  /* Which shard the given key belongs in. */
+  std::size_t shardFor(int key) const;
+
+  /* Hands the given shard's staged keys to its worker. */
+  void handOff(Shard& shard);
+
+  /* Waits for the given shard's worker to apply everything handed to it. */
+  static void waitIdle(Shard& shard);
+
+  /* Whether the shards are far enough out of balance to be worth fixing. */
+  bool isSkewed() const;
+
+  /* Moves the boundaries to even out the shards and rebuilds every shard.
+   * Only call this when the workers are idle.
+   */
+  void rebalance();
+
+  ShardedTree(const ShardedTree &) = delete;
+  void operator= (ShardedTree) = delete;
+};
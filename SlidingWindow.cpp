@@ -0,0 +1,63 @@
+#include "SlidingWindow.h"
+#include <stdexcept>
+using namespace std;
+
+/* The ring buffer is sized once up front, and the tree is given enough spare
+ * nodes to hold a window full of distinct samples. After this, nothing in the
+ * window ever allocates.
+ */
+SlidingWindow::SlidingWindow(size_t capacity, uint64_t maxAge)
+  : tree(RedBlackTree::Duplicates::COUNT), samples(capacity), maxAge(maxAge) {
+  if (capacity == 0) {
+    throw runtime_error("SlidingWindow(): capacity must be positive.");
+  }
+  tree.reserve(capacity);
+}
+
+void SlidingWindow::add(int value, uint64_t timestamp) {
+  advanceTo(timestamp);
+  if (count == samples.size()) evictOldest();
+  
+  samples[(oldest + count) % samples.size()] = { value, timestamp };
+  count++;
+  tree.insert(value);
+}
+
+size_t SlidingWindow::advanceTo(uint64_t now) {
+  if (now < latest) {
+    throw runtime_error("SlidingWindow::advanceTo(): time went backwards.");
+  }
+  latest = now;
+  if (maxAge == 0) return 0;
+  
+  /* Samples are stored oldest-first, so the ones that have aged out are a
+   * prefix of the ring.
+   */
+  size_t expired = 0;
+  while (expired != count && now - samples[(oldest + expired) % samples.size()].timestamp >= maxAge) {
+    expired++;
+  }
+  
+  /* If most of the window is going, it's cheaper to start the tree over and
+   * insert the survivors than to erase every expired sample, each with its
+   * own descent and fixup. Clearing is O(1) and the tree recycles its nodes,
+   * so this doesn't allocate either.
+   */
+  if (2 * expired < count) {
+    for (size_t i = 0; i < expired; i++) evictOldest();
+  } else {
+    oldest = (oldest + expired) % samples.size();
+    count -= expired;
+    tree.clear();
+    for (size_t i = 0; i < count; i++) {
+      tree.insert(samples[(oldest + i) % samples.size()].value);
+    }
+  }
+  return expired;
+}
+
+void SlidingWindow::evictOldest() {
+  tree.erase(samples[oldest].value);
+  oldest = (oldest + 1) % samples.size();
+  count--;
+}
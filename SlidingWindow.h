@@ -0,0 +1,102 @@
+/******************************************************************************
+ * File: SlidingWindow.h
+ *
+ * An order statistics structure over the most recent samples of a stream, for
+ * things like "the 99th percentile latency over the last 10,000 requests" or
+ * "the median over the last five seconds."
+ *
+ * The window keeps every sample, duplicates included (it's backed by a
+ * multiset RedBlackTree), so ranks and quantiles are computed over the full
+ * multiset of samples in the window. Samples leave the window either when
+ * it's full (the oldest sample is evicted to make room) or when they've aged
+ * out.
+ *
+ * All storage is set up in the constructor: samples live in a fixed-size ring
+ * buffer and the tree recycles its nodes, so adding and evicting samples never
+ * allocates memory.
+ */
+#pragma once
+
+#include "RedBlackTree.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class SlidingWindow {
+public:
+  /**
+   * Creates a window that holds at most the given number of samples. If maxAge
+   * is nonzero, samples whose timestamps are maxAge or more before the newest
+   * timestamp seen are evicted as well. Timestamps can be in whatever units
+   * are convenient (nanoseconds, ticks, etc.).
+   */
+  explicit SlidingWindow(std::size_t capacity, std::uint64_t maxAge = 0);
+  
+  /**
+   * Adds a sample to the window, first evicting anything that has aged out as
+   * of its timestamp and then, if the window is full, the oldest sample.
+   * Timestamps must never decrease; if they do, this function throws a
+   * std::runtime_error.
+   */
+  void add(int value, std::uint64_t timestamp = 0);
+  
+  /**
+   * Evicts every sample that has aged out as of the given time, returning how
+   * many there were. Samples are stored oldest-first, so the expired ones are
+   * counted up front and evicted as a batch: one erase apiece if only a few
+   * are going, or, if at least half the window is, by clearing the tree and
+   * reinserting the samples that are left.
+   */
+  std::size_t advanceTo(std::uint64_t now);
+  
+  /**
+   * Returns the number of samples in the window.
+   */
+  std::size_t size() const {
+    return count;
+  }
+  
+  /**
+   * Order statistics over the samples in the window. These behave exactly as
+   * their RedBlackTree counterparts, except that repeated samples are each
+   * counted. In particular, rankOf returns the number of samples less than
+   * the given value, and select throws a std::runtime_error if the rank is
+   * out of range.
+   */
+  std::size_t rankOf(int value) const {
+    return tree.rankOf(value);
+  }
+  
+  int select(std::size_t rank) const {
+    return tree.select(rank);
+  }
+  
+  double quantile(double q, RedBlackTree::Interpolation policy = RedBlackTree::Interpolation::LINEAR) const {
+    return tree.quantile(q, policy);
+  }
+  
+  void quantiles(const double* qs, std::size_t numQs, double* out,
+                 RedBlackTree::Interpolation policy = RedBlackTree::Interpolation::LINEAR) const {
+    tree.quantiles(qs, numQs, out, policy);
+  }
+
+private:
+  /* A sample, along with when it arrived. */
+  struct Sample {
+    int           value;
+    std::uint64_t timestamp;
+  };
+  
+  RedBlackTree tree;           // All samples in the window, duplicates included
+  std::vector<Sample> samples; // Ring buffer of samples, oldest first
+  std::size_t oldest = 0;      // Index of the oldest sample in the ring
+  std::size_t count  = 0;      // Number of samples in the window
+  std::uint64_t maxAge;        // Maximum age of a sample, or 0 for no limit
+  std::uint64_t latest = 0;    // Newest timestamp seen
+  
+  /* Removes the oldest sample from the window. */
+  void evictOldest();
+  
+  SlidingWindow(const SlidingWindow &) = delete;
+  void operator= (SlidingWindow) = delete;
+};
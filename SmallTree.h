@@ -0,0 +1,172 @@
+/******************************************************************************
+ * File: SmallTree.h
+ *
+ * An order statistics set (or multiset) of ints for the common case where
+ * there are only a handful of keys. Up to N keys are kept in a sorted array
+ * stored right inside the object, with no heap allocation at all. Inserting
+ * one key more than that builds a RedBlackTree from the array with
+ * fromSorted, and from then on every operation goes to the tree. If erasing
+ * brings the tree back down to N / 2 keys, they move back into the array.
+ *
+ * This matters when there are lots of little trees. A RedBlackTree holding a
+ * single key has already allocated its first chunk of 64 nodes, while a
+ * SmallTree<32> is about 150 bytes in all.
+ *
+ * The unused slots of the array always hold INT_MAX. That way, the rank of a
+ * key is the number of slots holding something smaller, and counting over
+ * all N slots, rather than a binary search that stops early, is a fixed-length
+ * loop with no branches that the compiler turns into SIMD compares.
+ */
+#pragma once
+
+#include "RedBlackTree.h"
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+template <std::size_t N = 32> class SmallTree {
+public:
+  static_assert(N >= 2, "SmallTree needs room for at least two inline keys.");
+
+  /**
+   * Creates an empty tree that handles duplicate keys as specified.
+   */
+  explicit SmallTree(RedBlackTree::Duplicates duplicates = RedBlackTree::Duplicates::REJECT);
+
+  /**
+   * These behave exactly like their RedBlackTree counterparts.
+   */
+  bool        insert(int key);
+  bool        erase(int key);
+  bool        contains(int key) const;
+  std::size_t getSize() const {
+    return tree? tree->getSize() : numInline;
+  }
+  std::size_t rankOf(int key) const;
+  int         select(std::size_t rank) const;
+
+  /**
+   * Returns whether the keys are in the inline array rather than a tree.
+   */
+  bool isInline() const {
+    return tree == nullptr;
+  }
+
+private:
+  RedBlackTree::Duplicates duplicates;
+  std::uint32_t numInline = 0;
+  int keys[N];
+
+  /* Non-null exactly when there are too many keys for the array. */
+  std::unique_ptr<RedBlackTree> tree;
+
+  /* Returns how many inline keys are smaller than the key. */
+  std::size_t inlineRankOf(int key) const;
+
+  /* Moves the inline keys, plus one more, into a new tree. */
+  void promote(int key);
+
+  /* Moves the tree's keys back into the array. */
+  void demote();
+};
+
+/* * * * * Implementation Below This Point * * * * */
+
+template <std::size_t N>
+SmallTree<N>::SmallTree(RedBlackTree::Duplicates duplicates) : duplicates(duplicates) {
+  std::fill(keys, keys + N, INT_MAX);
+}
+
+/* Every slot is compared, so the loop has a fixed trip count and no exits. */
+template <std::size_t N>
+std::size_t SmallTree<N>::inlineRankOf(int key) const {
+  std::uint32_t result = 0;
+  for (std::size_t i = 0; i < N; i++) {
+    result += keys[i] < key;
+  }
+  return result;
+}
+
+template <std::size_t N>
+std::size_t SmallTree<N>::rankOf(int key) const {
+  return tree? tree->rankOf(key) : inlineRankOf(key);
+}
+
+template <std::size_t N>
+bool SmallTree<N>::contains(int key) const {
+  if (tree) return tree->contains(key);
+
+  std::size_t rank = inlineRankOf(key);
+  return rank < numInline && keys[rank] == key;
+}
+
+template <std::size_t N>
+int SmallTree<N>::select(std::size_t rank) const {
+  if (tree) return tree->select(rank);
+
+  if (rank >= numInline) {
+    throw std::runtime_error("SmallTree::select(): rank out of range.");
+  }
+  return keys[rank];
+}
+
+template <std::size_t N>
+bool SmallTree<N>::insert(int key) {
+  if (tree) return tree->insert(key);
+
+  std::size_t rank = inlineRankOf(key);
+  if (duplicates == RedBlackTree::Duplicates::REJECT && rank < numInline && keys[rank] == key) {
+    return false;
+  }
+
+  if (numInline == N) {
+    promote(key);
+    return true;
+  }
+
+  /* Keys equal to this one go before it, so the copy lands after them. */
+  while (rank < numInline && keys[rank] == key) rank++;
+  std::copy_backward(keys + rank, keys + numInline, keys + numInline + 1);
+  keys[rank] = key;
+  numInline++;
+  return true;
+}
+
+template <std::size_t N>
+bool SmallTree<N>::erase(int key) {
+  if (tree) {
+    if (!tree->erase(key)) return false;
+    if (tree->getSize() <= N / 2) demote();
+    return true;
+  }
+
+  std::size_t rank = inlineRankOf(key);
+  if (rank >= numInline || keys[rank] != key) return false;
+
+  std::copy(keys + rank + 1, keys + numInline, keys + rank);
+  keys[--numInline] = INT_MAX;
+  return true;
+}
+
+template <std::size_t N>
+void SmallTree<N>::promote(int key) {
+  std::vector<int> all(keys, keys + numInline);
+  all.insert(std::upper_bound(all.begin(), all.end(), key), key);
+  tree.reset(new RedBlackTree(RedBlackTree::fromSorted(all, duplicates)));
+
+  std::fill(keys, keys + N, INT_MAX);
+  numInline = 0;
+}
+
+template <std::size_t N>
+void SmallTree<N>::demote() {
+  numInline = 0;
+  tree->forEach([&](int key, std::size_t count) {
+    for (std::size_t i = 0; i < count; i++) keys[numInline++] = key;
+  });
+  tree.reset();
+}
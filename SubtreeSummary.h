@@ -0,0 +1,70 @@
+/******************************************************************************
+ * File: SubtreeSummary.h
+ *
+ * Summaries that a tree built on a TreeCore can keep at each node, each one
+ * describing all of the keys in that node's subtree. The tree always tracks
+ * subtree sizes (these drive rankOf and select); a summary rides along on top
+ * of that and is kept up to date through insertions and rotations in the same
+ * way. Which summary a tree keeps is a template parameter, so trees that
+ * never ask for one don't pay for it:
+ *
+ *   SizeOnly        the default, which keeps nothing beyond the sizes and
+ *                   takes up no space in the node, and
+ *   SubtreeSummary  the sum, minimum, and maximum of the keys, which power
+ *                   WeightedRedBlackTree's weighted rank queries.
+ *
+ * Each summary is a commutative monoid over the keys, providing
+ *
+ *   identity()      the summary of an empty subtree,
+ *   ofKey(key, n)   the summary of n copies of a single key,
+ *   combine(a, b)   the summary of the union of two disjoint sets of keys, and
+ *   a == b          whether two summaries agree, for consistency checks,
+ *
+ * where combine is associative and commutative and identity() is its identity.
+ * Commutativity lets the tree fold a new key into every summary on the path
+ * down to its insertion point as it descends.
+ */
+#pragma once
+
+#include <climits>
+#include <cstddef>
+
+struct SizeOnly {
+  static SizeOnly identity() {
+    return {};
+  }
+
+  static SizeOnly ofKey(int, std::size_t = 1) {
+    return {};
+  }
+
+  static SizeOnly combine(const SizeOnly&, const SizeOnly&) {
+    return {};
+  }
+
+  friend bool operator== (const SizeOnly&, const SizeOnly&) {
+    return true;
+  }
+};
+
+struct SubtreeSummary {
+  long long sum;  // Sum of all keys in the subtree
+  int       min;  // Smallest key in the subtree
+  int       max;  // Largest key in the subtree
+
+  static SubtreeSummary identity() {
+    return { 0, INT_MAX, INT_MIN };
+  }
+
+  static SubtreeSummary ofKey(int key, std::size_t count = 1) {
+    return { (long long)key * (long long)count, key, key };
+  }
+
+  static SubtreeSummary combine(const SubtreeSummary& a, const SubtreeSummary& b) {
+    return { a.sum + b.sum, a.min < b.min? a.min : b.min, a.max > b.max? a.max : b.max };
+  }
+
+  friend bool operator== (const SubtreeSummary& a, const SubtreeSummary& b) {
+    return a.sum == b.sum && a.min == b.min && a.max == b.max;
+  }
+};
@@ -0,0 +1,224 @@
+#include "Trace.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iterator>
+#include <stdexcept>
+using namespace std;
+
+namespace {
+  /* Magic number at the start of every trace file, followed by a version. */
+  const char          kMagic[8] = { 'R', 'B', 'T', 'T', 'R', 'A', 'C', 'E' };
+  const unsigned char kVersion  = 1;
+  
+  /* Flush the write buffer once it gets this big. */
+  const size_t kFlushThreshold = 1 << 16;
+  
+  void putVarint(vector<unsigned char>& out, uint64_t value) {
+    while (value >= 0x80) {
+      out.push_back((unsigned char)(value | 0x80));
+      value >>= 7;
+    }
+    out.push_back((unsigned char)value);
+  }
+  
+  uint64_t getVarint(const vector<unsigned char>& in, size_t& pos) {
+    uint64_t result = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+      if (pos == in.size()) throw runtime_error("Truncated trace file.");
+      unsigned char byte = in[pos++];
+      result |= uint64_t(byte & 0x7F) << shift;
+      if ((byte & 0x80) == 0) return result;
+    }
+    throw runtime_error("Malformed varint in trace file.");
+  }
+  
+  /* Zigzag encoding maps small negative numbers to small unsigned numbers so
+   * that they stay short as varints.
+   */
+  uint64_t zigzag(int64_t value) {
+    return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+  }
+  
+  int64_t unzigzag(uint64_t value) {
+    return int64_t(value >> 1) ^ -int64_t(value & 1);
+  }
+  
+  uint64_t nanosecondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+  }
+}
+
+const char* traceOpName(TraceOp op) {
+  switch (op) {
+    case TraceOp::INSERT:   return "insert";
+    case TraceOp::CONTAINS: return "contains";
+    case TraceOp::RANK_OF:  return "rankOf";
+    case TraceOp::SELECT:   return "select";
+  }
+  return "(?)";
+}
+
+TraceWriter::TraceWriter(const string& filename)
+  : filename(filename), out(filename, ios::binary | ios::trunc) {
+  if (!out) {
+    throw runtime_error("Cannot open file \"" + filename + "\" for writing.");
+  }
+  out.write(kMagic, sizeof(kMagic));
+  out.put(char(kVersion));
+  buffer.reserve(kFlushThreshold + 32);
+}
+
+/* Throwing out of a destructor would end the program, so a failure here goes
+ * unreported; see the comment in Trace.h.
+ */
+TraceWriter::~TraceWriter() {
+  try {
+    flush();
+  } catch (const runtime_error &) {
+    /* Nothing more we can do. */
+  }
+}
+
+void TraceWriter::append(const TraceEvent& event) {
+  buffer.push_back((unsigned char)event.op);
+  putVarint(buffer, zigzag(event.argument));
+  putVarint(buffer, event.nanoseconds);
+  count++;
+  
+  if (buffer.size() >= kFlushThreshold) flush();
+}
+
+void TraceWriter::flush() {
+  out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+  out.flush();
+  buffer.clear();
+  
+  /* The stream stays failed once anything goes wrong, including writing the
+   * header, so this catches every earlier failure too.
+   */
+  if (!out) {
+    throw runtime_error("Cannot write to trace file \"" + filename + "\".");
+  }
+}
+
+vector<TraceEvent> readTrace(const string& filename) {
+  ifstream in(filename, ios::binary);
+  if (!in) {
+    throw runtime_error("Cannot open file \"" + filename + "\" for reading.");
+  }
+  vector<unsigned char> data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+  
+  if (data.size() < sizeof(kMagic) + 1 || !equal(kMagic, kMagic + sizeof(kMagic), data.begin())) {
+    throw runtime_error("\"" + filename + "\" is not a trace file.");
+  }
+  if (data[sizeof(kMagic)] != kVersion) {
+    throw runtime_error("\"" + filename + "\" has an unsupported trace version.");
+  }
+  
+  vector<TraceEvent> result;
+  for (size_t pos = sizeof(kMagic) + 1; pos < data.size(); ) {
+    unsigned char op = data[pos++];
+    if (op >= kNumTraceOps) throw runtime_error("Unknown operation in trace file.");
+    
+    TraceEvent event;
+    event.op          = TraceOp(op);
+    event.argument    = unzigzag(getVarint(data, pos));
+    event.nanoseconds = getVarint(data, pos);
+    result.push_back(event);
+  }
+  return result;
+}
+
+/* Each traced operation times the underlying call and then logs it. Calls that
+ * throw are logged as well, since they're part of the workload too.
+ */
+bool TracedRedBlackTree::contains(int key) const {
+  if (writer == nullptr) return tree.contains(key);
+  
+  auto start = chrono::steady_clock::now();
+  bool result = tree.contains(key);
+  writer->append({ TraceOp::CONTAINS, key, nanosecondsSince(start) });
+  return result;
+}
+
+bool TracedRedBlackTree::insert(int key) {
+  if (writer == nullptr) return tree.insert(key);
+  
+  auto start = chrono::steady_clock::now();
+  bool result = tree.insert(key);
+  writer->append({ TraceOp::INSERT, key, nanosecondsSince(start) });
+  return result;
+}
+
+size_t TracedRedBlackTree::rankOf(int key) const {
+  if (writer == nullptr) return tree.rankOf(key);
+  
+  auto start = chrono::steady_clock::now();
+  size_t result = tree.rankOf(key);
+  writer->append({ TraceOp::RANK_OF, key, nanosecondsSince(start) });
+  return result;
+}
+
+int TracedRedBlackTree::select(size_t rank) const {
+  if (writer == nullptr) return tree.select(rank);
+  
+  auto start = chrono::steady_clock::now();
+  try {
+    int result = tree.select(rank);
+    writer->append({ TraceOp::SELECT, int64_t(rank), nanosecondsSince(start) });
+    return result;
+  } catch (...) {
+    writer->append({ TraceOp::SELECT, int64_t(rank), nanosecondsSince(start) });
+    throw;
+  }
+}
+
+/* Samples below 8ns get a bucket apiece. Beyond that, a sample with highest set
+ * bit e lands in one of eight buckets for [2^e, 2^(e+1)), chosen by the three
+ * bits just below the highest one.
+ */
+size_t LatencyHistogram::bucketFor(uint64_t nanoseconds) {
+  if (nanoseconds < kSubBuckets) return size_t(nanoseconds);
+  
+  unsigned exponent = 63 - __builtin_clzll(nanoseconds);
+  size_t   sub      = (nanoseconds >> (exponent - 3)) & (kSubBuckets - 1);
+  return (exponent - 2) * kSubBuckets + sub;
+}
+
+uint64_t LatencyHistogram::upperBoundOf(size_t bucket) {
+  if (bucket < kSubBuckets) return bucket;
+  
+  unsigned exponent = unsigned(bucket / kSubBuckets) + 2;
+  uint64_t sub      = bucket % kSubBuckets;
+  uint64_t lower    = (kSubBuckets + sub) << (exponent - 3);
+  return lower + (uint64_t(1) << (exponent - 3)) - 1;
+}
+
+void LatencyHistogram::record(uint64_t nanoseconds) {
+  buckets[bucketFor(nanoseconds)]++;
+  count++;
+  total += nanoseconds;
+  if (nanoseconds > largest) largest = nanoseconds;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+  for (size_t i = 0; i < kNumBuckets; i++) buckets[i] += other.buckets[i];
+  count += other.count;
+  total += other.total;
+  if (other.largest > largest) largest = other.largest;
+}
+
+uint64_t LatencyHistogram::percentile(double p) const {
+  if (count == 0) return 0;
+  
+  size_t target = size_t(ceil(p / 100.0 * count));
+  if (target == 0) target = 1;
+  
+  size_t seen = 0;
+  for (size_t i = 0; i < kNumBuckets; i++) {
+    seen += buckets[i];
+    if (seen >= target) return min(upperBoundOf(i), largest);
+  }
+  return largest;
+}
@@ -0,0 +1,153 @@
+/******************************************************************************
+ * File: Trace.h
+ *
+ * Tools for capturing the operations performed on a RedBlackTree into a
+ * compact binary trace file and replaying them later. The idea is to record
+ * a real workload once, then replay it against different builds of the tree
+ * to see how their performance compares.
+ *
+ * A trace file starts with an eight-byte magic number and a version byte.
+ * Each recorded call follows as an opcode byte, the call's argument as a
+ * zigzag-encoded varint, and the call's latency in nanoseconds as a varint.
+ * Most records end up being three to five bytes long.
+ */
+#pragma once
+
+#include "RedBlackTree.h"
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/* The operations that can appear in a trace. */
+enum class TraceOp : std::uint8_t {
+  INSERT, CONTAINS, RANK_OF, SELECT
+};
+
+/* Number of distinct TraceOps, handy for sizing tables indexed by op. */
+const std::size_t kNumTraceOps = 4;
+
+/* Returns a human-readable name for an operation. */
+const char* traceOpName(TraceOp op);
+
+/* A single recorded call. */
+struct TraceEvent {
+  TraceOp       op;
+  std::int64_t  argument;     // Key for insert/contains/rankOf, rank for select
+  std::uint64_t nanoseconds;  // How long the call took when it was recorded
+};
+
+/* Appends events to a trace file. Events are buffered in memory and written in
+ * large chunks; the buffer is flushed when the writer is destroyed. A write
+ * that fails, say because the disk is full, makes flush (and so append) throw
+ * a std::runtime_error. The destructor can't report errors, so anyone who
+ * needs to know that the whole trace made it out should call flush first.
+ */
+class TraceWriter {
+public:
+  /* Creates the trace file, throwing a std::runtime_error on failure. */
+  explicit TraceWriter(const std::string& filename);
+  
+  /* Flushes any buffered events, ignoring any error. */
+  ~TraceWriter();
+  
+  /* Records an event. */
+  void append(const TraceEvent& event);
+  
+  /* Writes all buffered events out to the file, throwing a std::runtime_error
+   * if they couldn't all be written.
+   */
+  void flush();
+  
+  /* Number of events recorded so far. */
+  std::size_t numEvents() const {
+    return count;
+  }
+
+private:
+  std::string   filename;
+  std::ofstream out;
+  std::vector<unsigned char> buffer;
+  std::size_t count = 0;
+  
+  TraceWriter(const TraceWriter &) = delete;
+  void operator= (TraceWriter) = delete;
+};
+
+/* Reads back every event in a trace file, throwing a std::runtime_error if the
+ * file can't be read or isn't a valid trace.
+ */
+std::vector<TraceEvent> readTrace(const std::string& filename);
+
+/* A thin wrapper around a RedBlackTree that forwards each call to the tree and,
+ * if given a writer, records the call and its latency. Without a writer it
+ * simply forwards, so it can be left in place when tracing is turned off.
+ */
+class TracedRedBlackTree {
+public:
+  TracedRedBlackTree(RedBlackTree& tree, TraceWriter* writer = nullptr)
+    : tree(tree), writer(writer) {}
+  
+  bool contains(int key) const;
+  bool insert(int key);
+  std::size_t rankOf(int key) const;
+  int select(std::size_t rank) const;
+  
+  std::size_t getSize() const {
+    return tree.getSize();
+  }
+  
+  void printDebugInfo() const {
+    tree.printDebugInfo();
+  }
+
+private:
+  RedBlackTree& tree;
+  TraceWriter*  writer;
+};
+
+/* Histogram of latencies with logarithmically-spaced buckets. Each power of two
+ * is split into eight linear sub-buckets, so reported percentiles are accurate
+ * to within about 12.5%.
+ */
+class LatencyHistogram {
+public:
+  /* Records one sample. */
+  void record(std::uint64_t nanoseconds);
+  
+  /* Adds in every sample recorded by another histogram. */
+  void merge(const LatencyHistogram& other);
+  
+  /* Number of samples recorded. */
+  std::size_t numSamples() const {
+    return count;
+  }
+  
+  /* Returns an upper bound on the latency of the given percentile (between 0
+   * and 100) of the samples, or 0 if there are no samples.
+   */
+  std::uint64_t percentile(double p) const;
+  
+  /* Largest sample seen. */
+  std::uint64_t max() const {
+    return largest;
+  }
+  
+  /* Mean of all samples. */
+  double mean() const {
+    return count == 0? 0.0 : double(total) / count;
+  }
+
+private:
+  static const std::size_t kSubBuckets = 8;
+  static const std::size_t kNumBuckets = 64 * kSubBuckets;
+  
+  std::size_t   buckets[kNumBuckets] = {};
+  std::size_t   count   = 0;
+  std::uint64_t total   = 0;
+  std::uint64_t largest = 0;
+  
+  static std::size_t bucketFor(std::uint64_t nanoseconds);
+  static std::uint64_t upperBoundOf(std::size_t bucket);
+};
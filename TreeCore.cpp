@@ -0,0 +1,54 @@
+#include "TreeCore.h"
+#include <cstdlib>
+#include <new>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+using namespace std;
+
+namespace {
+  const size_t kHugePageSize = size_t(1) << 21;
+}
+
+/* Chunks on huge pages come from mmap (explicit huge pages) or from
+ * aligned_alloc (transparent huge pages) rather than the heap, and have to be
+ * returned the same way.
+ */
+NodeChunk allocateNodeChunk(size_t bytes, NodeMemory memory) {
+#ifdef __linux__
+  if (memory == NodeMemory::HUGE_PAGES) {
+    bytes = (bytes + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+
+    void* pages = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (pages != MAP_FAILED) {
+      return { pages, bytes, NodeChunk::Source::HUGETLB };
+    }
+
+    pages = aligned_alloc(kHugePageSize, bytes);
+    if (pages == nullptr) throw bad_alloc();
+    madvise(pages, bytes, MADV_HUGEPAGE);
+    return { pages, bytes, NodeChunk::Source::ALIGNED };
+  }
+#else
+  (void) memory;
+#endif
+
+  return { ::operator new(bytes), bytes, NodeChunk::Source::HEAP };
+}
+
+void freeNodeChunk(const NodeChunk& chunk) {
+  switch (chunk.source) {
+    case NodeChunk::Source::HEAP:
+      ::operator delete(chunk.memory);
+      break;
+#ifdef __linux__
+    case NodeChunk::Source::HUGETLB:
+      munmap(chunk.memory, chunk.bytes);
+      break;
+#endif
+    default:
+      free(chunk.memory);
+      break;
+  }
+}
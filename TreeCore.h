@@ -0,0 +1,643 @@
+/******************************************************************************
+ * File: TreeCore.h
+ *
+ * The parts of an order statistics tree that don't depend on how the tree is
+ * kept balanced: the node layout, the subtree sizes and summaries stored at
+ * each node, rotations, searching by key and by rank, plain BST insertion and
+ * removal, and the chunked storage that nodes are carved out of.
+ *
+ * The summary is a template parameter, one of those in SubtreeSummary.h. It
+ * defaults to SizeOnly, which takes up no room in the node, so only a tree
+ * that asks for a summary has nodes big enough to hold one.
+ *
+ * RedBlackTree and BalancedTree are both built on a TreeCore. All that differs
+ * between them is the balancing rule run after each insertion or removal (see
+ * Balancing.h). A rule keeps whatever it needs, a color or a rank, in each
+ * node's balance field, and reshapes the tree only through rotations, which
+ * keep the sizes and summaries up to date.
+ *
+ * The rotation primitives at the bottom of this file work on any node type
+ * with left and right pointers and an updateAugmentation overload, which is
+ * how IndexedSequence shares them.
+ */
+#pragma once
+
+/* Whether nodes store a pointer to their parent. None of the tree algorithms
+ * need parent pointers (they track the path from the root instead), so they
+ * can be compiled out to make every node smaller by building with
+ * -DRBT_PARENT_POINTERS=0. They're kept by default since they're handy when
+ * poking around the tree in a debugger.
+ */
+#ifndef RBT_PARENT_POINTERS
+#define RBT_PARENT_POINTERS 1
+#endif
+
+#include "SubtreeSummary.h"
+#include <cstddef>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+/**
+ * Where node storage comes from. HUGE_PAGES backs nodes with 2MB pages, which
+ * cuts down on TLB misses when the tree is much bigger than the TLB's reach.
+ * It uses explicitly reserved huge pages if the system has any free, then
+ * falls back to transparent huge pages, and on systems with neither it
+ * behaves like DEFAULT. Since every chunk of nodes is rounded up to a whole
+ * huge page, this only makes sense for large trees.
+ */
+enum class NodeMemory {
+  DEFAULT, HUGE_PAGES
+};
+
+/* Upper bound on the height of any balanced tree that fits in memory. A
+ * red/black or WAVL tree with n nodes has height at most 2 lg (n + 1), an
+ * AVL tree less than that, and n is certainly less than 2^64.
+ */
+const std::size_t kMaxTreeHeight = 2 * 64;
+
+template <typename Balance, typename Summary = SizeOnly> struct TreeNode {
+  int         key;      // The key itself
+  Balance     balance;  // The balancing rule's bookkeeping: a color or a rank
+  std::size_t count;    // How many copies of the key there are
+
+  TreeNode*   left;     // Left and right children
+  TreeNode*   right;
+
+#if RBT_PARENT_POINTERS
+  TreeNode*   parent;   // Parent pointer. This isn't strictly necessary, since
+                        // we track the path down from the root as we go.
+#endif
+
+  std::size_t numTotal; // The size of the subtree from this node (inclusive),
+                        // counting every copy of every key
+  std::size_t numLeft;  // The size of the left subtree
+  std::size_t numRight; // The size of the right subtree
+
+  [[no_unique_address]]
+  Summary     summary;  // Summary of all keys in this subtree (inclusive)
+
+  /* Recomputes the node's sizes and summary, assuming its children's are
+   * correct. With parent pointers, this also points the children back at the
+   * node, so that a rotation, which recomputes every node whose children it
+   * changed, leaves only the new top's parent to be set.
+   */
+  friend void updateAugmentation(TreeNode* node) {
+    auto summaryOf = [](const TreeNode* child) {
+      return child? child->summary : Summary::identity();
+    };
+    node->numLeft  = node->left  ? node->left->numTotal  : 0;
+    node->numRight = node->right ? node->right->numTotal : 0;
+    node->numTotal = node->numLeft + node->numRight + node->count;
+    node->summary  = Summary::combine(summaryOf(node->left),
+                                      Summary::combine(Summary::ofKey(node->key, node->count),
+                                                       summaryOf(node->right)));
+#if RBT_PARENT_POINTERS
+    if (node->left)  node->left->parent  = node;
+    if (node->right) node->right->parent = node;
+#endif
+  }
+};
+
+/* The ancestors of some node, ordered from the root downward. Since a tree's
+ * height is bounded, this fits in a fixed-size array on the stack.
+ */
+template <typename Node> struct TreePath {
+  Node*       nodes[kMaxTreeHeight];
+  std::size_t depth = 0;
+
+  void push(Node* node) {
+    nodes[depth++] = node;
+  }
+
+  /* Returns the ancestor the given number of levels up (1 for the parent, 2
+   * for the grandparent, etc.), or null if that's above the root.
+   */
+  Node* up(std::size_t levels) const {
+    return levels <= depth? nodes[depth - levels] : nullptr;
+  }
+};
+
+/* A block of memory that nodes are carved out of, and where it came from so
+ * that it can be given back the same way.
+ */
+struct NodeChunk {
+  enum class Source {
+    HEAP, HUGETLB, ALIGNED
+  };
+  void*       memory;
+  std::size_t bytes;
+  Source      source;
+};
+
+/* Gets at least the given number of bytes for nodes. A chunk on huge pages is
+ * rounded up to a whole number of huge pages, and bytes says how much that
+ * came to.
+ */
+NodeChunk allocateNodeChunk(std::size_t bytes, NodeMemory memory);
+void      freeNodeChunk(const NodeChunk& chunk);
+
+template <typename Balance, typename Summary = SizeOnly> class TreeCore {
+public:
+  using Node = TreeNode<Balance, Summary>;
+  using Path = TreePath<Node>;
+
+  TreeCore() = default;
+
+  /**
+   * Every node lives in some chunk and nodes don't own anything, so there's
+   * no need to visit them individually.
+   */
+  ~TreeCore();
+
+  /**
+   * Trades everything, nodes and storage alike, with another core.
+   */
+  void swap(TreeCore& rhs) noexcept;
+
+  Node*       root      = nullptr;
+  std::size_t rotations = 0;
+
+  /**
+   * Searches by key and rank. select expects a rank less than the size of
+   * the tree. findPath also records the ancestors of wherever the search
+   * stopped.
+   */
+  Node*       find(int key) const;
+  Node*       findPath(int key, Path& path) const;
+  std::size_t rankOf(int key) const;
+  int         select(std::size_t rank) const;
+  std::size_t height() const;
+
+  static Summary summaryOf(const Node* node) {
+    return node == nullptr? Summary::identity() : node->summary;
+  }
+
+  /**
+   * Inserts a key without any rebalancing. Returns the new leaf, whose
+   * balance is value-initialized, with its ancestors in the path, or null if
+   * the key was already present; then, if countDuplicates is set, its count
+   * has been bumped.
+   */
+  Node* insertKey(int key, bool countDuplicates, Path& path);
+
+  /**
+   * Unlinks a node holding one copy of its key without any rebalancing,
+   * given its ancestors in the path. A node with two children trades places
+   * with its successor, so the node returned, which has left the tree but
+   * not been released, may not be the one passed in. child is set to
+   * whatever took its place (possibly null) and the path to that spot's
+   * ancestors, all of whose sizes and summaries are already updated.
+   */
+  Node* removeNode(Node* node, Path& path, Node*& child);
+
+  /**
+   * Rotates a node up over its parent, given the grandparent (null if the
+   * parent is the root).
+   */
+  void rotateUp(Node* node, Node* parent, Node* grandparent);
+
+  /**
+   * Puts newChild where oldChild was under the given parent, or at the root
+   * if the parent is null. The old child can't be null unless the parent is,
+   * since otherwise there'd be no telling which side it was on.
+   */
+  void replaceChild(Node* parent, Node* oldChild, Node* newChild);
+
+  /**
+   * Recomputes the sizes and summary of every node on the path, starting
+   * from the bottom so that each node sees its children's updated values.
+   */
+  static void updateAlong(const Path& path);
+
+  /**
+   * For testing and debugging purposes, confirms that the keys are in order
+   * and that every node holds at least one copy of its key and has the right
+   * sizes, summary, and (with parent pointers) parent. Throws a
+   * std::runtime_error describing the first problem found.
+   */
+  void checkStructure() const {
+    checkSubtree(root, nullptr, nullptr, nullptr);
+  }
+
+  /**
+   * Node storage. Nodes are carved out of large chunks, each twice the size
+   * of the one before it (up to a cap), and nodes released back to the tree
+   * are kept around and handed out again, so a tree whose size stays roughly
+   * the same doesn't allocate. reserve sets aside room for the given number
+   * of nodes in all; forgetNodes starts carving from the first chunk again,
+   * as though every node had been released.
+   */
+  Node* allocateNode();
+  void  releaseNode(Node* node);
+  void  reserve(std::size_t numNodes);
+  void  forgetNodes();
+  void  setNodeMemory(NodeMemory memory) {
+    nodeMemory = memory;
+  }
+
+private:
+  /* Nodes that have been removed from the tree and are waiting to be reused,
+   * chained together through their left pointers.
+   */
+  Node* freeList = nullptr;
+
+  /* Chunks are used in order, so nodes are handed out from the chunk at
+   * index currChunk, between nextNode and chunkEnd. Any chunks after that one
+   * are empty, either from a reserve() or from a forgetNodes().
+   */
+  std::vector<NodeChunk> chunks;
+  std::size_t currChunk = 0;
+  Node* nextNode = nullptr;
+  Node* chunkEnd = nullptr;
+  std::size_t capacity = 0;     // Total number of nodes across all chunks
+
+  NodeMemory nodeMemory = NodeMemory::DEFAULT;
+
+  static constexpr std::size_t kMinChunkLength = 64;
+  static constexpr std::size_t kMaxChunkLength = std::size_t(1) << 16;
+
+  static Node* nodesIn(const NodeChunk& chunk) {
+    return static_cast<Node*>(chunk.memory);
+  }
+  static Node* endOf(const NodeChunk& chunk) {
+    return nodesIn(chunk) + chunk.bytes / sizeof(Node);
+  }
+
+  /* Checks the subtree at the given node, whose keys must all be strictly
+   * between low and high (either of which may be null, for no bound).
+   */
+  static void checkSubtree(const Node* node, const Node* parent, const int* low, const int* high);
+
+  /* Appends a chunk with room for at least the given number of nodes. If
+   * there's no chunk currently being carved up, the new one becomes that
+   * chunk.
+   */
+  void addChunk(std::size_t length);
+
+  TreeCore(const TreeCore &) = delete;
+  void operator= (TreeCore) = delete;
+};
+
+/* Rotations on any node type with left and right pointers and an
+ * updateAugmentation overload. Each rotates one child of the given node up
+ * into its place and returns that child, leaving it to the caller to link the
+ * child in wherever the node used to hang.
+ */
+template <typename Node> Node* rotateRight(Node* node) {
+  Node* child  = node->left;
+  node->left   = child->right;
+  child->right = node;
+
+  /* The old top is now below the child, so it has to be recomputed first. */
+  updateAugmentation(node);
+  updateAugmentation(child);
+  return child;
+}
+
+template <typename Node> Node* rotateLeft(Node* node) {
+  Node* child  = node->right;
+  node->right  = child->left;
+  child->left  = node;
+
+  updateAugmentation(node);
+  updateAugmentation(child);
+  return child;
+}
+
+/* * * * * Implementation Below This Point * * * * */
+
+template <typename Balance, typename Summary>
+TreeCore<Balance, Summary>::~TreeCore() {
+  for (const NodeChunk& chunk: chunks) {
+    freeNodeChunk(chunk);
+  }
+}
+
+template <typename Balance, typename Summary>
+void TreeCore<Balance, Summary>::swap(TreeCore& rhs) noexcept {
+  using std::swap;
+  swap(root,       rhs.root);
+  swap(rotations,  rhs.rotations);
+  swap(freeList,   rhs.freeList);
+  swap(chunks,     rhs.chunks);
+  swap(currChunk,  rhs.currChunk);
+  swap(nextNode,   rhs.nextNode);
+  swap(chunkEnd,   rhs.chunkEnd);
+  swap(capacity,   rhs.capacity);
+  swap(nodeMemory, rhs.nodeMemory);
+}
+
+/* Standard tree search. */
+template <typename Balance, typename Summary>
+typename TreeCore<Balance, Summary>::Node* TreeCore<Balance, Summary>::find(int key) const {
+  Node* curr = root;
+  while (curr != nullptr) {
+    if      (key == curr->key)   return curr;
+    else if (key <  curr->key)   curr = curr->left;
+    else /*  key >  curr->key */ curr = curr->right;
+  }
+  return nullptr;
+}
+
+template <typename Balance, typename Summary>
+typename TreeCore<Balance, Summary>::Node* TreeCore<Balance, Summary>::findPath(int key, Path& path) const {
+  Node* curr = root;
+  while (curr != nullptr && curr->key != key) {
+    path.push(curr);
+    curr = key < curr->key? curr->left : curr->right;
+  }
+  return curr;
+}
+
+/* Everything we skip over to the left, and every copy of each key we step
+ * past, comes before the key.
+ */
+template <typename Balance, typename Summary>
+std::size_t TreeCore<Balance, Summary>::rankOf(int key) const {
+  std::size_t result = 0;
+  Node* curr = root;
+  while (curr != nullptr) {
+    if (key < curr->key) {
+      curr = curr->left;
+    } else if (key > curr->key) {
+      result += curr->numLeft + curr->count;
+      curr = curr->right;
+    } else /* key == curr->key */ {
+      return result + curr->numLeft;
+    }
+  }
+  return result;
+}
+
+template <typename Balance, typename Summary>
+int TreeCore<Balance, Summary>::select(std::size_t rank) const {
+  Node* curr = root;
+  while (true) {
+    if (rank < curr->numLeft) {
+      curr = curr->left;
+    } else if (rank < curr->numLeft + curr->count) {
+      return curr->key;
+    } else {
+      rank -= curr->numLeft + curr->count;
+      curr = curr->right;
+    }
+  }
+}
+
+/* Walks the tree with an explicit stack. Every pending frame is the sibling of
+ * some node on the path to the current one, so the stack never holds more
+ * than the height of the tree.
+ */
+template <typename Balance, typename Summary>
+std::size_t TreeCore<Balance, Summary>::height() const {
+  if (root == nullptr) return 0;
+
+  struct Frame {
+    Node*       node;
+    std::size_t depth;
+  };
+  Frame stack[kMaxTreeHeight + 1];
+  std::size_t top = 0, result = 0;
+  stack[top++] = { root, 1 };
+  while (top > 0) {
+    Frame frame = stack[--top];
+    if (frame.depth > result) result = frame.depth;
+    if (frame.node->left)  stack[top++] = { frame.node->left,  frame.depth + 1 };
+    if (frame.node->right) stack[top++] = { frame.node->right, frame.depth + 1 };
+  }
+  return result;
+}
+
+/* We bump the sizes on the way down, so we need to know up front whether this
+ * insertion is going to add a node.
+ */
+template <typename Balance, typename Summary>
+typename TreeCore<Balance, Summary>::Node* TreeCore<Balance, Summary>::insertKey(int key, bool countDuplicates, Path& path) {
+  if (!countDuplicates && find(key) != nullptr) {
+    return nullptr;
+  }
+
+  /* Step one: Find the insertion point. */
+  Node* prev = nullptr;
+  Node* curr = root;
+
+  while (curr != nullptr) {
+    prev = curr;
+    path.push(curr);
+
+    if      (key == curr->key)   {                     // Already present
+      curr->count++;
+      curr->numTotal++;
+      curr->summary = Summary::combine(curr->summary, Summary::ofKey(key));
+      return nullptr;
+    }
+    else if (key <  curr->key)   {
+      curr = curr->left;
+      prev->numLeft++;
+      prev->numTotal++;
+    }
+    else /*  key >  curr->key */ {
+      curr = curr->right;
+      prev->numRight++;
+      prev->numTotal++;
+    }
+
+    /* The new key ends up somewhere in this subtree, so fold it into the
+     * summary now rather than making a second pass later.
+     */
+    prev->summary = Summary::combine(prev->summary, Summary::ofKey(key));
+  }
+
+  /* Step two: Make the new leaf and wire it into the tree. */
+  Node* node     = allocateNode();
+  node->key      = key;
+  node->balance  = Balance();
+  node->count    = 1;
+  node->left     = node->right = nullptr;
+  node->numTotal = 1;
+  node->numLeft  = node->numRight = 0;
+  node->summary  = Summary::ofKey(key);
+
+#if RBT_PARENT_POINTERS
+  node->parent   = prev; // Parent is the last node we saw
+#endif
+
+  if (prev == nullptr) {
+    root = node;
+  } else if (key < prev->key) {
+    prev->left = node;
+  } else /*  key > prev->key */ {
+    prev->right = node;
+  }
+  return node;
+}
+
+/* The successor (the leftmost node in the right subtree) has no left child, so
+ * either way the node we unlink has at most one child.
+ */
+template <typename Balance, typename Summary>
+typename TreeCore<Balance, Summary>::Node* TreeCore<Balance, Summary>::removeNode(Node* node, Path& path, Node*& child) {
+  if (node->left != nullptr && node->right != nullptr) {
+    path.push(node);
+    Node* successor = node->right;
+    while (successor->left != nullptr) {
+      path.push(successor);
+      successor = successor->left;
+    }
+
+    node->key   = successor->key;
+    node->count = successor->count;
+    node = successor;
+  }
+
+  /* Splice the node out, replacing it with its only child (if any), then fix
+   * the sizes and summaries of everything above it before anyone rotates.
+   */
+  child = node->left != nullptr? node->left : node->right;
+  replaceChild(path.up(1), node, child);
+  updateAlong(path);
+  return node;
+}
+
+/* The grandparent's subtree holds the same keys as before, so its sizes don't
+ * change.
+ */
+template <typename Balance, typename Summary>
+void TreeCore<Balance, Summary>::rotateUp(Node* node, Node* parent, Node* grandparent) {
+  Node* top = node == parent->left? rotateRight(parent) : rotateLeft(parent);
+  replaceChild(grandparent, parent, top);
+  rotations++;
+}
+
+template <typename Balance, typename Summary>
+void TreeCore<Balance, Summary>::replaceChild(Node* parent, Node* oldChild, Node* newChild) {
+  if (parent == nullptr) {
+    root = newChild;
+  } else if (parent->left == oldChild) {
+    parent->left = newChild;
+  } else {
+    parent->right = newChild;
+  }
+
+#if RBT_PARENT_POINTERS
+  if (newChild != nullptr) newChild->parent = parent;
+#endif
+}
+
+template <typename Balance, typename Summary>
+void TreeCore<Balance, Summary>::updateAlong(const Path& path) {
+  for (std::size_t i = path.depth; i > 0; i--) {
+    updateAugmentation(path.nodes[i - 1]);
+  }
+}
+
+/* The children are checked first, so that the sizes and summary at each node
+ * can be checked against its children's.
+ */
+template <typename Balance, typename Summary>
+void TreeCore<Balance, Summary>::checkSubtree(const Node* node, const Node* parent,
+                                              const int* low, const int* high) {
+  if (node == nullptr) return;
+
+  if ((low != nullptr && node->key <= *low) || (high != nullptr && node->key >= *high)) {
+    throw std::runtime_error("Tree keys are out of order.");
+  }
+  if (node->count == 0) {
+    throw std::runtime_error("A tree node holds no copies of its key.");
+  }
+#if RBT_PARENT_POINTERS
+  if (node->parent != parent) {
+    throw std::runtime_error("A tree node's parent pointer is wrong.");
+  }
+#else
+  (void) parent;
+#endif
+
+  checkSubtree(node->left,  node, low, &node->key);
+  checkSubtree(node->right, node, &node->key, high);
+
+  std::size_t numLeft  = node->left  ? node->left->numTotal  : 0;
+  std::size_t numRight = node->right ? node->right->numTotal : 0;
+  if (node->numLeft != numLeft || node->numRight != numRight ||
+      node->numTotal != numLeft + numRight + node->count) {
+    throw std::runtime_error("A tree node's subtree sizes are wrong.");
+  }
+
+  Summary expected = Summary::combine(summaryOf(node->left),
+                                      Summary::combine(Summary::ofKey(node->key, node->count),
+                                                       summaryOf(node->right)));
+  if (!(node->summary == expected)) {
+    throw std::runtime_error("A tree node's summary is wrong.");
+  }
+}
+
+template <typename Balance, typename Summary>
+void TreeCore<Balance, Summary>::addChunk(std::size_t length) {
+  chunks.push_back(allocateNodeChunk(length * sizeof(Node), nodeMemory));
+  capacity += chunks.back().bytes / sizeof(Node);
+
+  if (chunks.size() == 1) {
+    nextNode = nodesIn(chunks[0]);
+    chunkEnd = endOf(chunks[0]);
+  }
+}
+
+/* Hands out a node, reusing one that was previously released if possible. */
+template <typename Balance, typename Summary>
+typename TreeCore<Balance, Summary>::Node* TreeCore<Balance, Summary>::allocateNode() {
+  if (freeList != nullptr) {
+    Node* result = freeList;
+    freeList = freeList->left;
+    return result;
+  }
+
+  /* Move on to the next chunk, making a new one if we're out of chunks. */
+  if (nextNode == chunkEnd) {
+    if (currChunk + 1 == chunks.size() || chunks.empty()) {
+      std::size_t last = chunks.empty()? 0 : chunks.back().bytes / sizeof(Node);
+      addChunk(chunks.empty()? kMinChunkLength
+                             : (2 * last < kMaxChunkLength? 2 * last : kMaxChunkLength));
+    }
+    if (nextNode == chunkEnd) {
+      currChunk++;
+      nextNode = nodesIn(chunks[currChunk]);
+      chunkEnd = endOf(chunks[currChunk]);
+    }
+  }
+
+  return nextNode++;
+}
+
+/* Holds on to a node that's no longer in the tree so it can be reused. */
+template <typename Balance, typename Summary>
+void TreeCore<Balance, Summary>::releaseNode(Node* node) {
+  node->left = freeList;
+  freeList = node;
+}
+
+/* Every node that's been carved out of a chunk is either in the tree or on the
+ * free list, so all capacity beyond the live nodes is available. A single new
+ * chunk covers the shortfall.
+ */
+template <typename Balance, typename Summary>
+void TreeCore<Balance, Summary>::reserve(std::size_t numNodes) {
+  if (numNodes > capacity) {
+    std::size_t shortfall = numNodes - capacity;
+    addChunk(shortfall > kMinChunkLength? shortfall : kMinChunkLength);
+  }
+}
+
+template <typename Balance, typename Summary>
+void TreeCore<Balance, Summary>::forgetNodes() {
+  root     = nullptr;
+  freeList = nullptr;
+
+  currChunk = 0;
+  if (chunks.empty()) {
+    nextNode = chunkEnd = nullptr;
+  } else {
+    nextNode = nodesIn(chunks[0]);
+    chunkEnd = endOf(chunks[0]);
+  }
+}